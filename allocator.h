@@ -7,13 +7,58 @@
 
 #include <stdbool.h> // for bool
 #include <stddef.h>  // for size_t
+#include <string.h>  // for memset
 
-// Alignment requirement for all blocks
+// Alignment requirement for all blocks. A build may pass -DALIGNMENT=16 for
+// the 16-byte guarantee SSE types and long double need, as glibc gives
+#ifndef ALIGNMENT
 #define ALIGNMENT 8
+#endif
+#if ALIGNMENT < 8 || (ALIGNMENT & (ALIGNMENT - 1)) != 0
+#error "ALIGNMENT must be a power of two, at least 8"
+#endif
 
 // maximum size of block that must be accommodated
 #define MAX_REQUEST_SIZE (1 << 30)
 
+// Flags for mymalloc_flags. Every allocator honors MALLOC_ZERO; the others
+// are hints that an allocator may ignore.
+#define MALLOC_SHORT_LIVED   0x1   // expected to be freed soon
+#define MALLOC_LONG_LIVED    0x2   // expected to outlive most other blocks
+#define MALLOC_REALLOC_HEAVY 0x4   // expected to grow; reserve room to grow in place
+#define MALLOC_HOT           0x8   // accessed often; start it on a cache line
+#define MALLOC_ZERO          0x10  // zero-filled, like calloc
+
+// cache line size assumed by MALLOC_HOT
+#define CACHE_LINE_SIZE 64
+
+// extra room MALLOC_REALLOC_HEAVY reserves beyond the request. A
+// realloc-heavy block keeps it when myrealloc shrinks the block, and
+// reserves it again when the block has to move to grow.
+#define REALLOC_SLACK(size) ((size) / 2)
+
+// size plus its REALLOC_SLACK, or size alone if that would pass
+// MAX_REQUEST_SIZE
+static inline size_t realloc_reserve(size_t size) {
+    if (size > MAX_REQUEST_SIZE || REALLOC_SLACK(size) > MAX_REQUEST_SIZE - size) {
+        return size;
+    }
+    return size + REALLOC_SLACK(size);
+}
+
+// The part of mymalloc_flags every allocator shares. alloc gets the request,
+// with its slack for MALLOC_REALLOC_HEAVY, and the flags for any hints it
+// honors; the requested bytes are zeroed for MALLOC_ZERO.
+static inline void *malloc_flagged(void *(*alloc)(size_t size, unsigned flags),
+                                   size_t requested_size, unsigned flags) {
+    size_t size = (flags & MALLOC_REALLOC_HEAVY) ? realloc_reserve(requested_size)
+                                                 : requested_size;
+    void *ptr = alloc(size, flags);
+    if (ptr != NULL && (flags & MALLOC_ZERO)) {
+        memset(ptr, 0, requested_size);
+    }
+    return ptr;
+}
 
 
 /* Function: myinit
@@ -27,6 +72,15 @@
  */
 bool myinit(void *heap_start, size_t heap_size);
 
+/* Function: myconfig
+ * ------------------
+ * Sets an allocator-specific tuning option, such as the placement
+ * policy, by name. Options take effect at the next call to myinit.
+ * Returns true if the allocator recognizes the key and accepts the
+ * value, or false otherwise. Allocators without options return false.
+ */
+bool myconfig(const char *key, const char *value);
+
 /* Function: mymalloc
  * ------------------
  * Custom version of malloc.
@@ -34,6 +88,15 @@ bool myinit(void *heap_start, size_t heap_size);
 void *mymalloc(size_t requested_size);
 
 
+/* Function: mymalloc_flags
+ * ------------------------
+ * Custom version of malloc that takes a bitwise OR of MALLOC_* flags
+ * describing how the block will be used. mymalloc_flags(size, 0) behaves
+ * like mymalloc(size).
+ */
+void *mymalloc_flags(size_t requested_size, unsigned flags);
+
+
 /* Function: myrealloc
  * -------------------
  * Custom version of realloc.
@@ -48,6 +111,16 @@ void *myrealloc(void *old_ptr, size_t new_size);
 void myfree(void *ptr);
 
 
+/* Function: myusable_size
+ * -----------------------
+ * Returns how many bytes starting at ptr the client may use, which is at
+ * least the size it asked for.  Returns 0 if ptr is NULL or not the start
+ * of a block, or if the allocator does not track block sizes.  As with
+ * glibc's malloc_usable_size, the result for a freed block is undefined.
+ */
+size_t myusable_size(void *ptr);
+
+
 /* Function: validate_heap
  * -----------------------
  * This is the hook for your heap consistency checker. Returns true
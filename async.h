@@ -0,0 +1,37 @@
+/* File: async.h
+ * -------------
+ * Interface to asynchronous frees in the striped allocator. A thread that
+ * frees many blocks at once, such as a whole object graph, hands them to a
+ * background thread instead of merging each one with its neighbours
+ * itself. The pointers go into a ring owned by the calling thread, which
+ * the background thread empties in batches. It sorts each batch by
+ * address and frees every run of adjacent blocks as one block, so a run
+ * costs one round of locking and merging.
+ *
+ * Only the striped allocator provides these functions.
+ */
+
+#ifndef _ASYNC_H
+#define _ASYNC_H
+
+/* Function: myfree_async
+ * ----------------------
+ * Frees the block at ptr later, on the background thread, which starts on
+ * the first call. Pointers that are not allocated blocks when queued are
+ * ignored, but queuing the same block twice is undefined, as with any
+ * double free: by the time the second copy is drained, the block may have
+ * been merged with its neighbours or handed out again. When the calling
+ * thread's ring is full, myconfig's "async_full" decides what happens:
+ * "sync" (the default) frees the block at once on the calling thread, and
+ * "wait" waits until the background thread makes room.
+ */
+void myfree_async(void *ptr);
+
+/* Function: myfree_flush
+ * ----------------------
+ * Returns once every block passed to myfree_async so far, by any thread,
+ * has been freed.
+ */
+void myfree_flush(void);
+
+#endif
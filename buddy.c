@@ -0,0 +1,468 @@
+/* File: buddy.c
+ * -------------
+ * A binary buddy allocator. The segment is carved into power-of-two blocks
+ * (orders MIN_ORDER..MAX_ORDER); a request is rounded up to the next power
+ * of two and served from the smallest non-empty per-order free list,
+ * splitting larger blocks in half as needed. Freeing a block merges it with
+ * its buddy (the other half of its parent, found by flipping one address
+ * bit) for as long as the buddy is free too. Both are O(log n) in the
+ * segment size, with no list walks.
+ *
+ * Blocks carry no header. All bookkeeping lives in two bitmaps kept outside
+ * the segment: a split bit per block that has been halved, used to recover
+ * the order of a freed pointer by descending from the root, and a pair bit
+ * per buddy pair holding free(left) XOR free(right), which tells free in
+ * O(1) whether to merge. Bits below an unsplit block are never read, so
+ * they are (re)initialized on split and myinit only touches the roots. A
+ * third bitmap has a bit per MIN_ORDER granule, set at the start of each
+ * realloc-heavy block; mymalloc clears it for every block it hands out.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "./allocator.h"
+#include "./debug_break.h"
+
+// smallest block: room for the two free-list links
+#define MIN_ORDER 4
+// largest block (and root): 2 GiB, enough for MAX_REQUEST_SIZE
+#define MAX_ORDER 31
+#define NUM_ORDERS (MAX_ORDER + 1)
+// the bitmaps cover at most 4 GiB of segment; the rest is left unused
+#define MAX_SPAN_ORDER 32
+
+// Each bitmap needs fewer than span >> MIN_ORDER bits over all orders.
+// They are sized for the largest span, but untouched pages cost nothing.
+#define MAP_WORDS ((1UL << (MAX_SPAN_ORDER - MIN_ORDER)) / 64)
+
+typedef struct free_block {
+    struct free_block *next;
+    struct free_block *prev;
+} free_block_t;
+
+static uint8_t *g_heap;
+static size_t g_span;              // bytes covered by roots
+static int g_root_order;           // order of the top-level blocks
+static size_t g_allocated;         // bytes in allocated blocks
+static free_block_t *g_free[NUM_ORDERS];
+static uint64_t g_nonempty;        // bit k set when g_free[k] is non-empty
+
+static uint64_t g_split[MAP_WORDS];
+static uint64_t g_pair[MAP_WORDS];
+static uint64_t g_heavy[MAP_WORDS];
+static size_t g_split_base[NUM_ORDERS + 1];
+static size_t g_pair_base[NUM_ORDERS];
+
+
+// size of a block of the given order
+static inline size_t order_size(int order) {
+    return (size_t)1 << order;
+}
+
+// smallest order whose blocks hold size bytes
+static inline int order_for(size_t size) {
+    if (size <= order_size(MIN_ORDER)) {
+        return MIN_ORDER;
+    }
+    return 64 - __builtin_clzl(size - 1);
+}
+
+static inline size_t offset_of(const void *p) {
+    return (size_t)((const uint8_t *)p - g_heap);
+}
+
+// Bitmap access
+static inline bool bit_test(const uint64_t *map, size_t i) {
+    return (map[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void bit_assign(uint64_t *map, size_t i, bool value) {
+    if (value) {
+        map[i / 64] |= 1UL << (i % 64);
+    } else {
+        map[i / 64] &= ~(1UL << (i % 64));
+    }
+}
+
+// toggles bit i and returns its new value
+static inline bool bit_toggle(uint64_t *map, size_t i) {
+    map[i / 64] ^= 1UL << (i % 64);
+    return bit_test(map, i);
+}
+
+// Split bits exist for orders above MIN_ORDER, pair bits below the root
+static inline size_t split_index(int order, size_t off) {
+    return g_split_base[order] + (off >> order);
+}
+
+static inline size_t pair_index(int order, size_t off) {
+    return g_pair_base[order] + (off >> (order + 1));
+}
+
+static inline bool is_split(int order, size_t off) {
+    return order > MIN_ORDER && bit_test(g_split, split_index(order, off));
+}
+
+static inline void set_split(int order, size_t off, bool value) {
+    if (order > MIN_ORDER) {
+        bit_assign(g_split, split_index(order, off), value);
+    }
+}
+
+// Free lists
+static void list_push(void *p, int order) {
+    free_block_t *b = p;
+    b->prev = NULL;
+    b->next = g_free[order];
+    if (b->next != NULL) {
+        b->next->prev = b;
+    }
+    g_free[order] = b;
+    g_nonempty |= 1UL << order;
+}
+
+static void list_remove(void *p, int order) {
+    free_block_t *b = p;
+    if (b->prev != NULL) {
+        b->prev->next = b->next;
+    } else {
+        g_free[order] = b->next;
+    }
+    if (b->next != NULL) {
+        b->next->prev = b->prev;
+    }
+    if (g_free[order] == NULL) {
+        g_nonempty &= ~(1UL << order);
+    }
+}
+
+// Descends from the root to the unsplit block containing offset off
+static int block_order(size_t off) {
+    int order = g_root_order;
+    while (is_split(order, off)) {
+        order--;
+    }
+    return order;
+}
+
+// Halves the block at off until it has the target order; the upper halves
+// go on the free lists and the lower half stays allocated
+static void split_down(size_t off, int order, int target) {
+    while (order > target) {
+        set_split(order, off, true);
+        order--;
+        size_t upper = off + order_size(order);
+        set_split(order, off, false);
+        set_split(order, upper, false);
+        bit_assign(g_pair, pair_index(order, off), true);
+        list_push(g_heap + upper, order);
+    }
+}
+
+
+// no tunable options
+bool myconfig(const char *key, const char *value) {
+    return false;
+}
+
+/* Function: myinit
+ * ----------------
+ * Lays the segment out as a row of root blocks of the largest order that
+ * fits (at most MAX_ORDER), and computes where each order's bits start in
+ * the bitmaps. Any tail shorter than a root is left unused.
+ */
+bool myinit(void *heap_start, size_t heap_size) {
+    if (heap_start == NULL) {
+        return false;
+    }
+    if (heap_size > order_size(MAX_SPAN_ORDER)) {
+        heap_size = order_size(MAX_SPAN_ORDER);
+    }
+    if (heap_size < order_size(MIN_ORDER)) {
+        return false;
+    }
+    g_heap = heap_start;
+    g_root_order = 63 - __builtin_clzl(heap_size);
+    if (g_root_order > MAX_ORDER) {
+        g_root_order = MAX_ORDER;
+    }
+    g_span = heap_size & ~(order_size(g_root_order) - 1);
+    g_allocated = 0;
+    g_nonempty = 0;
+    memset(g_free, 0, sizeof(g_free));
+
+    size_t split_base = 0;
+    size_t pair_base = 0;
+    for (int order = MIN_ORDER; order <= g_root_order; order++) {
+        g_split_base[order] = split_base;
+        g_pair_base[order] = pair_base;
+        if (order > MIN_ORDER) {
+            split_base += g_span >> order;
+        }
+        pair_base += g_span >> (order + 1);
+    }
+
+    // push in reverse so the lowest root is handed out first
+    for (size_t off = g_span; off > 0; ) {
+        off -= order_size(g_root_order);
+        set_split(g_root_order, off, false);
+        list_push(g_heap + off, g_root_order);
+    }
+    return true;
+}
+
+/* Function: mymalloc
+ * ------------------
+ * Takes a block from the smallest non-empty free list at or above the
+ * needed order (one bit scan over g_nonempty) and splits it down.
+ */
+void *mymalloc(size_t requested_size) {
+    if (requested_size == 0 || requested_size > MAX_REQUEST_SIZE || g_heap == NULL) {
+        return NULL;
+    }
+    int order = order_for(requested_size);
+    uint64_t avail = g_nonempty & ~(order_size(order) - 1);
+    if (avail == 0) {
+        return NULL;
+    }
+    int found = __builtin_ctzl(avail);
+    free_block_t *b = g_free[found];
+    size_t off = offset_of(b);
+    list_remove(b, found);
+    if (found < g_root_order) {
+        bit_toggle(g_pair, pair_index(found, off));
+    }
+    split_down(off, found, order);
+    bit_assign(g_heavy, off >> MIN_ORDER, false);
+    g_allocated += order_size(order);
+    return b;
+}
+
+// Allocation step of mymalloc_flags: a hot block is at least a line long,
+// and realloc-heavy blocks are marked to keep their slack through myrealloc
+static void *malloc_hinted(size_t size, unsigned flags) {
+    if ((flags & MALLOC_HOT) && size != 0 && size < CACHE_LINE_SIZE) {
+        size = CACHE_LINE_SIZE;
+    }
+    void *ptr = mymalloc(size);
+    if (ptr != NULL && (flags & MALLOC_REALLOC_HEAVY)) {
+        bit_assign(g_heavy, offset_of(ptr) >> MIN_ORDER, true);
+    }
+    return ptr;
+}
+
+/* Function: mymalloc_flags
+ * ------------------------
+ * Every block is aligned to its own size, so a hot block only needs to be
+ * at least a cache line long. Realloc-heavy blocks reserve slack before
+ * rounding, and zeroed blocks are cleared up to the request.
+ */
+void *mymalloc_flags(size_t requested_size, unsigned flags) {
+    return malloc_flagged(malloc_hinted, requested_size, flags);
+}
+
+/* Function: myfree
+ * ----------------
+ * Returns the block to its free list, first merging it with its buddy at
+ * each order where the pair bit shows the buddy is free as well.
+ */
+void myfree(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    size_t off = offset_of(ptr);
+    if ((uint8_t *)ptr < g_heap || off >= g_span || off % order_size(MIN_ORDER) != 0) {
+        return;
+    }
+    int order = block_order(off);
+    if (off % order_size(order) != 0) {
+        return;  // not the start of a block
+    }
+    g_allocated -= order_size(order);
+    while (order < g_root_order) {
+        if (bit_toggle(g_pair, pair_index(order, off))) {
+            break;  // buddy is in use
+        }
+        list_remove(g_heap + (off ^ order_size(order)), order);
+        off &= ~order_size(order);
+        order++;
+        set_split(order, off, false);
+    }
+    list_push(g_heap + off, order);
+}
+
+/* Function: myrealloc
+ * -------------------
+ * Shrinks in place by freeing upper halves. Grows in place when the block
+ * is the lower buddy at every order up to the target and each upper buddy
+ * is free; otherwise falls back to malloc/copy/free.
+ */
+void *myrealloc(void *old_ptr, size_t new_size) {
+    if (old_ptr == NULL) {
+        return mymalloc(new_size);
+    }
+    if (new_size == 0) {
+        myfree(old_ptr);
+        return NULL;
+    }
+    if (new_size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+    size_t off = offset_of(old_ptr);
+    int order = block_order(off);
+    int target = order_for(new_size);
+
+    // a realloc-heavy block keeps the halves its slack needs when it shrinks,
+    // and reserves its slack again when it has to move
+    bool heavy = bit_test(g_heavy, off >> MIN_ORDER);
+    if (target <= order) {
+        int keep = heavy ? order_for(realloc_reserve(new_size)) : target;
+        if (keep < order) {
+            split_down(off, order, keep);
+            g_allocated -= order_size(order) - order_size(keep);
+        }
+        return old_ptr;
+    }
+
+    bool can_grow = target <= g_root_order && off % order_size(target) == 0;
+    // with this block allocated, a set pair bit means the buddy is free
+    for (int k = order; can_grow && k < target; k++) {
+        can_grow = bit_test(g_pair, pair_index(k, off));
+    }
+    if (can_grow) {
+        for (int k = order; k < target; k++) {
+            list_remove(g_heap + off + order_size(k), k);
+            set_split(k + 1, off, false);
+        }
+        g_allocated += order_size(target) - order_size(order);
+        return old_ptr;
+    }
+
+    void *new_ptr = heavy ? mymalloc_flags(new_size, MALLOC_REALLOC_HEAVY) : mymalloc(new_size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, old_ptr, order_size(order));
+    myfree(old_ptr);
+    return new_ptr;
+}
+
+// Whether b is linked into the free list of its order. A free block's
+// neighbours are free blocks of the same order, so each link is checked
+// to point at one before it is followed.
+static bool on_free_list(const free_block_t *b, int order) {
+    if (b->prev == NULL) {
+        return g_free[order] == b;
+    }
+    size_t prev = offset_of(b->prev);
+    return (uint8_t *)b->prev >= g_heap && prev < g_span && prev % order_size(order) == 0 &&
+           block_order(prev) == order && b->prev->next == b;
+}
+
+// Whether the unsplit block of the given order at off is free. Below the
+// root its pair bit is clear when it and its buddy are both in use, and
+// set when exactly one is free; a split buddy is in use, so then the block
+// is free. Otherwise the free one of the two is on the free list.
+static bool block_free(size_t off, int order) {
+    if (order < g_root_order) {
+        if (!bit_test(g_pair, pair_index(order, off))) {
+            return false;
+        }
+        if (is_split(order, off ^ order_size(order))) {
+            return true;
+        }
+    }
+    return on_free_list((const free_block_t *)(g_heap + off), order);
+}
+
+/* Function: myusable_size
+ * ------------------------
+ * The whole power-of-two block is usable; its order comes from the split
+ * bits, so interior pointers are recognized and rejected, and the pair
+ * bits tell a free block from an allocated one.
+ */
+size_t myusable_size(void *ptr) {
+    size_t off = offset_of(ptr);
+    if (ptr == NULL || (uint8_t *)ptr < g_heap || off >= g_span) {
+        return 0;
+    }
+    int order = block_order(off);
+    if (off % order_size(order) != 0 || block_free(off, order)) {
+        return 0;
+    }
+    return order_size(order);
+}
+
+/* Function: validate_heap
+ * -----------------------
+ * Checks every free list: links are consistent, each block is aligned to
+ * its order, the split bits lead to it at that order, and its pair bit
+ * shows an unmerged buddy. Free plus allocated bytes must cover the span.
+ */
+bool validate_heap() {
+    if (g_heap == NULL) {
+        return false;
+    }
+    size_t free_bytes = 0;
+    for (int order = MIN_ORDER; order <= g_root_order; order++) {
+        bool nonempty = (g_nonempty >> order) & 1;
+        if (nonempty != (g_free[order] != NULL)) {
+            printf("order %d: non-empty mask disagrees with list\n", order);
+            breakpoint();
+            return false;
+        }
+        free_block_t *prev = NULL;
+        for (free_block_t *b = g_free[order]; b != NULL; b = b->next) {
+            size_t off = offset_of(b);
+            if ((uint8_t *)b < g_heap || off >= g_span || off % order_size(order) != 0) {
+                printf("order %d: free block %p misplaced\n", order, b);
+                breakpoint();
+                return false;
+            }
+            if (b->prev != prev || block_order(off) != order) {
+                printf("order %d: free block %p has bad links or split bits\n", order, b);
+                breakpoint();
+                return false;
+            }
+            if (order < g_root_order && !bit_test(g_pair, pair_index(order, off))) {
+                printf("order %d: free block %p has a free buddy\n", order, b);
+                breakpoint();
+                return false;
+            }
+            free_bytes += order_size(order);
+            if (free_bytes > g_span) {
+                printf("order %d: free list cycle\n", order);
+                breakpoint();
+                return false;
+            }
+            prev = b;
+        }
+    }
+    if (free_bytes + g_allocated != g_span) {
+        printf("free %zu + allocated %zu != span %zu\n", free_bytes, g_allocated, g_span);
+        breakpoint();
+        return false;
+    }
+    return true;
+}
+
+/* Function: dump_heap
+ * -------------------
+ * This function is not called anywhere, but is useful from gdb. It prints
+ * the span, the allocated total, and every free block by order.
+ */
+void dump_heap(void) {
+    printf("HEAP [%p .. %p) roots of order %d, %zu bytes allocated\n",
+           g_heap, g_heap + g_span, g_root_order, g_allocated);
+    for (int order = MIN_ORDER; order <= g_root_order; order++) {
+        if (g_free[order] == NULL) {
+            continue;
+        }
+        printf("order %2d (%zu bytes):", order, order_size(order));
+        for (free_block_t *b = g_free[order]; b != NULL; b = b->next) {
+            printf(" +%zu", offset_of(b));
+        }
+        printf("\n");
+    }
+}
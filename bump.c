@@ -9,6 +9,7 @@
  * This shows the very simplest of approaches; there are better options!
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +36,14 @@ bool myinit(void *heap_start, size_t heap_size) {
     return true;
 }
 
+/* Function: myconfig
+ * ------------------
+ * The bump allocator has nothing to tune, so every option is rejected.
+ */
+bool myconfig(const char *key, const char *value) {
+    return false;
+}
+
 /* Function: roundup
  * -----------------
  * This function rounds up the given number to the given multiple, which
@@ -60,12 +69,41 @@ void *mymalloc(size_t requested_size) {
     return ptr;
 }
 
+/* Function: mymalloc_flags
+ * ------------------------
+ * A hot block starts at the next cache line; the bytes skipped are wasted
+ * like everything else here. The segment is fresh memory, but zeroing is
+ * done anyway so the flag does not depend on that.
+ */
+void *mymalloc_flags(size_t requested_size, unsigned flags) {
+    if (flags & MALLOC_HOT) {
+        uintptr_t start = (uintptr_t)segment_start;
+        size_t aligned = roundup(start + nused, CACHE_LINE_SIZE) - start;
+        if (aligned <= segment_size) {
+            nused = aligned;
+        }
+    }
+    void *ptr = mymalloc(requested_size);
+    if (ptr != NULL && (flags & MALLOC_ZERO)) {
+        memset(ptr, 0, requested_size);
+    }
+    return ptr;
+}
+
 /* Function: myfree
  * ----------------
  * This function does nothing - fast!... but sad :(
  */
 void myfree(void *ptr) {}
 
+/* Function: myusable_size
+ * ------------------------
+ * The bump allocator keeps no record of block sizes, so it cannot tell.
+ */
+size_t myusable_size(void *ptr) {
+    return 0;
+}
+
 /* Function: realloc
  * -----------------
  * This function satisfies requests for resizing previously-allocated memory
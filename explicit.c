@@ -2,26 +2,304 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+// The THREAD_SAFE build renames every public function here, and defines
+// the public names at the end of the file as wrappers that call the
+// renamed ones under g_lock. Calls from inside the allocator go straight to
+// the renamed functions, so nothing takes the lock twice.
+#ifdef THREAD_SAFE
+#define myinit unlocked_myinit
+#define myconfig unlocked_myconfig
+#define mymalloc unlocked_mymalloc
+#define mymalloc_flags unlocked_mymalloc_flags
+#define mymalloc_lifetime unlocked_mymalloc_lifetime
+#define myrealloc unlocked_myrealloc
+#define myfree unlocked_myfree
+#define myusable_size unlocked_myusable_size
+#define validate_heap unlocked_validate_heap
+#define hmalloc unlocked_hmalloc
+#define hlock unlocked_hlock
+#define hunlock unlocked_hunlock
+#define hfree unlocked_hfree
+#define hcompact unlocked_hcompact
+#define hlargest_free unlocked_hlargest_free
+#endif
+
 #include "./allocator.h"
 #include "./debug_break.h"
+#include "./handle.h"
+#include "./lifetime.h"
+#ifdef THREAD_SAFE
+#include "./lock.h"
+#include "./stats.h"
+#endif
+
+// Free-list links are full pointers, or with COMPACT_LINKS 32-bit offsets
+// from g_heap_base in ALIGNMENT units. Compact links halve the space a free
+// block needs for them, so the smallest block shrinks to a header and one
+// granule; they reach 4 Gi granules (32 GiB of heap with 8-byte alignment).
+#ifdef COMPACT_LINKS
+typedef uint32_t link_t;
+#define LINK_NULL UINT32_MAX
+#else
+typedef void *link_t;
+#endif
+
+// Block headers are a size_t, or with COMPACT_HEADERS 32 bits. Either way a
+// header holds the block size in ALIGNMENT granules above FLAG_BITS flag
+// bits. A header shorter than ALIGNMENT sits at the end of a granule, so
+// every block starts HDR_PAD bytes past an ALIGNMENT boundary and payloads
+// stay aligned. A compact header has no room for FLAG_REALLOC.
+#ifdef COMPACT_HEADERS
+typedef uint32_t hdr_t;
+#define FLAG_BITS 3
+#else
+typedef size_t hdr_t;
+#define FLAG_BITS 4
+#endif
 
 // Memory layout constants
-static const size_t HDR_SIZE = sizeof(size_t);                  // Size of block header
-static const size_t PTR_SIZE = sizeof(void *);                  // Size of pointer
-static const size_t FREE_NODE_OVERHEAD = 2 * sizeof(void *);    // Space for prev/next pointers
+static const size_t HDR_SIZE = sizeof(hdr_t);                   // Size of block header
+static const size_t HDR_PAD = (ALIGNMENT - sizeof(hdr_t) % ALIGNMENT) % ALIGNMENT;
+static const size_t LINK_SIZE = sizeof(link_t);                 // Size of a free-list link
+static const size_t FREE_NODE_OVERHEAD = 2 * sizeof(link_t);    // Space for prev/next links
 static const size_t MIN_PAYLOAD = (FREE_NODE_OVERHEAD > ALIGNMENT) ? FREE_NODE_OVERHEAD : ALIGNMENT;
-static const size_t MIN_BLOCK = sizeof(size_t) + MIN_PAYLOAD;   // Minimum block size including header
+static const size_t MIN_BLOCK =                                 // Minimum block size including header
+    (sizeof(hdr_t) + MIN_PAYLOAD + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+static const size_t TINY_BLOCK =                                // Smallest block with tiny bins, room for a bin link
+    (sizeof(hdr_t) + sizeof(void *) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+// Header flags
+static const hdr_t FLAG_ALLOC = 1;                              // Allocation flag (LSB)
+static const hdr_t FLAG_QUICK = 2;                              // Allocated block parked on a quick list
+static const hdr_t FLAG_HANDLE = 4;                             // Relocatable block owned by a handle
+static const hdr_t FLAG_REALLOC = FLAG_BITS > 3 ? 8 : 0;        // Realloc-heavy block that keeps its slack
+
+// Placement policies; all of them share the block and free-list primitives
+// below and differ only in which fitting free block find_fit picks
+typedef enum {
+    FIT_FIRST,          // first block in list order that fits
+    FIT_NEXT,           // first fit, resuming where the previous search stopped
+    FIT_BEST,           // smallest fitting block in the whole list
+    FIT_GOOD,           // smallest among the first GOOD_FIT_K fitting blocks
+    FIT_SEGREGATED      // first fit within per-size-class lists
+} fit_policy_t;
+
+// Tuning defaults. Each one can be changed per run through myconfig unless
+// TUNING_FIXED is defined, which makes them compile-time constants (the
+// variant matrix in the Makefile). USE_TUNED_CONFIG takes the defaults from
+// explicit_tuned.h, the header written by tune.py.
+#ifdef USE_TUNED_CONFIG
+#include "./explicit_tuned.h"
+#endif
+
+// Placement policy
+#ifndef FIT_POLICY
+#define FIT_POLICY FIT_FIRST
+#endif
+
+// Number of fitting candidates good-fit examines before settling
+#ifndef GOOD_FIT_K
+#define GOOD_FIT_K 8
+#endif
+
+// Smallest remainder split off a block (never below MIN_BLOCK)
+#ifndef SPLIT_THRESHOLD
+#define SPLIT_THRESHOLD 0
+#endif
+
+// Freed blocks of up to QUICK_MAX_BLOCK bytes parked per exact-size quick
+// list, bypassing coalescing and search (0 disables the quick lists)
+#ifndef QUICK_DEPTH
+#define QUICK_DEPTH 0
+#endif
+#define QUICK_MAX_BLOCK 256
+
+// Nonzero leaves freed blocks unmerged; runs of free blocks are then merged
+// in one sweep when a search fails, and also every COALESCE_AFTER frees if
+// that is nonzero
+#ifndef COALESCE_DEFERRED
+#define COALESCE_DEFERRED 0
+#endif
+#ifndef COALESCE_AFTER
+#define COALESCE_AFTER 0
+#endif
+
+// Upper bounds (inclusive) of the block sizes held by each segregated list;
+// a final class takes everything larger
+#ifndef SIZE_CLASSES
+#define SIZE_CLASSES 32, 48, 64, 96, 128, 192, 256, 512, 1024, 2048, 4096, 8192, \
+    16384, 65536, 262144, 1048576
+#endif
+#define MAX_CLASSES 32
 
-// Header flags and masks
-static const size_t FLAG_ALLOC = (size_t)1;                     // Allocation flag (LSB)
-static const size_t SIZE_MASK = ~(ALIGNMENT - 1);               // Mask to extract size from header
+// Bytes the compactor may move per hmalloc (0 compacts only in hcompact)
+#ifndef COMPACT_STEP
+#define COMPACT_STEP 4096
+#endif
+
+// Nonzero keeps blocks predicted short-lived and long-lived in separate
+// regions; a size bucket is predicted long-lived once its estimated mean
+// lifetime exceeds LIFETIME_RATIO percent of the mean over all blocks
+#ifndef LIFETIME_SEGREGATION
+#define LIFETIME_SEGREGATION 0
+#endif
+#ifndef LIFETIME_RATIO
+#define LIFETIME_RATIO 150
+#endif
+
+// Nonzero serves blocks smaller than LARGE_MIN bytes from the low end of the
+// heap and the rest from the high end, the two growing toward each other
+#ifndef TWO_ENDED
+#define TWO_ENDED 0
+#endif
+#ifndef LARGE_MIN
+#define LARGE_MIN 1024
+#endif
+
+// Nonzero lets small requests take blocks below MIN_BLOCK, down to
+// TINY_BLOCK. Freed, these go on exact-size singly linked bins that are never
+// coalesced in place; they are merged in bulk when a search fails or is
+// about to cut into the top of the heap
+#ifndef TINY_BINS
+#define TINY_BINS 0
+#endif
+
+// A cut into the top of the heap merges the tiny bins only once the
+// searches since the last merge, times TINY_WALK_BUDGET, cover the blocks
+// that merge walked, so the heap walks cost at most that many blocks per
+// search
+#ifndef TINY_WALK_BUDGET
+#define TINY_WALK_BUDGET 64
+#endif
+
+// Nonzero prefetches the next free block while a search examines the
+// current one. Off by default: the next iteration loads that block after
+// one compare, so the prefetch hides almost nothing.
+#ifndef PREFETCH
+#define PREFETCH 0
+#endif
+
+// FREELIST_ADDR_ORDER (compile time only) keeps every free list sorted by
+// address instead of LIFO
+
+// Run-time tuning state
+typedef struct {
+    fit_policy_t policy;
+    size_t good_fit_k;
+    size_t split_threshold;
+    size_t quick_depth;
+    bool deferred;
+    size_t coalesce_after;
+    size_t compact_step;
+    bool lifetime;
+    size_t lifetime_ratio;
+    bool two_ended;
+    size_t large_min;
+    bool tiny;
+    bool prefetch;
+    size_t num_classes;                 // including the final catch-all class
+    size_t class_limits[MAX_CLASSES];
+} tuning_t;
+
+#define DEFAULT_TUNING {                                                    \
+    .policy = FIT_POLICY,                                                   \
+    .good_fit_k = GOOD_FIT_K,                                               \
+    .split_threshold = SPLIT_THRESHOLD,                                     \
+    .quick_depth = QUICK_DEPTH,                                             \
+    .deferred = COALESCE_DEFERRED,                                          \
+    .coalesce_after = COALESCE_AFTER,                                       \
+    .compact_step = COMPACT_STEP,                                           \
+    .lifetime = LIFETIME_SEGREGATION,                                       \
+    .lifetime_ratio = LIFETIME_RATIO,                                       \
+    .two_ended = TWO_ENDED,                                                 \
+    .large_min = LARGE_MIN,                                                 \
+    .tiny = TINY_BINS,                                                      \
+    .prefetch = PREFETCH,                                                   \
+    .num_classes = sizeof((size_t[]){SIZE_CLASSES}) / sizeof(size_t) + 1,   \
+    .class_limits = {SIZE_CLASSES, SIZE_MAX}                                \
+}
+
+// myconfig edits g_next_tuning and myinit makes it current. In a fixed build
+// the tuning is a constant and the placement policy a literal.
+#ifdef TUNING_FIXED
+static const tuning_t g_tuning = DEFAULT_TUNING;
+#define g_policy ((fit_policy_t)FIT_POLICY)
+#else
+static tuning_t g_tuning = DEFAULT_TUNING;
+static tuning_t g_next_tuning = DEFAULT_TUNING;
+#define g_policy (g_tuning.policy)
+#endif
+
+// Lifetime classes; each has its own free lists and, with lifetime
+// segregation on, its own regions of the heap. In two-ended mode the two
+// sets of lists belong to the two ends of the heap instead.
+enum { LIFE_SHORT, LIFE_LONG, NUM_LIFETIMES };
+enum { END_LOW = LIFE_SHORT, END_HIGH = LIFE_LONG };
 
 // Global heap management variables
 static uint8_t *g_heap_base = NULL;     // Pointer to the beginning of the heap
 static size_t g_heap_size = 0;          // Total size of the heap
-static void *g_free_head = NULL;        // Head of the free blocks linked list
+static void *g_free_lists[NUM_LIFETIMES][MAX_CLASSES]; // Free list heads (only [0] unless segregated)
+static void *g_rover[NUM_LIFETIMES];    // Next-fit resume point within each g_free_lists[l][0]
+static void *g_quick[QUICK_MAX_BLOCK / ALIGNMENT + 1];      // Quick lists (and tiny bins) by block size
+static size_t g_quick_len[QUICK_MAX_BLOCK / ALIGNMENT + 1]; // Blocks on each quick list
+static size_t g_frees_since_sweep = 0;  // Frees left unmerged since the last sweep
+static size_t g_tiny_fresh = 0;         // Tiny blocks parked since the last consolidation
+static size_t g_tiny_walked = 0;        // Blocks the last consolidation walked
+static size_t g_tiny_searches = 0;      // Free-list searches since the last consolidation
+
+// Handles: a relocatable block starts its payload with a link back to its
+// handle, and the client's bytes follow it
+#define MAX_HANDLES 65536
+#define COMPACT_VISIT_LIMIT 256                 // blocks one compaction step may visit
+static const size_t HANDLE_LINK = (sizeof(void *) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+struct handle {
+    void *hdr;                  // header of the block, NULL while the handle is free
+    unsigned pins;              // outstanding hlock calls
+    struct handle *next_free;
+};
+static struct handle g_handles[MAX_HANDLES];
+static size_t g_handles_used = 0;       // handles ever handed out since myinit
+static struct handle *g_handle_free = NULL;
+static void *g_compact_cursor = NULL;   // block the next compaction step starts at
+
+// Lifetime regions: with segregation on, the heap is claimed bottom-up in
+// REGION_SIZE regions, each owned by one lifetime class. The unclaimed rest
+// is one free block, the wilderness, on no free list. Free blocks merge only
+// within a lifetime's regions.
+#define REGION_SHIFT 14
+#define REGION_SIZE ((size_t)1 << REGION_SHIFT)
+#define MAX_REGIONS ((size_t)1 << 18)           // 4 GiB of regions
+static uint8_t g_region_owner[MAX_REGIONS];
+static size_t g_regions_claimed = 0;
+static void *g_wild = NULL;             // the wilderness block, NULL when used up
+
+// Two-ended mode: the low end owns the heap below g_low_end and the high end
+// the heap from g_high_start up; the wilderness lies between them
+static uint8_t *g_low_end = NULL;
+static uint8_t *g_high_start = NULL;
+
+// Online lifetime estimate per size bucket and over all blocks. By Little's law the
+// mean lifetime, counted in allocations, is the time-averaged number of
+// live blocks divided by the allocation rate: the area under the live count
+// over the allocations made. Both are halved every LIFETIME_WINDOW
+// allocations so the estimate follows phase changes.
+#define LIFETIME_BUCKETS (LIFETIME_EXACT_MAX / ALIGNMENT + 64)
+#define LIFETIME_EXACT_MAX 1024
+#define LIFETIME_WINDOW 4096
+#define LIFETIME_MIN_SAMPLES 16
+typedef struct {
+    uint64_t area;              // sum over allocations of the live count
+    uint64_t allocs;
+    uint64_t live;
+    uint64_t stamp;             // g_clock when area was last brought up to date
+} life_stats_t;
+static life_stats_t g_life[LIFETIME_BUCKETS];
+static life_stats_t g_life_all;         // every block, whatever its size
+static uint64_t g_clock = 0;            // allocations since myinit
 
 // Helper function to get the end of the heap
 static inline uint8_t *heap_end(void) {
@@ -38,18 +316,18 @@ static inline size_t align_up(size_t n) {
 }
 
 // Get raw header value without any processing
-static inline size_t hdr_raw(void *hdr) {
-    return *(size_t *)hdr;
+static inline hdr_t hdr_raw(void *hdr) {
+    return *(hdr_t *)hdr;
 }
 
 // Write header with size and allocation status
 static inline void hdr_write(void *hdr, size_t size, bool alloc) {
-    *(size_t *)hdr = (size & SIZE_MASK) | (alloc ? FLAG_ALLOC : 0);
+    *(hdr_t *)hdr = (hdr_t)((size / ALIGNMENT) << FLAG_BITS) | (alloc ? FLAG_ALLOC : 0);
 }
 
 // Extract block size from header
 static inline size_t blk_size(void *hdr) {
-    return hdr_raw(hdr) & SIZE_MASK;
+    return (size_t)(hdr_raw(hdr) >> FLAG_BITS) * ALIGNMENT;
 }
 
 // Check if block is allocated
@@ -82,50 +360,150 @@ static inline void *blk_next(void *hdr) {
     return (void *)heap_end();
 }
 
-// Get pointer to the previous pointer field in a free block
-static inline void **free_prevp(void *hdr) {
-    return (void **)((uint8_t *)hdr + HDR_SIZE);
+// Lifetime class owning the region that holds hdr, REGION_WILD past the
+// claimed regions, and always LIFE_SHORT without lifetime segregation. In
+// two-ended mode, the end whose side of the wilderness holds hdr.
+#define REGION_WILD 0xFF
+static inline int region_of(void *hdr) {
+    if (g_tuning.two_ended) {
+        return (uint8_t *)hdr < g_low_end ? END_LOW :
+               (uint8_t *)hdr >= g_high_start ? END_HIGH : REGION_WILD;
+    }
+    if (!g_tuning.lifetime) {
+        return LIFE_SHORT;
+    }
+    size_t region = (size_t)((uint8_t *)hdr - g_heap_base) >> REGION_SHIFT;
+    return region < g_regions_claimed ? g_region_owner[region] : REGION_WILD;
+}
+
+// True if blocks a and b may merge or trade space
+static inline bool same_region(void *a, void *b) {
+    return region_of(a) == region_of(b);
+}
+
+// Note that block victim has been merged into block into, so the compaction
+// cursor never points into the middle of a block
+static inline void blk_absorbed(void *victim, void *into) {
+    if (g_compact_cursor == victim) {
+        g_compact_cursor = into;
+    }
+}
+
+// Encode a free block (or NULL) as a link
+static inline link_t link_to(void *hdr) {
+#ifdef COMPACT_LINKS
+    return hdr ? (link_t)(((uint8_t *)hdr - g_heap_base) / ALIGNMENT) : LINK_NULL;
+#else
+    return hdr;
+#endif
 }
 
-// Get pointer to the next pointer field in a free block
-static inline void **free_nextp(void *hdr) {
-    return (void **)((uint8_t *)hdr + HDR_SIZE + PTR_SIZE);
+// Decode a link back to the free block it names, or NULL
+static inline void *link_from(link_t link) {
+#ifdef COMPACT_LINKS
+    return link != LINK_NULL ? g_heap_base + (size_t)link * ALIGNMENT : NULL;
+#else
+    return link;
+#endif
+}
+
+// Get pointer to the next link field in a free block. It follows the
+// header, so a search reads a node's size and next link from the same
+// cache line unless the header ends a line.
+static inline link_t *free_nextp(void *hdr) {
+    return (link_t *)((uint8_t *)hdr + HDR_SIZE);
+}
+
+// Get pointer to the previous link field in a free block
+static inline link_t *free_prevp(void *hdr) {
+    return (link_t *)((uint8_t *)hdr + HDR_SIZE + LINK_SIZE);
 }
 
 // Get the previous free block pointer from a free block
 static inline void *free_prev(void *hdr) {
-    return *free_prevp(hdr);
+    return link_from(*free_prevp(hdr));
 }
 
 // Get the next free block pointer from a free block
 static inline void *free_next(void *hdr) {
-    return *free_nextp(hdr);
+    return link_from(*free_nextp(hdr));
+}
+
+// Set the previous free block of a free block
+static inline void set_free_prev(void *hdr, void *prev) {
+    *free_prevp(hdr) = link_to(prev);
 }
 
-// Insert a free block at the front of the free list
-static void freelist_insert_front(void *hdr) {
-    *free_prevp(hdr) = NULL;
-    *free_nextp(hdr) = g_free_head;
-    if (g_free_head) {
-        *free_prevp(g_free_head) = hdr;
+// Set the next free block of a free block
+static inline void set_free_next(void *hdr, void *next) {
+    *free_nextp(hdr) = link_to(next);
+}
+
+// Map a block size to the free list that holds it within its lifetime
+static inline size_t list_index(size_t size) {
+    if (g_policy != FIT_SEGREGATED) {
+        return 0;
+    }
+    size_t i = 0;
+    while (size > g_tuning.class_limits[i]) {
+        i++;
     }
-    g_free_head = hdr;
+    return i;
 }
 
-// Remove a block from the free list
+// Insert a free block into its free list: at the front, or at its address
+// position when the lists are address-ordered
+static void freelist_insert(void *hdr) {
+    void **head = &g_free_lists[region_of(hdr)][list_index(blk_size(hdr))];
+    void *prev = NULL;
+    void *next = *head;
+#ifdef FREELIST_ADDR_ORDER
+    while (next && next < hdr) {
+        prev = next;
+        next = free_next(next);
+    }
+#endif
+    set_free_prev(hdr, prev);
+    set_free_next(hdr, next);
+    if (prev) {
+        set_free_next(prev, hdr);
+    } else {
+        *head = hdr;
+    }
+    if (next) {
+        set_free_prev(next, hdr);
+    }
+}
+
+// Remove a block from its free list
 static void freelist_remove(void *hdr) {
     void *prev = free_prev(hdr);
     void *next = free_next(hdr);
+    int life = region_of(hdr);
+    if (hdr == g_rover[life]) {
+        g_rover[life] = next;
+    }
     if (prev) {
-        *free_nextp(prev) = next;
+        set_free_next(prev, next);
     } else {
-        g_free_head = next;
+        g_free_lists[life][list_index(blk_size(hdr))] = next;
     }
     if (next) {
-        *free_prevp(next) = prev;
+        set_free_prev(next, prev);
+    }
+    set_free_prev(hdr, NULL);
+    set_free_next(hdr, NULL);
+}
+
+// Change the size of a listed free block, moving it if its list changes
+static void freelist_resize(void *hdr, size_t size) {
+    if (list_index(blk_size(hdr)) == list_index(size)) {
+        hdr_write(hdr, size, false);
+        return;
     }
-    *free_prevp(hdr) = NULL;
-    *free_nextp(hdr) = NULL;
+    freelist_remove(hdr);
+    hdr_write(hdr, size, false);
+    freelist_insert(hdr);
 }
 
 // Find the previous block in linear order (expensive operation)
@@ -147,16 +525,17 @@ static inline void *blk_prev_linear(void *hdr) {
     return NULL;
 }
 
-// Convert requested size to aligned block size
+// Convert requested size to aligned block size; with tiny bins a small
+// request may get a block below MIN_BLOCK
 static inline size_t request_to_asize(size_t requested) {
     if (requested == 0) {
         return 0;
     }
-    size_t need = (requested < MIN_PAYLOAD) ? MIN_PAYLOAD : requested;
-    need = align_up(need);
-    size_t total = HDR_SIZE + need;
-    if (total < MIN_BLOCK) {
-        total = MIN_BLOCK;
+    size_t need = (requested < MIN_PAYLOAD && !g_tuning.tiny) ? MIN_PAYLOAD : requested;
+    size_t total = align_up(HDR_SIZE + need);
+    size_t least = g_tuning.tiny ? TINY_BLOCK : MIN_BLOCK;
+    if (total < least) {
+        total = least;
     }
     return total;
 }
@@ -168,77 +547,578 @@ static void coalesce_right_chain(void *hdr_free) {
         if (!ptr_in_heap(n) || n == heap_end()) {
             break;
         }
-        if (blk_alloc(n)) {
+        if (blk_alloc(n) || !same_region(n, hdr_free)) {
             break;
         }
         freelist_remove(n);
+        blk_absorbed(n, hdr_free);
         size_t merged = blk_size(hdr_free) + blk_size(n);
-        hdr_write(hdr_free, merged, false);
+        freelist_resize(hdr_free, merged);
+    }
+}
+
+// Merge every run of adjacent free blocks in one pass over the heap,
+// returning true if anything was merged
+static bool coalesce_all(void) {
+    bool merged = false;
+    g_frees_since_sweep = 0;
+    for (void *hdr = g_heap_base; hdr != heap_end(); hdr = blk_next(hdr)) {
+        if (blk_alloc(hdr)) {
+            continue;
+        }
+        void *n = blk_next(hdr);
+        if (n != heap_end() && !blk_alloc(n) && same_region(n, hdr)) {
+            coalesce_right_chain(hdr);
+            merged = true;
+        }
     }
+    return merged;
 }
 
 // Coalesce free block bidirectionally (with left and right neighbors)
 static void coalesce_bidir(void **hdr_free_io) {
     void *hdr = *hdr_free_io;
     void *left = blk_prev_linear(hdr);
-    if (left && !blk_alloc(left)) {
+    if (left && !blk_alloc(left) && same_region(left, hdr)) {
         freelist_remove(hdr);
+        blk_absorbed(hdr, left);
         size_t merged = blk_size(left) + blk_size(hdr);
-        hdr_write(left, merged, false);
+        freelist_resize(left, merged);
         hdr = left;
         *hdr_free_io = hdr;
     }
     coalesce_right_chain(hdr);
 }
 
+// Return an allocated block to the free lists, merging it with its
+// neighbors now or leaving that to a later sweep when coalescing is deferred
+static void release_block(void *hdr) {
+    hdr_write(hdr, blk_size(hdr), false);
+    freelist_insert(hdr);
+    if (!g_tuning.deferred) {
+        coalesce_bidir(&hdr);
+        return;
+    }
+    g_frees_since_sweep++;
+    if (g_tuning.coalesce_after != 0 && g_frees_since_sweep >= g_tuning.coalesce_after) {
+        coalesce_all();
+    }
+}
+
+// Park a freed block on the quick list for its exact size. It stays marked
+// allocated, so neighbors never merge with it while it waits to be reused.
+static void quick_push(void *hdr) {
+    size_t i = blk_size(hdr) / ALIGNMENT;
+    *(hdr_t *)hdr |= FLAG_QUICK;
+    *(void **)blk_payload(hdr) = g_quick[i];
+    g_quick[i] = hdr;
+    g_quick_len[i]++;
+}
+
+// Take the most recently parked block of exactly asize bytes
+static void *quick_pop(size_t asize) {
+    size_t i = asize / ALIGNMENT;
+    void *hdr = g_quick[i];
+    g_quick[i] = *(void **)blk_payload(hdr);
+    g_quick_len[i]--;
+    hdr_write(hdr, asize, true);
+    return blk_payload(hdr);
+}
+
+// True if a freed block of size bytes goes on a tiny bin, however long;
+// only blocks too small for the free lists do
+static inline bool is_tiny(size_t size) {
+    return g_tuning.tiny && size < MIN_BLOCK;
+}
+
+// Park a freed tiny block on its bin
+static void tiny_park(void *hdr) {
+    quick_push(hdr);
+    g_tiny_fresh++;
+}
+
+// Bulk consolidation of the tiny bins, if anything was parked since the
+// last one. Blocks below MIN_BLOCK cannot hold free-list links, so they
+// leave their bins only here: every tiny block is marked free at once, and
+// one pass over the heap merges every run of free blocks. A run of at least
+// MIN_BLOCK bytes goes on the free lists; a tiny block with no free
+// neighbour goes back to its bin. Returns true if any tiny block was freed.
+static bool consolidate_tiny(void) {
+    if (g_tiny_fresh == 0) {
+        return false;
+    }
+    g_tiny_fresh = 0;
+    g_tiny_walked = 0;
+    g_tiny_searches = 0;
+    size_t parked = 0;
+    for (size_t size = TINY_BLOCK; size < MIN_BLOCK; size += ALIGNMENT) {
+        size_t i = size / ALIGNMENT;
+        while (g_quick[i]) {
+            void *hdr = g_quick[i];
+            g_quick[i] = *(void **)blk_payload(hdr);
+            hdr_write(hdr, size, false);
+            parked++;
+        }
+        g_quick_len[i] = 0;
+    }
+    size_t reparked = 0;
+    for (uint8_t *hdr = g_heap_base; hdr != heap_end(); hdr += blk_size(hdr)) {
+        g_tiny_walked++;
+        if (blk_alloc(hdr) || hdr == g_wild) {
+            continue;
+        }
+        size_t total = 0;
+        for (uint8_t *p = hdr; p != heap_end() && !blk_alloc(p) && p != (uint8_t *)g_wild &&
+                               same_region(p, hdr); p += blk_size(p)) {
+            if (blk_size(p) >= MIN_BLOCK) {
+                freelist_remove(p);
+            }
+            blk_absorbed(p, hdr);
+            total += blk_size(p);
+        }
+        if (total >= MIN_BLOCK) {
+            hdr_write(hdr, total, false);
+            freelist_insert(hdr);
+        } else {
+            hdr_write(hdr, total, true);
+            quick_push(hdr);
+            reparked++;
+        }
+    }
+    return reparked < parked;
+}
+
+// Release every parked block that can hold free-list links, consolidate the
+// tiny bins and, if coalescing is deferred, merge all free runs. Called when
+// a search fails; returns true if anything changed.
+static bool reclaim(void) {
+    bool changed = false;
+    for (size_t i = MIN_BLOCK / ALIGNMENT; i <= QUICK_MAX_BLOCK / ALIGNMENT; i++) {
+        while (g_quick[i]) {
+            void *hdr = g_quick[i];
+            g_quick[i] = *(void **)blk_payload(hdr);
+            g_quick_len[i]--;
+            release_block(hdr);
+            changed = true;
+        }
+    }
+    if (consolidate_tiny()) {
+        changed = true;
+    }
+    if (g_tuning.deferred && coalesce_all()) {
+        changed = true;
+    }
+    return changed;
+}
+
+// Trim an allocated block down to asize bytes when the tail is large
+// enough to split off, returning the tail to the free list. With park set, a
+// tail too small for the free list but not for a tiny bin goes on its bin;
+// a block that may grow in place keeps such a tail instead.
+static void split_tail(void *hdr, size_t asize, bool park) {
+    size_t rem = blk_size(hdr) - asize;
+    if (rem < g_tuning.split_threshold || rem < (park ? TINY_BLOCK : MIN_BLOCK)) {
+        return;
+    }
+    void *right = (uint8_t *)hdr + asize;
+    hdr_write(hdr, asize, true);
+    if (rem < MIN_BLOCK) {
+        hdr_write(right, rem, true);
+        tiny_park(right);
+        return;
+    }
+    hdr_write(right, rem, false);
+    freelist_insert(right);
+    coalesce_right_chain(right);
+}
+
 // Allocate memory from a specific free block, splitting if necessary
 static void *allocate_from_free(void *hdr, size_t asize) {
-    size_t sz = blk_size(hdr);
     freelist_remove(hdr);
-    if (sz >= asize + MIN_BLOCK) {
-        void *right = (uint8_t *)hdr + asize;
-        hdr_write(hdr, asize, true);
-        hdr_write(right, sz - asize, false);
-        freelist_insert_front(right);
-        coalesce_right_chain(right);
-        return blk_payload(hdr);
-    } else {
-        hdr_write(hdr, sz, true);
-        return blk_payload(hdr);
-    }
+    hdr_write(hdr, blk_size(hdr), true);
+    split_tail(hdr, asize, g_tuning.tiny);
+    return blk_payload(hdr);
 }
 
-// Try to grow an allocated block in place by absorbing adjacent free blocks
-static bool grow_in_place(void *hdr_alloc, size_t asize) {
+// Try to grow an allocated block in place to asize bytes by absorbing
+// adjacent free blocks, taking up to keep bytes where they are free
+static bool grow_in_place(void *hdr_alloc, size_t asize, size_t keep) {
     size_t cur = blk_size(hdr_alloc);
-    while (cur < asize) {
+    while (cur < keep) {
         void *n = blk_next(hdr_alloc);
-        if (!ptr_in_heap(n) || n == heap_end() || blk_alloc(n)) {
+        if (!ptr_in_heap(n) || n == heap_end() || blk_alloc(n) || !same_region(n, hdr_alloc)) {
             break;
         }
         freelist_remove(n);
+        blk_absorbed(n, hdr_alloc);
         cur += blk_size(n);
         hdr_write(hdr_alloc, cur, true);
     }
     if (cur < asize) {
         return false;
     }
-    if (cur >= asize + MIN_BLOCK) {
-        void *right = (uint8_t *)hdr_alloc + asize;
-        hdr_write(hdr_alloc, asize, true);
-        hdr_write(right, cur - asize, false);
-        freelist_insert_front(right);
-        coalesce_right_chain(right);
+    if (cur > keep) {
+        split_tail(hdr_alloc, keep, false);
     }
     return true;
 }
 
+// Bytes from a block's header to the first header whose payload starts a
+// cache line and leaves a gap in front of it that is empty or a block
+static size_t aligned_lead(void *hdr) {
+    uintptr_t p = (uintptr_t)blk_payload(hdr);
+    uintptr_t aligned = (p + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1);
+    if (aligned != p && aligned - p < MIN_BLOCK) {
+        aligned += CACHE_LINE_SIZE;
+    }
+    return aligned - p;
+}
+
+// Search the free list(s) starting at head for a block of at least asize
+// bytes, with aligned set one that holds them on a cache line, examining at
+// most limit fitting candidates and keeping the smallest
+static void *search_list(void *head, void *stop, size_t asize, size_t limit, bool aligned) {
+    void *best = NULL;
+    size_t seen = 0;
+    for (void *p = head, *next; p != stop; p = next) {
+        // Start loading the next node before looking at this one; going
+        // further ahead would need its link, which is the load to hide
+        next = free_next(p);
+        if (g_tuning.prefetch && next != NULL) {
+            __builtin_prefetch(next);
+        }
+        size_t sz = blk_size(p);
+        size_t need = aligned ? asize + aligned_lead(p) : asize;
+        if (sz < need) {
+            continue;
+        }
+        if (!best || sz < blk_size(best)) {
+            best = p;
+        }
+        if (sz == need || ++seen >= limit) {
+            break;
+        }
+    }
+    return best;
+}
+
+// Pick the free block of lifetime class life to allocate asize bytes from
+// under the current policy, with aligned set one that holds them on a
+// cache line
+static void *find_fit_where(size_t asize, int life, bool aligned) {
+    void **lists = g_free_lists[life];
+    switch (g_policy) {
+        case FIT_NEXT: {
+            // Search from the rover to the end, then wrap around to it
+            void *start = g_rover[life] ? g_rover[life] : lists[0];
+            void *p = search_list(start, NULL, asize, 1, aligned);
+            if (!p && start != lists[0]) {
+                p = search_list(lists[0], start, asize, 1, aligned);
+            }
+            return p;
+        }
+        case FIT_BEST:
+            return search_list(lists[0], NULL, asize, SIZE_MAX, aligned);
+        case FIT_GOOD:
+            return search_list(lists[0], NULL, asize, g_tuning.good_fit_k, aligned);
+        case FIT_SEGREGATED:
+            for (size_t i = list_index(asize); i < g_tuning.num_classes; i++) {
+                void *p = search_list(lists[i], NULL, asize, 1, aligned);
+                if (p) {
+                    return p;
+                }
+            }
+            return NULL;
+        case FIT_FIRST:
+        default:
+            return search_list(lists[0], NULL, asize, 1, aligned);
+    }
+}
+
+// Pick the free block to allocate asize bytes from, anywhere on its line
+static void *find_fit(size_t asize, int life) {
+    return find_fit_where(asize, life, false);
+}
+
+// Estimator bucket for a block size: one per size up to LIFETIME_EXACT_MAX,
+// then one per bit length
+static inline size_t life_bucket(size_t size) {
+    if (size <= LIFETIME_EXACT_MAX) {
+        return size / ALIGNMENT;
+    }
+    return LIFETIME_EXACT_MAX / ALIGNMENT + 64 - __builtin_clzll((unsigned long long)size);
+}
+
+// Record an allocation (delta 1) or a free (delta -1) in one estimate, or
+// with delta 0 only bring its area up to date
+static void life_update(life_stats_t *st, int delta) {
+    st->area += st->live * (g_clock - st->stamp);
+    st->stamp = g_clock;
+    if (delta > 0) {
+        st->live++;
+        st->allocs++;
+        if (st->allocs >= LIFETIME_WINDOW) {
+            st->area /= 2;
+            st->allocs /= 2;
+        }
+    } else if (delta < 0 && st->live > 0) {
+        st->live--;
+    }
+}
+
+// Record an allocation (delta 1) or a free (delta -1) of a block of size
+// bytes in the lifetime estimator
+static void life_note(size_t size, int delta) {
+    life_update(&g_life[life_bucket(size)], delta);
+    life_update(&g_life_all, delta);
+    if (delta > 0) {
+        g_clock++;
+    }
+}
+
+// Move a live block that was noted at old_size bytes to the estimate for
+// its current size, after a realloc or an aligned allocation resized it.
+// The move is not a new allocation, so it neither counts one nor advances
+// the clock.
+static void life_resize(void *hdr, size_t old_size) {
+    size_t from = life_bucket(old_size);
+    size_t to = life_bucket(blk_size(hdr));
+    if (g_tuning.lifetime && from != to) {
+        life_update(&g_life[from], -1);
+        life_update(&g_life[to], 0);
+        g_life[to].live++;
+    }
+}
+
+// Mean lifetime of the blocks in one estimate, in allocations
+static uint64_t life_mean(const life_stats_t *st) {
+    uint64_t area = st->area + st->live * (g_clock - st->stamp);
+    return area / st->allocs;
+}
+
+// Lifetime class for a new block of asize bytes: the hint if there is one,
+// else long-lived if blocks of its size live lifetime_ratio percent as long
+// as the average block
+static int predict_lifetime(size_t asize, lifetime_t hint) {
+    if (hint != LIFETIME_UNKNOWN) {
+        return hint == LIFETIME_LONG ? LIFE_LONG : LIFE_SHORT;
+    }
+    const life_stats_t *st = &g_life[life_bucket(asize)];
+    if (st->allocs < LIFETIME_MIN_SAMPLES) {
+        return LIFE_SHORT;
+    }
+    return life_mean(st) * 100 > life_mean(&g_life_all) * g_tuning.lifetime_ratio ?
+           LIFE_LONG : LIFE_SHORT;
+}
+
+// Hand lifetime class life enough whole regions from the bottom of the
+// wilderness to hold asize bytes, as a free block on its lists. Returns
+// false if the wilderness is too small.
+static bool claim_regions(size_t asize, int life) {
+    if (g_wild == NULL) {
+        return false;
+    }
+    size_t wild_size = blk_size(g_wild);
+    size_t n = (asize + REGION_SIZE - 1) >> REGION_SHIFT;
+    size_t bytes = n << REGION_SHIFT;
+    if (bytes > wild_size) {
+        return false;
+    }
+    void *hdr = g_wild;
+    if (wild_size - bytes < MIN_BLOCK) {
+        bytes = wild_size;
+        n = (bytes + REGION_SIZE - 1) >> REGION_SHIFT;
+        g_wild = NULL;
+    } else {
+        g_wild = (uint8_t *)hdr + bytes;
+        hdr_write(g_wild, wild_size - bytes, false);
+    }
+    memset(g_region_owner + g_regions_claimed, life, n);
+    g_regions_claimed += n;
+    hdr_write(hdr, bytes, false);
+    freelist_insert(hdr);
+    coalesce_bidir(&hdr);
+    return true;
+}
+
+// Carve asize bytes off the wilderness at the given end, moving that end's
+// frontier, and return them as a free block on no list, or NULL if the
+// wilderness is too small. A leftover too small to stand alone goes with
+// the block, and the frontiers meet.
+static void *claim_end(size_t asize, int end) {
+    if (g_wild == NULL || blk_size(g_wild) < asize) {
+        return NULL;
+    }
+    size_t wild_size = blk_size(g_wild);
+    uint8_t *wild = g_wild;
+    uint8_t *hdr;
+    if (wild_size - asize < MIN_BLOCK) {
+        hdr = wild;
+        asize = wild_size;
+        g_low_end = g_high_start = (end == END_LOW) ? wild + wild_size : wild;
+        g_wild = NULL;
+    } else if (end == END_LOW) {
+        hdr = wild;
+        g_low_end = g_wild = wild + asize;
+        hdr_write(g_wild, wild_size - asize, false);
+    } else {
+        hdr = wild + wild_size - asize;
+        g_high_start = hdr;
+        hdr_write(g_wild, wild_size - asize, false);
+    }
+    hdr_write(hdr, asize, false);
+    return hdr;
+}
+
+
+#ifndef TUNING_FIXED
+// Parse a whole decimal string into *out, returning false if malformed
+static bool parse_size(const char *s, size_t *out) {
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (*s == '\0' || *s == '-' || *end != '\0') {
+        return false;
+    }
+    *out = (size_t)v;
+    return true;
+}
+
+// Parse colon-separated, strictly increasing segregated class limits
+static bool parse_classes(const char *s, tuning_t *t) {
+    size_t n = 0;
+    while (*s != '\0') {
+        char *end;
+        unsigned long long v = strtoull(s, &end, 10);
+        if (end == s || (*end != ':' && *end != '\0') || n + 1 >= MAX_CLASSES) {
+            return false;
+        }
+        if (n > 0 && v <= t->class_limits[n - 1]) {
+            return false;
+        }
+        t->class_limits[n++] = (size_t)v;
+        s = (*end == ':') ? end + 1 : end;
+    }
+    if (n == 0) {
+        return false;
+    }
+    t->class_limits[n++] = SIZE_MAX;
+    t->num_classes = n;
+    return true;
+}
+#endif
+
+
+bool myconfig(const char *key, const char *value) {
+#ifdef TUNING_FIXED
+    // Every option is a compile-time constant in this build
+    return false;
+#else
+    static const char *const names[] = {"first", "next", "best", "good", "seg"};
+    tuning_t *t = &g_next_tuning;
+    if (strcmp(key, "policy") == 0) {
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            if (strcmp(value, names[i]) == 0) {
+                t->policy = (fit_policy_t)i;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (strcmp(key, "goodfit_k") == 0) {
+        return parse_size(value, &t->good_fit_k) && t->good_fit_k > 0;
+    }
+    if (strcmp(key, "split") == 0) {
+        return parse_size(value, &t->split_threshold);
+    }
+    if (strcmp(key, "quick_depth") == 0) {
+        return parse_size(value, &t->quick_depth);
+    }
+    if (strcmp(key, "coalesce") == 0) {
+        if (strcmp(value, "imm") != 0 && strcmp(value, "def") != 0) {
+            return false;
+        }
+        t->deferred = (strcmp(value, "def") == 0);
+        return true;
+    }
+    if (strcmp(key, "coalesce_after") == 0) {
+        return parse_size(value, &t->coalesce_after);
+    }
+    if (strcmp(key, "compact_step") == 0) {
+        return parse_size(value, &t->compact_step);
+    }
+    if (strcmp(key, "lifetime") == 0) {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+            return false;
+        }
+        t->lifetime = (strcmp(value, "on") == 0);
+        return true;
+    }
+    if (strcmp(key, "lifetime_ratio") == 0) {
+        return parse_size(value, &t->lifetime_ratio);
+    }
+    if (strcmp(key, "two_ended") == 0) {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+            return false;
+        }
+        t->two_ended = (strcmp(value, "on") == 0);
+        return true;
+    }
+    if (strcmp(key, "large_min") == 0) {
+        return parse_size(value, &t->large_min);
+    }
+    if (strcmp(key, "tiny") == 0) {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+            return false;
+        }
+        t->tiny = (strcmp(value, "on") == 0);
+        return true;
+    }
+    if (strcmp(key, "prefetch") == 0) {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+            return false;
+        }
+        t->prefetch = (strcmp(value, "on") == 0);
+        return true;
+    }
+    if (strcmp(key, "classes") == 0) {
+        tuning_t parsed = *t;
+        if (!parse_classes(value, &parsed)) {
+            return false;
+        }
+        *t = parsed;
+        return true;
+    }
+    return false;
+#endif
+}
+
 
 bool myinit(void *heap_start, size_t heap_size) {
     g_heap_base = NULL;
     g_heap_size = 0;
-    g_free_head = NULL;
-    if (heap_start == NULL) {
+    memset(g_free_lists, 0, sizeof(g_free_lists));
+    memset(g_quick, 0, sizeof(g_quick));
+    memset(g_quick_len, 0, sizeof(g_quick_len));
+    memset(g_rover, 0, sizeof(g_rover));
+    g_frees_since_sweep = 0;
+    g_tiny_fresh = 0;
+    g_tiny_walked = 0;
+    g_tiny_searches = 0;
+    g_handles_used = 0;
+    g_handle_free = NULL;
+    g_compact_cursor = NULL;
+    memset(g_life, 0, sizeof(g_life));
+    memset(&g_life_all, 0, sizeof(g_life_all));
+    g_clock = 0;
+    g_regions_claimed = 0;
+    g_wild = NULL;
+    g_low_end = NULL;
+    g_high_start = NULL;
+#ifndef TUNING_FIXED
+    g_tuning = g_next_tuning;
+#endif
+    // lifetime segregation bypasses the quick lists, which the other two need
+    if (heap_start == NULL || (g_tuning.lifetime && (g_tuning.two_ended || g_tuning.tiny))) {
         return false;
     }
     if (((uintptr_t)heap_start) % ALIGNMENT != 0) {
@@ -247,36 +1127,220 @@ bool myinit(void *heap_start, size_t heap_size) {
     if (heap_size % ALIGNMENT != 0) {
         return false;
     }
-    if (heap_size < MIN_BLOCK) {
+    if (heap_size < HDR_PAD + MIN_BLOCK) {
         return false;
     }
-    g_heap_base = (uint8_t *)heap_start;
+    // the first header ends on an alignment boundary; the rest of the last
+    // granule is left unused
+    heap_size = (heap_size - HDR_PAD) & ~(size_t)(ALIGNMENT - 1);
+#ifdef COMPACT_LINKS
+    if (heap_size / ALIGNMENT >= LINK_NULL) {
+        return false;
+    }
+#endif
+#ifdef COMPACT_HEADERS
+    if ((heap_size / ALIGNMENT) >> (8 * sizeof(hdr_t) - FLAG_BITS) != 0) {
+        return false;
+    }
+#endif
+    g_heap_base = (uint8_t *)heap_start + HDR_PAD;
     g_heap_size = heap_size;
     void *hdr = (void *)g_heap_base;
     hdr_write(hdr, heap_size, false);
-    freelist_insert_front(hdr);
+    g_compact_cursor = hdr;
+    if (g_tuning.lifetime) {
+        // the heap starts out as all wilderness
+        g_wild = hdr;
+        return (heap_size + REGION_SIZE - 1) >> REGION_SHIFT <= MAX_REGIONS;
+    }
+    if (g_tuning.two_ended) {
+        // both frontiers start at the edges of an all-wilderness heap
+        g_wild = hdr;
+        g_low_end = g_heap_base;
+        g_high_start = heap_end();
+        return true;
+    }
+    freelist_insert(hdr);
     return true;
 }
 
 
+// Allocate with lifetime segregation: search the predicted lifetime's
+// regions, then claim new ones, and only then borrow from the other class
+static void *malloc_segregated(size_t asize, lifetime_t hint) {
+    int life = predict_lifetime(asize, hint);
+    void *p = find_fit(asize, life);
+    if (!p && g_tuning.deferred && coalesce_all()) {
+        p = find_fit(asize, life);
+    }
+    if (!p && claim_regions(asize, life)) {
+        p = find_fit(asize, life);
+    }
+    if (!p) {
+        p = find_fit(asize, 1 - life);
+    }
+    if (!p) {
+        return NULL;
+    }
+    if (g_policy == FIT_NEXT) {
+        g_rover[region_of(p)] = free_next(p);
+    }
+    void *payload = allocate_from_free(p, asize);
+    life_note(blk_size(blk_from_payload(payload)), 1);
+    return payload;
+}
+
+// Allocate in two-ended mode: a block goes to the end its size belongs to,
+// which extends its frontier into the wilderness only once reclaiming parked
+// and unmerged blocks fails, and borrows from the other end as a last resort
+static void *malloc_two_ended(size_t asize) {
+    int end = asize >= g_tuning.large_min ? END_HIGH : END_LOW;
+    void *p = find_fit(asize, end);
+    if (!p && reclaim()) {
+        p = find_fit(asize, end);
+    }
+    if (!p) {
+        void *hdr = claim_end(asize, end);
+        if (hdr != NULL) {
+            hdr_write(hdr, blk_size(hdr), true);
+            return blk_payload(hdr);
+        }
+        p = find_fit(asize, 1 - end);
+    }
+    if (!p) {
+        return NULL;
+    }
+    if (g_policy == FIT_NEXT) {
+        g_rover[region_of(p)] = free_next(p);
+    }
+    return allocate_from_free(p, asize);
+}
+
+
 void *mymalloc(size_t requested_size) {
+    return mymalloc_lifetime(requested_size, LIFETIME_UNKNOWN);
+}
+
+/* Function: mymalloc_lifetime
+ * ---------------------------
+ * The allocation path behind mymalloc. Without lifetime segregation the
+ * hint is unused: an exact-size quick block is taken if there is one, and
+ * otherwise the free lists are searched under the placement policy, those
+ * of the block's end of the heap in two-ended mode.
+ */
+void *mymalloc_lifetime(size_t requested_size, lifetime_t hint) {
     // Convert requested size to aligned block size
     size_t asize = request_to_asize(requested_size);
     if (asize == 0) {
         return NULL;
     }
-    
-    // First-fit search through free list
-    for (void *p = g_free_head; p != NULL; p = free_next(p)) {
-        if (blk_size(p) >= asize) {
-            return allocate_from_free(p, asize);
+    if (g_tuning.lifetime) {
+        return malloc_segregated(asize, hint);
+    }
+
+    // An exact-size block parked on a quick list needs no search or split
+    if (asize <= QUICK_MAX_BLOCK && g_quick[asize / ALIGNMENT]) {
+        return quick_pop(asize);
+    }
+    if (g_tuning.two_ended) {
+        return malloc_two_ended(asize);
+    }
+
+    // Search the free list(s) under the configured placement policy,
+    // reclaiming parked and unmerged blocks before giving up
+    void *p = find_fit(asize, LIFE_SHORT);
+    g_tiny_searches++;
+    if (p && blk_next(p) == heap_end() && g_tiny_searches * TINY_WALK_BUDGET >= g_tiny_walked &&
+        consolidate_tiny()) {
+        // memory is running short: merge the tiny bins before cutting into the top
+        p = find_fit(asize, LIFE_SHORT);
+    }
+    if (!p && reclaim()) {
+        p = find_fit(asize, LIFE_SHORT);
+    }
+    if (!p) {
+        return NULL;
+    }
+    if (g_policy == FIT_NEXT) {
+        g_rover[LIFE_SHORT] = free_next(p);
+    }
+    return allocate_from_free(p, asize);
+}
+
+// Allocate size bytes with the payload on a cache line. A free block that
+// holds the payload on a line is used if there is one; otherwise
+// over-allocate. Either way the gap in front becomes a free block of its
+// own and the tail is trimmed. With lifetime segregation or two-ended
+// placement the free lists belong to regions or ends, so only the
+// over-allocation is used.
+static void *malloc_aligned(size_t size, lifetime_t hint) {
+    if (size == 0 || size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+    size_t asize = request_to_asize(size);
+    void *hdr = NULL;
+    if (!g_tuning.lifetime && !g_tuning.two_ended) {
+        if (asize <= QUICK_MAX_BLOCK && g_quick[asize / ALIGNMENT] &&
+            aligned_lead(g_quick[asize / ALIGNMENT]) == 0) {
+            return quick_pop(asize);
+        }
+        hdr = find_fit_where(asize, LIFE_SHORT, true);
+        if (hdr != NULL) {
+            if (g_policy == FIT_NEXT) {
+                g_rover[LIFE_SHORT] = free_next(hdr);
+            }
+            freelist_remove(hdr);
+            hdr_write(hdr, blk_size(hdr), true);
         }
     }
-    
-    // No suitable free block found
-    return NULL;
+    if (hdr == NULL) {
+        void *payload = mymalloc_lifetime(size + CACHE_LINE_SIZE + MIN_BLOCK, hint);
+        if (payload == NULL) {
+            return NULL;
+        }
+        hdr = blk_from_payload(payload);
+    }
+    size_t noted = blk_size(hdr);
+    size_t lead = aligned_lead(hdr);
+    if (lead != 0) {
+        void *front = hdr;
+        hdr = (uint8_t *)front + lead;
+        hdr_write(hdr, blk_size(front) - lead, true);
+        hdr_write(front, lead, true);
+        release_block(front);
+    }
+    split_tail(hdr, asize, g_tuning.tiny);
+    life_resize(hdr, noted);
+    return blk_payload(hdr);
+}
+
+// Allocation step of mymalloc_flags: lifetime flags become the lifetime
+// hint, hot blocks get a cache-line aligned payload and realloc-heavy blocks
+// are flagged to keep their slack through myrealloc
+static void *malloc_hinted(size_t size, unsigned flags) {
+    lifetime_t hint = LIFETIME_UNKNOWN;
+    if (flags & MALLOC_LONG_LIVED) {
+        hint = LIFETIME_LONG;
+    } else if (flags & MALLOC_SHORT_LIVED) {
+        hint = LIFETIME_SHORT;
+    }
+    void *payload = (flags & MALLOC_HOT) ? malloc_aligned(size, hint)
+                                         : mymalloc_lifetime(size, hint);
+    if (payload != NULL && (flags & MALLOC_REALLOC_HEAVY)) {
+        *(hdr_t *)blk_from_payload(payload) |= FLAG_REALLOC;
+    }
+    return payload;
 }
 
+/* Function: mymalloc_flags
+ * ------------------------
+ * Lifetime flags become the lifetime hint (used with lifetime=on),
+ * realloc-heavy blocks reserve slack, hot blocks get a cache-line aligned
+ * payload, and zeroed blocks are cleared up to the request.
+ */
+void *mymalloc_flags(size_t requested_size, unsigned flags) {
+    return malloc_flagged(malloc_hinted, requested_size, flags);
+}
 
 
 void myfree(void *ptr) {
@@ -286,17 +1350,27 @@ void myfree(void *ptr) {
     
     // Get block header from payload pointer
     void *hdr = blk_from_payload(ptr);
-    if (!ptr_in_heap(hdr)) {
+    if (!ptr_in_heap(hdr) || (hdr_raw(hdr) & FLAG_HANDLE)) {
         return;
     }
+    *(hdr_t *)hdr &= ~FLAG_REALLOC;
     
-    // Mark block as free and add to free list
+    // Park small blocks on their quick list while it has room, and tiny ones
+    // on their bin whatever its length; quick lists are not lifetime-aware,
+    // so segregation bypasses them
     size_t sz = blk_size(hdr);
-    hdr_write(hdr, sz, false);
-    freelist_insert_front(hdr);
-    
-    // Coalesce with adjacent free blocks
-    coalesce_bidir(&hdr);
+    if (g_tuning.lifetime) {
+        life_note(sz, -1);
+    } else if (is_tiny(sz)) {
+        tiny_park(hdr);
+        return;
+    } else if (sz <= QUICK_MAX_BLOCK && g_quick_len[sz / ALIGNMENT] < g_tuning.quick_depth) {
+        quick_push(hdr);
+        return;
+    }
+
+    // Mark block as free, add to free list and coalesce with neighbors
+    release_block(hdr);
 }
 
 
@@ -321,22 +1395,26 @@ void *myrealloc(void *old_ptr, size_t new_size) {
         return np;
     }
     
+    // A realloc-heavy block keeps its slack: a shrink trims only the tail
+    // beyond it, and a block that has to move reserves it again
+    bool heavy = (hdr_raw(hdr) & FLAG_REALLOC) != 0;
     size_t asize = request_to_asize(new_size);
+    size_t keep = heavy ? request_to_asize(realloc_reserve(new_size)) : asize;
     size_t cur = blk_size(hdr);
     if (asize <= cur) {
-        if (cur >= asize + MIN_BLOCK) {
-            void *right = (uint8_t *)hdr + asize;
-            hdr_write(hdr, asize, true);
-            hdr_write(right, cur - asize, false);
-            freelist_insert_front(right);
-            coalesce_right_chain(right);
+        if (keep < cur) {
+            split_tail(hdr, keep, false);
+            *(hdr_t *)hdr |= heavy ? FLAG_REALLOC : 0;
+            life_resize(hdr, cur);
         }
         return old_ptr;
     }
-    if (grow_in_place(hdr, asize)) {
+    if (grow_in_place(hdr, asize, keep)) {
+        *(hdr_t *)hdr |= heavy ? FLAG_REALLOC : 0;
+        life_resize(hdr, cur);
         return old_ptr;
     }
-    void *np2 = mymalloc(new_size);
+    void *np2 = heavy ? mymalloc_flags(new_size, MALLOC_REALLOC_HEAVY) : mymalloc(new_size);
     if (!np2) {
         return NULL;
     }
@@ -349,16 +1427,181 @@ void *myrealloc(void *old_ptr, size_t new_size) {
     return np2;
 }
 
+// Payload capacity of an allocated block; 0 for anything else, including
+// blocks parked on a quick list
+size_t myusable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    void *hdr = blk_from_payload(ptr);
+    if (!ptr_in_heap(hdr) || !blk_alloc(hdr) || (hdr_raw(hdr) & FLAG_QUICK)) {
+        return 0;
+    }
+    return blk_size(hdr) - HDR_SIZE;
+}
+
+
+// Take an unused handle, or NULL if the table is full
+static struct handle *handle_new(void) {
+    struct handle *h = g_handle_free;
+    if (h != NULL) {
+        g_handle_free = h->next_free;
+    } else if (g_handles_used < MAX_HANDLES) {
+        h = &g_handles[g_handles_used++];
+    }
+    return h;
+}
+
+static void handle_delete(struct handle *h) {
+    h->hdr = NULL;
+    h->next_free = g_handle_free;
+    g_handle_free = h;
+}
+
+// True if h is a live handle from the table
+static bool handle_valid(handle_t h) {
+    return h >= g_handles && h < g_handles + g_handles_used &&
+           ((uintptr_t)h - (uintptr_t)g_handles) % sizeof(*h) == 0 && h->hdr != NULL;
+}
+
+// Handle that owns the relocatable block at hdr
+static inline struct handle *blk_handle(void *hdr) {
+    return *(struct handle **)blk_payload(hdr);
+}
+
+// Slide the unpinned relocatable block at hdr down over the free block
+// right before it, which reappears after the moved block. Returns the
+// bytes moved.
+static size_t slide_down(void *free_hdr, void *hdr) {
+    size_t free_size = blk_size(free_hdr);
+    size_t size = blk_size(hdr);
+    freelist_remove(free_hdr);
+    memmove(free_hdr, hdr, size);
+    blk_handle(free_hdr)->hdr = free_hdr;
+    void *rest = (uint8_t *)free_hdr + size;
+    hdr_write(rest, free_size, false);
+    freelist_insert(rest);
+    coalesce_right_chain(rest);
+    g_compact_cursor = rest;
+    return size;
+}
+
+
+/* Function: hmalloc
+ * -----------------
+ * Runs a compaction step of compact_step bytes, then takes an ordinary
+ * block with room for the handle link in front of the client's bytes.
+ */
+handle_t hmalloc(size_t requested_size) {
+    if (requested_size == 0 || requested_size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+    hcompact(g_tuning.compact_step);
+    struct handle *h = handle_new();
+    if (h == NULL) {
+        return NULL;
+    }
+    void *payload = mymalloc(requested_size + HANDLE_LINK);
+    if (payload == NULL) {
+        handle_delete(h);
+        return NULL;
+    }
+    void *hdr = blk_from_payload(payload);
+    *(hdr_t *)hdr |= FLAG_HANDLE;
+    *(struct handle **)payload = h;
+    h->hdr = hdr;
+    h->pins = 0;
+    return h;
+}
+
+void *hlock(handle_t h) {
+    if (!handle_valid(h)) {
+        return NULL;
+    }
+    h->pins++;
+    return (uint8_t *)blk_payload(h->hdr) + HANDLE_LINK;
+}
+
+void hunlock(handle_t h) {
+    if (handle_valid(h) && h->pins > 0) {
+        h->pins--;
+    }
+}
+
+void hfree(handle_t h) {
+    if (!handle_valid(h)) {
+        return;
+    }
+    if (g_tuning.lifetime) {
+        life_note(blk_size(h->hdr), -1);
+    }
+    release_block(h->hdr);
+    handle_delete(h);
+}
+
+/* Function: hcompact
+ * ------------------
+ * Walks the heap from the cursor left by the previous step. At a free
+ * block it merges any free blocks after it, and slides an unpinned
+ * relocatable block that follows down over it, so the free block moves up
+ * the heap; any other block is stepped over. At the end of the heap the
+ * walk starts again from the base. A step visits at most
+ * COMPACT_VISIT_LIMIT blocks and moves no block once max_bytes have moved.
+ */
+size_t hcompact(size_t max_bytes) {
+    size_t moved = 0;
+    if (g_compact_cursor == NULL) {
+        return 0;
+    }
+    for (size_t visited = 0; visited < COMPACT_VISIT_LIMIT && moved < max_bytes; visited++) {
+        void *hdr = g_compact_cursor;
+        if (hdr == heap_end()) {
+            g_compact_cursor = g_heap_base;
+            continue;
+        }
+        void *next = blk_next(hdr);
+        if (blk_alloc(hdr) || next == heap_end() || !same_region(hdr, next)) {
+            g_compact_cursor = next;
+        } else if (!blk_alloc(next)) {
+            coalesce_right_chain(hdr);
+        } else if ((hdr_raw(next) & FLAG_HANDLE) && blk_handle(next)->pins == 0) {
+            moved += slide_down(hdr, next);
+        } else {
+            g_compact_cursor = next;
+        }
+    }
+    return moved;
+}
+
+size_t hlargest_free(void) {
+    size_t largest = 0;
+    if (g_heap_base == NULL) {
+        return 0;
+    }
+    for (void *hdr = g_heap_base; hdr != heap_end(); hdr = blk_next(hdr)) {
+        if (!blk_alloc(hdr) && blk_size(hdr) > largest) {
+            largest = blk_size(hdr);
+        }
+    }
+    return largest;
+}
+
 
-// Validate heap by walking through all blocks linearly
-static bool validate_linear_walk(size_t *out_free_linear) {
+// Validate heap by walking through all blocks linearly, counting the free
+// blocks, the blocks parked on quick lists and the relocatable blocks, and
+// checking that the compaction cursor is at a block boundary
+static bool validate_linear_walk(size_t *out_free_linear, size_t *out_quick_linear,
+                                 size_t *out_handle_linear) {
     size_t walked = 0;
     size_t free_linear = 0;
+    size_t quick_linear = 0;
+    size_t handle_linear = 0;
+    bool cursor_seen = g_compact_cursor == heap_end();
     for (uint8_t *p = g_heap_base; p < heap_end();) {
         void *hdr = (void *)p;
         size_t sz = blk_size(hdr);
         bool al = blk_alloc(hdr);
-        if (sz < MIN_BLOCK || sz % ALIGNMENT != 0) {
+        if (sz < (al && g_tuning.tiny ? TINY_BLOCK : MIN_BLOCK) || sz % ALIGNMENT != 0) {
             breakpoint();
             return false;
         }
@@ -367,35 +1610,92 @@ static bool validate_linear_walk(size_t *out_free_linear) {
             return false;
         }
         void *n = blk_next(hdr);
-        if (n != heap_end() && !al && !blk_alloc(n)) {
+        if (!g_tuning.deferred && n != heap_end() && !al && !blk_alloc(n) &&
+            same_region(hdr, n)) {
             breakpoint();
             return false;
         }
-        if (!al) {
+        if ((hdr_raw(hdr) & FLAG_QUICK) != 0) {
+            if (!al) {
+                breakpoint();
+                return false;
+            }
+            quick_linear++;
+        }
+        if ((hdr_raw(hdr) & FLAG_REALLOC) != 0 && (!al || (hdr_raw(hdr) & FLAG_QUICK) != 0)) {
+            breakpoint();
+            return false;
+        }
+        if ((hdr_raw(hdr) & FLAG_HANDLE) != 0) {
+            if (!al || (hdr_raw(hdr) & FLAG_QUICK) != 0 || !handle_valid(blk_handle(hdr)) ||
+                blk_handle(hdr)->hdr != hdr) {
+                breakpoint();
+                return false;
+            }
+            handle_linear++;
+        }
+        if (hdr == g_compact_cursor) {
+            cursor_seen = true;
+        }
+        if (!al && hdr != g_wild) {
             free_linear++;
         }
         walked += sz;
         p += sz;
     }
-    if (walked != g_heap_size) {
+    if (walked != g_heap_size || !cursor_seen) {
         breakpoint();
         return false;
     }
     *out_free_linear = free_linear;
+    *out_quick_linear = quick_linear;
+    *out_handle_linear = handle_linear;
     return true;
 }
 
-// Validate the free list for consistency and detect cycles
-static bool validate_freelist(size_t expect_free_count) {
+// Validate the quick lists: every parked block is flagged, has the list's
+// exact size, and no list exceeds the configured depth
+static bool validate_quick(size_t expect_quick_count) {
+    size_t quick_count = 0;
+    for (size_t i = 0; i <= QUICK_MAX_BLOCK / ALIGNMENT; i++) {
+        size_t len = 0;
+        for (void *hdr = g_quick[i]; hdr != NULL; hdr = *(void **)blk_payload(hdr)) {
+            if (!ptr_in_heap(hdr) || (hdr_raw(hdr) & FLAG_QUICK) == 0 ||
+                blk_size(hdr) != i * ALIGNMENT || ++len > g_quick_len[i]) {
+                breakpoint();
+                return false;
+            }
+        }
+        if (len != g_quick_len[i] || (len > g_tuning.quick_depth && !is_tiny(i * ALIGNMENT))) {
+            breakpoint();
+            return false;
+        }
+        quick_count += len;
+    }
+    if (quick_count != expect_quick_count) {
+        breakpoint();
+        return false;
+    }
+    return true;
+}
+
+// Validate one free list of lifetime class life for consistency and detect
+// cycles, adding the number of blocks found to *count
+static bool validate_freelist(int life, size_t index, size_t *count) {
     size_t free_list_count = 0;
-    void *slow = g_free_head;
-    void *fast = g_free_head;
+    void *slow = g_free_lists[life][index];
+    void *fast = g_free_lists[life][index];
+    if (slow && free_prev(slow) != NULL) {
+        breakpoint();
+        return false;
+    }
     while (slow) {
         if (!ptr_in_heap(slow)) {
             breakpoint();
             return false;
         }
-        if (blk_alloc(slow)) {
+        if (blk_alloc(slow) || list_index(blk_size(slow)) != index ||
+            region_of(slow) != life) {
             breakpoint();
             return false;
         }
@@ -409,6 +1709,12 @@ static bool validate_freelist(size_t expect_free_count) {
             breakpoint();
             return false;
         }
+#ifdef FREELIST_ADDR_ORDER
+        if (n && n < slow) {
+            breakpoint();
+            return false;
+        }
+#endif
         free_list_count++;
         slow = n;
         if (fast) {
@@ -422,10 +1728,7 @@ static bool validate_freelist(size_t expect_free_count) {
             return false;
         }
     }
-    if (expect_free_count != free_list_count) {
-        breakpoint();
-        return false;
-    }
+    *count += free_list_count;
     return true;
 }
 
@@ -435,10 +1738,45 @@ bool validate_heap(void) {
         return false;
     }
     size_t free_linear = 0;
-    if (!validate_linear_walk(&free_linear)) {
+    size_t quick_linear = 0;
+    size_t handle_linear = 0;
+    if (!validate_linear_walk(&free_linear, &quick_linear, &handle_linear)) {
+        return false;
+    }
+    size_t unused_handles = 0;
+    for (struct handle *h = g_handle_free; h != NULL; h = h->next_free) {
+        if (h->hdr != NULL || ++unused_handles > g_handles_used) {
+            breakpoint();
+            return false;
+        }
+    }
+    if (handle_linear + unused_handles != g_handles_used) {
+        breakpoint();
         return false;
     }
-    if (!validate_freelist(free_linear)) {
+    if (!validate_quick(quick_linear)) {
+        return false;
+    }
+    size_t free_listed = 0;
+    for (int life = 0; life < NUM_LIFETIMES; life++) {
+        for (size_t i = 0; i < g_tuning.num_classes; i++) {
+            if (!validate_freelist(life, i, &free_listed)) {
+                return false;
+            }
+        }
+    }
+    uint8_t *wild_end = g_tuning.two_ended ? g_high_start : heap_end();
+    if (g_wild != NULL && ((uint8_t *)g_wild + blk_size(g_wild) != wild_end ||
+                           blk_alloc(g_wild) || region_of(g_wild) != REGION_WILD)) {
+        breakpoint();
+        return false;
+    }
+    if (g_tuning.two_ended && (g_wild != NULL ? g_wild != g_low_end : g_low_end != g_high_start)) {
+        breakpoint();
+        return false;
+    }
+    if (free_listed != free_linear) {
+        breakpoint();
         return false;
     }
     return true;
@@ -446,12 +1784,28 @@ bool validate_heap(void) {
 
 // Debug function to print the heap structure
 void dump_heap(void) {
-    printf("==== HEAP DUMP base=%p size=%zu free_head=%p ====\n", (void *)g_heap_base, g_heap_size, g_free_head);
+    printf("==== HEAP DUMP base=%p size=%zu policy=%d ====\n", (void *)g_heap_base, g_heap_size, (int)g_policy);
+    for (int life = 0; life < NUM_LIFETIMES; life++) {
+        for (size_t c = 0; c < g_tuning.num_classes; c++) {
+            if (g_free_lists[life][c]) {
+                printf("list[%d][%02zu] head=%p\n", life, c, g_free_lists[life][c]);
+            }
+        }
+    }
+    if (g_tuning.two_ended) {
+        printf("low end below %p, high end from %p\n", (void *)g_low_end, (void *)g_high_start);
+    } else if (g_wild != NULL) {
+        printf("wilderness=%p, %zu regions claimed\n", g_wild, g_regions_claimed);
+    }
     size_t i = 0;
     for (uint8_t *p = g_heap_base; p < heap_end();) {
         void *hdr = (void *)p;
         size_t sz = blk_size(hdr);
-        if (blk_alloc(hdr)) {
+        if ((hdr_raw(hdr) & FLAG_QUICK) != 0) {
+            printf("[%04zu] %p  size=%6zu  QUICK\n", i, hdr, sz);
+        } else if ((hdr_raw(hdr) & FLAG_HANDLE) != 0) {
+            printf("[%04zu] %p  size=%6zu  HANDLE pins=%u\n", i, hdr, sz, blk_handle(hdr)->pins);
+        } else if (blk_alloc(hdr)) {
             printf("[%04zu] %p  size=%6zu  ALLOC\n", i, hdr, sz);
         } else {
             printf("[%04zu] %p  size=%6zu  FREE", i, hdr, sz);
@@ -462,3 +1816,88 @@ void dump_heap(void) {
     }
     printf("==== END DUMP ====\n");
 }
+
+#ifdef THREAD_SAFE
+static lock_t g_lock = LOCK_INITIALIZER;
+
+#undef myinit
+#undef myconfig
+#undef mymalloc
+#undef mymalloc_flags
+#undef mymalloc_lifetime
+#undef myrealloc
+#undef myfree
+#undef myusable_size
+#undef validate_heap
+#undef hmalloc
+#undef hlock
+#undef hunlock
+#undef hfree
+#undef hcompact
+#undef hlargest_free
+
+// Defines the public function name(params) to call the unlocked version
+// with args under g_lock
+#define LOCKED(type, name, params, args)        \
+    type name params {                          \
+        lock_acquire(&g_lock);                  \
+        type result = unlocked_##name args;     \
+        lock_release(&g_lock);                  \
+        return result;                          \
+    }
+#define LOCKED_VOID(name, params, args)         \
+    void name params {                          \
+        lock_acquire(&g_lock);                  \
+        unlocked_##name args;                   \
+        lock_release(&g_lock);                  \
+    }
+
+LOCKED(bool, myconfig, (const char *key, const char *value), (key, value))
+LOCKED(void *, mymalloc, (size_t requested_size), (requested_size))
+LOCKED(void *, mymalloc_flags, (size_t requested_size, unsigned flags), (requested_size, flags))
+LOCKED(void *, mymalloc_lifetime, (size_t requested_size, lifetime_t hint),
+       (requested_size, hint))
+LOCKED(void *, myrealloc, (void *old_ptr, size_t new_size), (old_ptr, new_size))
+LOCKED_VOID(myfree, (void *ptr), (ptr))
+LOCKED(size_t, myusable_size, (void *ptr), (ptr))
+LOCKED(bool, validate_heap, (void), ())
+LOCKED(handle_t, hmalloc, (size_t requested_size), (requested_size))
+LOCKED(void *, hlock, (handle_t h), (h))
+LOCKED_VOID(hunlock, (handle_t h), (h))
+LOCKED_VOID(hfree, (handle_t h), (h))
+LOCKED(size_t, hcompact, (size_t max_bytes), (max_bytes))
+LOCKED(size_t, hlargest_free, (void), ())
+
+/* Function: myinit
+ * ----------------
+ * In the THREAD_SAFE build, also zeroes the lock's counters.
+ */
+bool myinit(void *heap_start, size_t heap_size) {
+    lock_acquire(&g_lock);
+    bool ok = unlocked_myinit(heap_start, heap_size);
+    lock_release(&g_lock);
+    lock_reset_stats(&g_lock);
+    return ok;
+}
+
+/* Function: mystats
+ * -----------------
+ * Reports how often the heap lock was taken, how many of those found it
+ * held and how many then slept, and the mean and longest time it was held,
+ * in cycles.
+ */
+size_t mystats(stat_t stats[], size_t max) {
+    unsigned long n = g_lock.acquisitions;
+    stat_t all[] = {
+        {"lock_acquisitions", n},
+        {"lock_contended", g_lock.contended},
+        {"lock_sleeps", g_lock.sleeps},
+        {"lock_spin_limit", g_lock.spin_limit},
+        {"lock_mean_hold_cycles", n == 0 ? 0 : g_lock.hold_cycles / n},
+        {"lock_max_hold_cycles", g_lock.max_hold_cycles},
+    };
+    size_t count = sizeof(all) / sizeof(all[0]) < max ? sizeof(all) / sizeof(all[0]) : max;
+    memcpy(stats, all, count * sizeof(stat_t));
+    return count;
+}
+#endif
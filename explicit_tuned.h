@@ -0,0 +1,10 @@
+// Generated by tune.py -- do not edit. Rerun `make tune` to refresh.
+// Trained on: samples/trace-chs.script samples/trace-emacs.script samples/trace-firefox.script samples/trace-gcc.script samples/pattern-mixed.script
+// Utilization 86%, 243.3 ns/op, score 117.50
+#define FIT_POLICY FIT_GOOD
+#define GOOD_FIT_K 32
+#define SPLIT_THRESHOLD 0
+#define QUICK_DEPTH 64
+#define COALESCE_DEFERRED 1
+#define COALESCE_AFTER 0
+#define SIZE_CLASSES 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 384, 512, 1024, 4096
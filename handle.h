@@ -0,0 +1,66 @@
+/* File: handle.h
+ * --------------
+ * Interface to relocatable blocks in the explicit allocator. A block
+ * allocated with hmalloc is reached through a handle, an entry in an
+ * indirection table, rather than a fixed address. While a handle is
+ * unlocked the compactor may slide its block toward the heap base, so free
+ * space gathers into one region at the top of the heap instead of staying
+ * scattered between live blocks. A client locks the handle to get the
+ * block's current address, and unlocks it when done; a locked (pinned)
+ * block never moves.
+ *
+ * Blocks from mymalloc never move, and the compactor steps over them.
+ */
+
+#ifndef _HANDLE_H
+#define _HANDLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct handle *handle_t;
+
+/* Function: hmalloc
+ * -----------------
+ * Allocates a relocatable block of at least requested_size bytes, running
+ * a compaction step first. Returns NULL if the request cannot be met or the
+ * handle table is full.
+ */
+handle_t hmalloc(size_t requested_size);
+
+/* Function: hlock
+ * ---------------
+ * Pins the block and returns its current address, which stays valid until
+ * the matching hunlock. Locks nest.
+ */
+void *hlock(handle_t h);
+
+/* Function: hunlock
+ * -----------------
+ * Releases one hlock; once every lock is released the block may move.
+ */
+void hunlock(handle_t h);
+
+/* Function: hfree
+ * ---------------
+ * Frees the block and its handle, whether or not it is locked.
+ */
+void hfree(handle_t h);
+
+/* Function: hcompact
+ * ------------------
+ * Runs one bounded step of the incremental compactor: it resumes its walk
+ * of the heap where the previous step stopped and slides unpinned blocks
+ * down into the free space before them, stopping once it has moved
+ * max_bytes or visited a fixed number of blocks. Returns the bytes moved.
+ */
+size_t hcompact(size_t max_bytes);
+
+/* Function: hlargest_free
+ * -----------------------
+ * Returns the size of the largest free block in the heap, a measure of
+ * external fragmentation. It walks the whole heap.
+ */
+size_t hlargest_free(void);
+
+#endif
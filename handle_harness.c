@@ -0,0 +1,242 @@
+/*
+ * Files: handle_harness.c
+ * -----------------------
+ * Exercises the handle API of the explicit allocator.  It fragments the
+ * heap by allocating relocatable blocks interleaved with ordinary ones and
+ * freeing half of the relocatable blocks at random, pins a few of the rest,
+ * then runs bounded compaction steps until the compactor has nothing left
+ * to move.  The heap is sized to just hold every block, so the largest
+ * free block measures how scattered the free space is.  It reports the
+ * largest free block before and after, the number of steps, and the most
+ * bytes and cycles any single step took, and checks every block's contents
+ * and the heap's consistency at the end.
+ */
+
+#include <error.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "allocator.h"
+#include "handle.h"
+#include "segment.h"
+
+// Amount of memory reserved for the heap
+#define HEAP_SIZE (1L << 32)
+
+// Per-block bytes beyond the request that size the heap given to myinit;
+// it covers the header, handle link and rounding of every block
+#define BLOCK_OVERHEAD (16 + 2 * ALIGNMENT)
+
+// Every FIXED_EVERY-th block comes from mymalloc and never moves
+#define FIXED_EVERY 1000
+
+// Every PIN_EVERY-th surviving relocatable block stays locked
+#define PIN_EVERY 1000
+
+// Largest block size requested
+#define MAX_BLOCK_SIZE 1024
+
+// struct for one block the harness allocated
+typedef struct
+{
+    handle_t handle; // NULL for an ordinary block
+    void *ptr;       // address of an ordinary block
+    size_t size;
+    bool pinned;
+} block_t;
+
+/* FUNCTION PROTOTYPES */
+
+static void fill(void *ptr, size_t size, size_t id);
+static bool check(void *ptr, size_t size, size_t id);
+static void *block_address(block_t *block);
+static uint64_t now_cycles(void);
+
+/* Function: main
+ * --------------
+ * The main function parses command-line arguments (-n number of blocks,
+ * -s bytes per compaction step), runs the scenario above and prints its
+ * report.  Exits with status 1 if any block was corrupted or the heap is
+ * invalid.
+ */
+int main(int argc, char *argv[])
+{
+    int c;
+    size_t num_blocks = 20000;
+    size_t step_bytes = 4096;
+    while ((c = getopt(argc, argv, "n:s:")) != -1)
+    {
+        if (c == 'n')
+        {
+            num_blocks = strtoul(optarg, NULL, 10);
+        }
+        else if (c == 's')
+        {
+            step_bytes = strtoul(optarg, NULL, 10);
+        }
+        else
+        {
+            error(1, 0, "Usage: %s [-n blocks] [-s bytes per step]", argv[0]);
+        }
+    }
+    if (num_blocks == 0 || step_bytes == 0)
+    {
+        error(1, 0, "Need at least one block and one byte per step.");
+    }
+
+    block_t *blocks = calloc(num_blocks, sizeof(block_t));
+    size_t heap_size = 0;
+    srand(1);
+    for (size_t i = 0; i < num_blocks; i++)
+    {
+        blocks[i].size = 1 + rand() % MAX_BLOCK_SIZE;
+        heap_size += (blocks[i].size + BLOCK_OVERHEAD) / ALIGNMENT * ALIGNMENT;
+    }
+
+    // only the explicit compaction steps below should move blocks
+    myconfig("compact_step", "0");
+    init_heap_segment(HEAP_SIZE);
+    if (heap_size > HEAP_SIZE || !myinit(heap_segment_start(), heap_size))
+    {
+        error(1, 0, "Could not initialize the heap.");
+    }
+
+    for (size_t i = 0; i < num_blocks; i++)
+    {
+        if (i % FIXED_EVERY == 0)
+        {
+            blocks[i].ptr = mymalloc(blocks[i].size);
+        }
+        else
+        {
+            blocks[i].handle = hmalloc(blocks[i].size);
+        }
+        void *ptr = block_address(&blocks[i]);
+        if (ptr == NULL)
+        {
+            error(1, 0, "Allocation %zu of %zu bytes failed.", i, blocks[i].size);
+        }
+        fill(ptr, blocks[i].size, i);
+        if (blocks[i].handle != NULL)
+        {
+            hunlock(blocks[i].handle);
+        }
+    }
+    size_t survivors = 0;
+    for (size_t i = 0; i < num_blocks; i++)
+    {
+        if (blocks[i].handle == NULL)
+        {
+            continue;
+        }
+        if (rand() % 2 == 0)
+        {
+            hfree(blocks[i].handle);
+            blocks[i].handle = NULL;
+            blocks[i].size = 0;
+        }
+        else if (++survivors % PIN_EVERY == 0)
+        {
+            hlock(blocks[i].handle);
+            blocks[i].pinned = true;
+        }
+    }
+    size_t largest_before = hlargest_free();
+
+    size_t steps = 0;
+    size_t moved = 0;
+    size_t worst_bytes = 0;
+    uint64_t worst_cycles = 0;
+    for (size_t idle = 0; idle < num_blocks / 16 + 2; steps++)
+    {
+        uint64_t start = now_cycles();
+        size_t bytes = hcompact(step_bytes);
+        uint64_t cycles = now_cycles() - start;
+        moved += bytes;
+        idle = bytes == 0 ? idle + 1 : 0;
+        worst_bytes = bytes > worst_bytes ? bytes : worst_bytes;
+        worst_cycles = cycles > worst_cycles ? cycles : worst_cycles;
+    }
+    size_t largest_after = hlargest_free();
+
+    size_t failures = 0;
+    for (size_t i = 0; i < num_blocks; i++)
+    {
+        if (blocks[i].ptr == NULL && blocks[i].handle == NULL)
+        {
+            continue;
+        }
+        if (!check(block_address(&blocks[i]), blocks[i].size, i))
+        {
+            printf("block %zu was corrupted\n", i);
+            failures++;
+        }
+        if (blocks[i].handle != NULL)
+        {
+            hunlock(blocks[i].handle);
+        }
+    }
+    bool valid = validate_heap();
+    free(blocks);
+
+    printf("Largest free block before compaction = %zu bytes\n", largest_before);
+    printf("Largest free block after compaction  = %zu bytes\n", largest_after);
+    printf("%zu steps moved %zu bytes; worst step %zu bytes, %lu cycles\n", steps, moved,
+           worst_bytes, (unsigned long)worst_cycles);
+    printf("%zu failures, heap %s\n", failures, valid ? "valid" : "INVALID");
+    return failures == 0 && valid ? 0 : 1;
+}
+
+/* Function: fill
+ * --------------
+ * Fills a block with a byte pattern derived from its id.
+ */
+static void fill(void *ptr, size_t size, size_t id)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        ((uint8_t *)ptr)[i] = (uint8_t)(id + i);
+    }
+}
+
+/* Function: check
+ * ---------------
+ * Returns true if a block still holds the pattern fill wrote.
+ */
+static bool check(void *ptr, size_t size, size_t id)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (((uint8_t *)ptr)[i] != (uint8_t)(id + i))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Function: block_address
+ * -----------------------
+ * Returns the current address of a block.  A relocatable block is locked
+ * by this call, and the caller unlocks it when done.
+ */
+static void *block_address(block_t *block)
+{
+    return block->handle != NULL ? hlock(block->handle) : block->ptr;
+}
+
+/* Function: now_cycles
+ * --------------------
+ * Returns the CPU timestamp counter, or 0 on machines without one.
+ */
+static uint64_t now_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
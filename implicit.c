@@ -8,18 +8,75 @@
 #include <string.h>
 
 
+// Headers are a size_t, or with COMPACT_HEADERS 32 bits; either holds the
+// block size in ALIGNMENT granules above the flag bits. A header shorter
+// than ALIGNMENT sits at the end of a granule, so heap_lo (the first header)
+// is HDR_PAD bytes past the segment start and payloads stay aligned.
+#ifdef COMPACT_HEADERS
+typedef uint32_t hdr_t;
+#else
+typedef size_t hdr_t;
+#endif
+
+// Side table: with SIDE_TABLE nonzero (or myconfig "table" on), every
+// block's size and allocation bit are also kept in a dense table of 32-bit
+// entries in block order, so first fit scans contiguous memory and compares
+// TABLE_LANES sizes at once instead of loading one header per block.
+#ifndef SIDE_TABLE
+#define SIDE_TABLE 0
+#endif
+
+// Nonzero (or myconfig "prefetch" on) prefetches the next header while the
+// header walk examines the current one. Off by default, as the walk loads
+// that header right after, so there is no time for the prefetch to help.
+#ifndef PREFETCH
+#define PREFETCH 0
+#endif
+
 // cosntants
 static uint8_t *heap_lo = NULL;
 static uint8_t *heap_hi = NULL;
 
 enum {
-    HDR_SIZE = 8,
+    HDR_SIZE = sizeof(hdr_t),
+    HDR_PAD = (ALIGNMENT - sizeof(hdr_t) % ALIGNMENT) % ALIGNMENT,
+    FLAG_BITS = 3,
     FLAG_MASK = 0x7,   // lower 3 bits reserved for flags
     ALLOC_BIT =  0x1,   // allocation flag in bit 0
-    MIN_PAYLOAD = 8,
-    PREVIEW_BYTES = 16
+    REALLOC_BIT = 0x2,  // realloc-heavy block that keeps its slack
+    MIN_PAYLOAD = HDR_PAD > 0 ? HDR_PAD : 8,
+    PREVIEW_BYTES = 16,
+    TABLE_CHUNK = 64,   // entries per table chunk; a full chunk splits in two
+    TABLE_SHARE = 16    // the table takes 1/TABLE_SHARE of the segment, at its top
 };
 
+// Entries compared at once: one native vector register. A vector wider
+// than the target's registers is split up by the compiler and runs several
+// times slower.
+#ifdef __AVX2__
+#define TABLE_LANES 8
+#else
+#define TABLE_LANES 4
+#endif
+
+// A table entry is a block size in granules, made negative by
+// TABLE_ALLOC_BIT for an allocated block; unused entries are 0
+#define TABLE_ALLOC_BIT INT32_MIN
+
+typedef int32_t lanes_t __attribute__((vector_size(TABLE_LANES * sizeof(int32_t))));
+
+// The table is an array of chunks in block order. Each chunk records the
+// granule offset of its first block, so a block is found by binary search.
+static bool table_next = SIDE_TABLE;            // setting for the next myinit
+static bool table_on = false;
+static bool prefetch_next = PREFETCH;           // setting for the next myinit
+static bool prefetch_on = false;
+static int32_t (*table_entries)[TABLE_CHUNK] = NULL;
+static uint32_t *table_start = NULL;            // offset of each chunk's first block
+static uint8_t *table_len = NULL;               // entries used in each chunk
+static size_t table_chunks = 0;                 // chunks in use
+static size_t table_cap = 0;                    // chunks that fit
+
 
 
 // helper funcs
@@ -33,22 +90,22 @@ static inline size_t align_up(size_t n) {
 }
 
 // Raw header read/write
-static inline size_t hdr_load(const void *hdrp) {
-    return *(const size_t *)hdrp;
+static inline hdr_t hdr_load(const void *hdrp) {
+    return *(const hdr_t *)hdrp;
 }
 
-static inline void hdr_store(void *hdrp, size_t value) {
-    *(size_t *)hdrp = value;
+static inline void hdr_store(void *hdrp, hdr_t value) {
+    *(hdr_t *)hdrp = value;
 }
 
 
 // Pack/unpack
-static inline size_t pack(size_t total_block_size, bool allocated) {
-    return (total_block_size & ~(size_t)FLAG_MASK) | (allocated ? ALLOC_BIT : 0);
+static inline hdr_t pack(size_t total_block_size, bool allocated) {
+    return (hdr_t)((total_block_size / ALIGNMENT) << FLAG_BITS) | (allocated ? ALLOC_BIT : 0);
 }
 
 static inline size_t block_size(const void *hdrp) {
-    return hdr_load(hdrp) & ~(size_t)FLAG_MASK;
+    return (size_t)(hdr_load(hdrp) >> FLAG_BITS) * ALIGNMENT;
 }
 
 static inline bool is_alloc(const void *hdrp) {
@@ -80,9 +137,184 @@ static inline bool aligned_ptr(const void *p) {
 
 // smallest reasonable size block
 static inline size_t min_block_size(void) {
-    return HDR_SIZE + MIN_PAYLOAD;
+    return align_up(HDR_SIZE + MIN_PAYLOAD);
+}
+
+// block size for a payload of n bytes, or SIZE_MAX on overflow
+static inline size_t total_for(size_t n) {
+    if (n > SIZE_MAX - HDR_SIZE - ALIGNMENT) {
+        return SIZE_MAX;
+    }
+    size_t total = align_up(HDR_SIZE + n);
+    return total < min_block_size() ? min_block_size() : total;
+}
+
+
+// Table entries
+static inline int32_t table_entry(size_t total_block_size, bool allocated) {
+    return (int32_t)(total_block_size / ALIGNMENT) | (allocated ? TABLE_ALLOC_BIT : 0);
+}
+
+static inline size_t entry_size(int32_t e) {
+    return (size_t)(e & INT32_MAX) * ALIGNMENT;
+}
+
+// Find the chunk and entry of the block at hdr; false if no block starts there
+static bool table_locate(const uint8_t *hdr, size_t *c_out, size_t *i_out) {
+    size_t off = (size_t)(hdr - heap_lo) / ALIGNMENT;
+    size_t lo = 0, hi = table_chunks;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (table_start[mid] <= off) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t at = table_start[lo];
+    for (size_t i = 0; i < table_len[lo]; i++) {
+        if (at == off) {
+            *c_out = lo;
+            *i_out = i;
+            return true;
+        }
+        at += table_entries[lo][i] & INT32_MAX;
+    }
+    return false;
+}
+
+// Index of the first entry in chunk c for a free block of at least need
+// granules, or -1. Allocated entries are negative and unused ones 0, so one
+// signed comparison per lane tests both.
+static int chunk_first_fit(size_t c, int32_t need) {
+    lanes_t want = {0};
+    want += need;
+    for (int i = 0; i < TABLE_CHUNK; i += TABLE_LANES) {
+        lanes_t hit = *(const lanes_t *)&table_entries[c][i] >= want;
+        uint64_t any[sizeof(lanes_t) / sizeof(uint64_t)];
+        memcpy(any, &hit, sizeof(hit));
+        uint64_t folded = 0;
+        for (size_t w = 0; w < sizeof(any) / sizeof(any[0]); w++) {
+            folded |= any[w];
+        }
+        if (folded != 0) {
+            for (int j = 0; j < TABLE_LANES; j++) {
+                if (hit[j]) {
+                    return i + j;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+// First-fit search of the table; returns the header of the block or NULL
+static uint8_t *table_first_fit(size_t need_total) {
+    int32_t need = (int32_t)(need_total / ALIGNMENT);
+    for (size_t c = 0; c < table_chunks; c++) {
+        int i = chunk_first_fit(c, need);
+        if (i >= 0) {
+            size_t at = table_start[c];
+            for (int j = 0; j < i; j++) {
+                at += table_entries[c][j] & INT32_MAX;
+            }
+            return heap_lo + at * ALIGNMENT;
+        }
+    }
+    return NULL;
+}
+
+// Record a new allocation bit for the block at hdr
+static void table_mark(const uint8_t *hdr, bool allocated) {
+    size_t c, i;
+    if (table_locate(hdr, &c, &i)) {
+        table_entries[c][i] = table_entry(entry_size(table_entries[c][i]), allocated);
+    }
+}
+
+// Record the split of the block at hdr into an allocated front of front
+// bytes and a free remainder. Returns false, changing nothing, if the table
+// has no room for another entry; the caller then does not split.
+static bool table_split(const uint8_t *hdr, size_t front) {
+    size_t c, i;
+    if (!table_locate(hdr, &c, &i)) {
+        return false;
+    }
+    size_t rem = entry_size(table_entries[c][i]) - front;
+    if (table_len[c] == TABLE_CHUNK) {
+        if (table_chunks == table_cap) {
+            return false;
+        }
+        // Split the full chunk, moving its upper half into a new chunk after it
+        size_t half = TABLE_CHUNK / 2;
+        size_t later = table_chunks - c - 1;
+        memmove(table_entries[c + 2], table_entries[c + 1], later * sizeof(table_entries[0]));
+        memmove(&table_start[c + 2], &table_start[c + 1], later * sizeof(table_start[0]));
+        memmove(&table_len[c + 2], &table_len[c + 1], later * sizeof(table_len[0]));
+        table_chunks++;
+        size_t at = table_start[c];
+        for (size_t j = 0; j < half; j++) {
+            at += table_entries[c][j] & INT32_MAX;
+        }
+        memcpy(table_entries[c + 1], &table_entries[c][half], half * sizeof(int32_t));
+        memset(&table_entries[c + 1][half], 0, half * sizeof(int32_t));
+        memset(&table_entries[c][half], 0, half * sizeof(int32_t));
+        table_start[c + 1] = (uint32_t)at;
+        table_len[c] = (uint8_t)half;
+        table_len[c + 1] = (uint8_t)half;
+        if (i >= half) {
+            c++;
+            i -= half;
+        }
+    }
+    int32_t *e = table_entries[c];
+    memmove(&e[i + 2], &e[i + 1], (table_len[c] - i - 1) * sizeof(int32_t));
+    e[i] = table_entry(front, true);
+    e[i + 1] = table_entry(rem, false);
+    table_len[c]++;
+    return true;
 }
 
+// Place the table in the top 1/TABLE_SHARE of the segment, holding one
+// block of total bytes; returns the bytes left for the heap, or 0 if the
+// table does not fit
+static size_t table_init(void *heap_start, size_t heap_size) {
+    uintptr_t end = (uintptr_t)heap_start + heap_size;
+    uintptr_t base = (end - heap_size / TABLE_SHARE + 63) & ~(uintptr_t)63;
+    size_t per_chunk = sizeof(table_entries[0]) + sizeof(table_start[0]) + sizeof(table_len[0]);
+    if (base >= end || (end - base) / per_chunk == 0 || base < (uintptr_t)heap_lo) {
+        return 0;
+    }
+    table_cap = (end - base) / per_chunk;
+    table_entries = (int32_t (*)[TABLE_CHUNK])base;
+    table_start = (uint32_t *)(base + table_cap * sizeof(table_entries[0]));
+    table_len = (uint8_t *)(table_start + table_cap);
+    table_chunks = 1;
+    size_t total = (base - (uintptr_t)heap_lo) & ~(size_t)(ALIGNMENT - 1);
+    if (total / ALIGNMENT > INT32_MAX) {
+        total = (size_t)INT32_MAX * ALIGNMENT;
+    }
+    memset(table_entries[0], 0, sizeof(table_entries[0]));
+    table_entries[0][0] = table_entry(total, false);
+    table_start[0] = 0;
+    table_len[0] = 1;
+    return total;
+}
+
+// Options: table=on|off and prefetch=on|off
+bool myconfig(const char *key, const char *value) {
+    bool *setting = NULL;
+    if (strcmp(key, "table") == 0) {
+        setting = &table_next;
+    } else if (strcmp(key, "prefetch") == 0) {
+        setting = &prefetch_next;
+    }
+    if (setting == NULL || (strcmp(value, "on") != 0 && strcmp(value, "off") != 0)) {
+        return false;
+    }
+    *setting = (strcmp(value, "on") == 0);
+    return true;
+}
 
 bool myinit(void *heap_start, size_t heap_size) {
     breakpoint();
@@ -90,23 +322,31 @@ bool myinit(void *heap_start, size_t heap_size) {
         return false;
     }
     // Reset globals
-    heap_lo = (uint8_t *)heap_start;
+    heap_lo = (uint8_t *)heap_start + HDR_PAD;
     
     breakpoint();
     // Trim heap to ALIGNMENT and sanity-check capacity
-    size_t total = heap_size & ~(size_t)(ALIGNMENT - 1);
-    if (total < min_block_size()) {
+    if (heap_size < HDR_PAD + min_block_size()) {
         return false;
     }
+    size_t total = (heap_size - HDR_PAD) & ~(size_t)(ALIGNMENT - 1);
+    table_on = table_next;
+    prefetch_on = prefetch_next;
+    if (table_on) {
+        total = table_init(heap_start, heap_size);
+        if (total < min_block_size()) {
+            return false;
+        }
+    }
+    if ((total / ALIGNMENT) >> (8 * sizeof(hdr_t) - FLAG_BITS) != 0) {
+        return false;  // too many granules for a header
+    }
 
     // Compute hi after trimming and validate
     heap_hi = heap_lo + total;
     if (!aligned_ptr(heap_start)) {
         return false;  // should already be true per spec
     }
-    if (((uintptr_t)heap_hi & (ALIGNMENT - 1)) != 0) {
-        return false;
-    }
     if (heap_hi < heap_lo) {
         return false;  // overflow guard
     }
@@ -125,38 +365,68 @@ void *mymalloc(size_t requested_size) {
         return NULL;  // not initialized
     }
 
-    // Align the payload; compute total size (header + payload) with overflow guard
-    size_t need_payload = align_up(requested_size);
-    if (need_payload > SIZE_MAX - HDR_SIZE) {
+    // Total size (header + aligned payload) with overflow guard
+    size_t need_total = total_for(requested_size);
+    if (need_total == SIZE_MAX) {
         return NULL;  // overflow check
     }
-    size_t need_total = need_payload + HDR_SIZE;
-
-    // First-fit search over implicit list
-    for (uint8_t *hdr = heap_lo; hdr < heap_hi; hdr = (uint8_t *)next_hdr(hdr)) {
-        size_t sz = block_size(hdr);
-        bool a = is_alloc(hdr);
-
-        if (!a && sz >= need_total) {
-            size_t rem = sz - need_total;
 
-            if (rem >= min_block_size()) {
-                // Split: allocate front part, leave remainder as a free block
-                hdr_store(hdr, pack(need_total, true));
-
-                uint8_t *split_hdr = (uint8_t *)hdr + need_total;
-                hdr_store(split_hdr, pack(rem, false));
-            } else {
-                // No useful split; consume the whole free block
-                hdr_store(hdr, pack(sz, true));
+    // First-fit search over the side table, or else the implicit list
+    uint8_t *hdr = NULL;
+    if (table_on) {
+        hdr = table_first_fit(need_total);
+    } else {
+        // The next header's address is known once this header is read, so
+        // its load can start before this block is examined; going further
+        // ahead would need the next header itself
+        for (uint8_t *h = heap_lo, *next; h < heap_hi; h = next) {
+            next = (uint8_t *)next_hdr(h);
+            if (prefetch_on && next < heap_hi) {
+                __builtin_prefetch(next);
+            }
+            if (!is_alloc(h) && block_size(h) >= need_total) {
+                hdr = h;
+                break;
             }
+        }
+    }
+    if (hdr == NULL) {
+        return NULL;  // No fit
+    }
 
-            return payload_from_hdr(hdr);
+    size_t sz = block_size(hdr);
+    size_t rem = sz - need_total;
+    if (rem >= min_block_size() && (!table_on || table_split(hdr, need_total))) {
+        // Split: allocate front part, leave remainder as a free block
+        hdr_store(hdr, pack(need_total, true));
+
+        uint8_t *split_hdr = (uint8_t *)hdr + need_total;
+        hdr_store(split_hdr, pack(rem, false));
+    } else {
+        // No useful split; consume the whole free block
+        hdr_store(hdr, pack(sz, true));
+        if (table_on) {
+            table_mark(hdr, true);
         }
     }
+    return payload_from_hdr(hdr);
+}
 
-    // No fit
-    return NULL;
+// Allocation step of mymalloc_flags: realloc-heavy blocks are flagged to
+// keep their slack through myrealloc
+static void *malloc_hinted(size_t size, unsigned flags) {
+    void *ptr = mymalloc(size);
+    if (ptr != NULL && (flags & MALLOC_REALLOC_HEAVY)) {
+        uint8_t *hdr = hdr_from_payload(ptr);
+        hdr_store(hdr, hdr_load(hdr) | REALLOC_BIT);
+    }
+    return ptr;
+}
+
+// Reserves slack for realloc-heavy blocks and zeroes on request; hot blocks
+// get no special placement
+void *mymalloc_flags(size_t requested_size, unsigned flags) {
+    return malloc_flagged(malloc_hinted, requested_size, flags);
 }
 
 void myfree(void *ptr) {
@@ -180,6 +450,9 @@ void myfree(void *ptr) {
         return;
     }
     hdr_store(hdr, pack(sz, false));
+    if (table_on) {
+        table_mark(hdr, false);
+    }
 }
 
 void *myrealloc(void *old_ptr, size_t new_size) {
@@ -196,19 +469,22 @@ void *myrealloc(void *old_ptr, size_t new_size) {
     size_t old_pay = (old_total >= HDR_SIZE) ? (old_total - HDR_SIZE) : 0;
 
     // Compute needed total (header + aligned payload)
-    size_t need_pay = align_up(new_size);
-    if (need_pay > SIZE_MAX - HDR_SIZE) {
+    size_t need_total = total_for(new_size);
+    if (need_total == SIZE_MAX) {
         // overflow guard: can't satisfy
         return NULL;
     }
-    size_t need_total = need_pay + HDR_SIZE;
 
+    // A realloc-heavy block keeps its slack: a shrink splits off only the
+    // tail beyond it, and a block that has to move reserves it again
+    bool heavy = (hdr_load(old_hdr) & REALLOC_BIT) != 0;
     if (need_total <= old_total) {
-        size_t rem = old_total - need_total;
-        if (rem >= (HDR_SIZE + MIN_PAYLOAD)) {
+        size_t keep_total = heavy ? total_for(realloc_reserve(new_size)) : need_total;
+        size_t rem = keep_total < old_total ? old_total - keep_total : 0;
+        if (rem >= min_block_size() && (!table_on || table_split(old_hdr, keep_total))) {
             // Split: keep front as ALLOC, leave remainder as FREE^
-            hdr_store(old_hdr, pack(need_total, true));
-            uint8_t *split_hdr = old_hdr + need_total;
+            hdr_store(old_hdr, pack(keep_total, true) | (heavy ? REALLOC_BIT : 0));
+            uint8_t *split_hdr = old_hdr + keep_total;
             hdr_store(split_hdr, pack(rem, false));
         }
         // If remainder too tiny, keep the current block size
@@ -216,7 +492,7 @@ void *myrealloc(void *old_ptr, size_t new_size) {
     }
 
     // Need a bigger block: allocate new, copy, free old
-    void *new_ptr = mymalloc(new_size);
+    void *new_ptr = heavy ? mymalloc_flags(new_size, MALLOC_REALLOC_HEAVY) : mymalloc(new_size);
     if (new_ptr == NULL) {
         // Per realloc contract, old block stays valid on failure
         return NULL;
@@ -228,6 +504,46 @@ void *myrealloc(void *old_ptr, size_t new_size) {
     return new_ptr;
 }
 
+size_t myusable_size(void *ptr) {
+    if (ptr == NULL || !aligned_ptr(ptr)) {
+        return 0;
+    }
+    uint8_t *hdr = (uint8_t *)hdr_from_payload(ptr);
+    if (!in_heap(hdr) || hdr >= heap_hi || !is_alloc(hdr)) {
+        return 0;
+    }
+    return block_size(hdr) - HDR_SIZE;
+}
+
+// The side table must list every block in order, with matching size and
+// allocation bit, and zeros in every unused entry
+static bool validate_table(void) {
+    if (table_chunks == 0 || table_chunks > table_cap) {
+        return false;
+    }
+    uint8_t *hdr = heap_lo;
+    for (size_t c = 0; c < table_chunks; c++) {
+        if (table_len[c] == 0 || table_len[c] > TABLE_CHUNK ||
+            table_start[c] != (size_t)(hdr - heap_lo) / ALIGNMENT) {
+            return false;
+        }
+        for (size_t i = 0; i < TABLE_CHUNK; i++) {
+            int32_t e = table_entries[c][i];
+            if (i >= table_len[c]) {
+                if (e != 0) {
+                    return false;
+                }
+                continue;
+            }
+            if (hdr >= heap_hi || e != table_entry(block_size(hdr), is_alloc(hdr))) {
+                return false;
+            }
+            hdr += block_size(hdr);
+        }
+    }
+    return hdr == heap_hi;
+}
+
 bool validate_heap() {
     if (heap_lo == NULL || heap_hi == NULL) {
         return false;
@@ -236,11 +552,8 @@ bool validate_heap() {
         return false;
     }
 
-    // Alignment of bounds
-    if ((((uintptr_t)heap_lo) & (ALIGNMENT - 1)) != 0) {
-        return false;
-    }
-    if ((((uintptr_t)heap_hi) & (ALIGNMENT - 1)) != 0) {
+    // Alignment of bounds: every header ends on an alignment boundary
+    if (!aligned_ptr(heap_lo + HDR_SIZE) || !aligned_ptr(heap_hi + HDR_SIZE)) {
         return false;
     }
 
@@ -256,7 +569,7 @@ bool validate_heap() {
         if ((sz & (ALIGNMENT - 1)) != 0) {
             return false;
         }
-        if (sz < (HDR_SIZE + MIN_PAYLOAD)) {
+        if (sz < min_block_size()) {
             return false;
         }
 
@@ -271,7 +584,7 @@ bool validate_heap() {
     if (hdr != heap_hi) {
         return false;
     }
-    return true;
+    return !table_on || validate_table();
 }
 
 /* Function: dump_heap
@@ -302,7 +615,7 @@ static void print_payload(uint8_t *payload, size_t pay) {
 }
 
 static bool block_corrupt(uint8_t *hdr, size_t sz, uint8_t *next) {
-    return sz < (HDR_SIZE + MIN_PAYLOAD)  || (sz & (ALIGNMENT - 1)) != 0 || next <= hdr || next > heap_hi;
+    return sz < min_block_size()  || (sz & (ALIGNMENT - 1)) != 0 || next <= hdr || next > heap_hi;
 }
 
 
@@ -314,6 +627,9 @@ void dump_heap(void) {
 
     size_t total = (size_t)(heap_hi - heap_lo);
     printf("HEAP [%p .. %p) total=%zu bytes\n", heap_lo, heap_hi, total);
+    if (table_on) {
+        printf("TABLE at %p, %zu of %zu chunks\n", (void *)table_entries, table_chunks, table_cap);
+    }
 
     size_t idx = 0;
     uint8_t *hdr = heap_lo;
@@ -0,0 +1,29 @@
+/* File: lifetime.h
+ * ----------------
+ * Lifetime hints for the explicit allocator. With lifetime segregation on
+ * (myconfig("lifetime", "on")), the explicit allocator keeps blocks it
+ * expects to be freed soon apart from blocks it expects to live long, so
+ * long-lived survivors do not pin down space between short-lived blocks.
+ * The expectation comes from the caller's hint when given, and otherwise
+ * from what the allocator has seen of blocks of similar size.
+ */
+
+#ifndef _LIFETIME_H
+#define _LIFETIME_H
+
+#include <stddef.h>
+
+typedef enum {
+    LIFETIME_UNKNOWN,   // let the allocator predict
+    LIFETIME_SHORT,     // expected to be freed soon
+    LIFETIME_LONG       // expected to outlive most other blocks
+} lifetime_t;
+
+/* Function: mymalloc_lifetime
+ * ---------------------------
+ * Like mymalloc, but places the block with others of the given expected
+ * lifetime. The hint is ignored while lifetime segregation is off.
+ */
+void *mymalloc_lifetime(size_t requested_size, lifetime_t hint);
+
+#endif
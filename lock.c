@@ -0,0 +1,95 @@
+/* File: lock.c
+ * ------------
+ * The spin-then-futex lock of lock.h. The state word follows Drepper's
+ * "Futexes Are Tricky": 0 is free, 1 is held, and 2 is held with possible
+ * sleepers, so a release only makes a system call when someone may be
+ * asleep.
+ */
+
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "./lock.h"
+
+// bounds on the number of pause iterations before sleeping
+#define MIN_SPINS 10
+#define MAX_SPINS 200
+
+enum { FREE, HELD, SLEEPERS };
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline uint64_t now_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+static inline bool try_take(lock_t *lock) {
+    uint32_t expected = FREE;
+    return __atomic_compare_exchange_n(&lock->state, &expected, HELD, false, __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED);
+}
+
+// Spins while the lock stays held, up to the adapted bound; returns how
+// many iterations it took to get the lock, or the bound if it never did
+static unsigned spin(lock_t *lock, unsigned limit) {
+    for (unsigned i = 0; i < limit; i++) {
+        cpu_relax();
+        if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == FREE && try_take(lock)) {
+            return i;
+        }
+    }
+    return limit;
+}
+
+void lock_acquire(lock_t *lock) {
+    if (!try_take(lock)) {
+        unsigned spin_limit = __atomic_load_n(&lock->spin_limit, __ATOMIC_RELAXED);
+        unsigned limit = spin_limit * 2 + MIN_SPINS < MAX_SPINS ? spin_limit * 2 + MIN_SPINS
+                                                                : MAX_SPINS;
+        unsigned spun = spin(lock, limit);
+        bool slept = spun == limit;
+        if (slept) {
+            // mark the lock as having sleepers, and sleep until it is free
+            while (__atomic_exchange_n(&lock->state, SLEEPERS, __ATOMIC_ACQUIRE) != FREE) {
+                syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, SLEEPERS, NULL, NULL, 0);
+            }
+        }
+        // we hold the lock: a wait that spinning ended moves the bound an
+        // eighth of the way toward its length, and one that slept halves it
+        __atomic_store_n(&lock->spin_limit,
+                         slept ? spin_limit / 2 : spin_limit + ((int)spun - (int)spin_limit) / 8,
+                         __ATOMIC_RELAXED);
+        lock->contended++;
+        lock->sleeps += slept;
+    }
+    lock->acquisitions++;
+    lock->acquired_at = now_cycles();
+}
+
+void lock_release(lock_t *lock) {
+    uint64_t held = now_cycles() - lock->acquired_at;
+    lock->hold_cycles += held;
+    if (held > lock->max_hold_cycles) {
+        lock->max_hold_cycles = held;
+    }
+    if (__atomic_exchange_n(&lock->state, FREE, __ATOMIC_RELEASE) == SLEEPERS) {
+        syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+void lock_reset_stats(lock_t *lock) {
+    lock->acquisitions = lock->contended = lock->sleeps = 0;
+    lock->hold_cycles = lock->max_hold_cycles = 0;
+}
@@ -0,0 +1,54 @@
+/* File: lock.h
+ * ------------
+ * An allocator-internal lock for critical sections a few dozen instructions
+ * long, where a mutex that puts a waiter to sleep at once costs more than
+ * the section. A thread that finds the lock held spins on it with pause
+ * for a bounded number of iterations, then sleeps on a futex until the
+ * holder wakes it. The spin bound adapts: like glibc's adaptive mutexes it
+ * follows how long waits that spinning ended took, and it halves whenever
+ * spinning failed, so a holder that is descheduled or slow stops costing
+ * its waiters cycles.
+ *
+ * The lock also counts its acquisitions, how many found it held and how
+ * many of those had to sleep, and how many cycles it was held. The
+ * counters are only written by the holder, so read them while no other
+ * thread can take the lock.
+ */
+
+#ifndef _LOCK_H
+#define _LOCK_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t state;                 // 0 free, 1 held, 2 held with sleepers
+    uint32_t spin_limit;            // adapted spin bound
+    uint64_t acquired_at;           // cycle count when last taken
+    unsigned long acquisitions;
+    unsigned long contended;        // found it held
+    unsigned long sleeps;           // gave up spinning and slept
+    uint64_t hold_cycles;           // total from acquire to release
+    uint64_t max_hold_cycles;
+} lock_t;
+
+#define LOCK_INITIALIZER {0}
+
+/* Function: lock_acquire
+ * ----------------------
+ * Takes the lock, spinning and then sleeping while another thread holds it.
+ */
+void lock_acquire(lock_t *lock);
+
+/* Function: lock_release
+ * ----------------------
+ * Releases the lock, waking one sleeper if there is any.
+ */
+void lock_release(lock_t *lock);
+
+/* Function: lock_reset_stats
+ * --------------------------
+ * Zeroes the counters. Only call it while no thread holds the lock.
+ */
+void lock_reset_stats(lock_t *lock);
+
+#endif
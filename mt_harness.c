@@ -0,0 +1,485 @@
+/*
+ * Files: mt_harness.c
+ * -------------------
+ * Multithreaded stress test for allocators that can be called from several
+ * threads at once.  Every thread runs a random sequence of malloc, realloc
+ * and free over its own table of blocks, and hands some blocks to other
+ * threads through a shared exchange table, so a block is often freed by a
+ * thread other than the one that allocated it.  Every block is filled with
+ * a pattern derived from its address and size, and checked before it is
+ * resized, handed off or freed.  When all threads are done, the main thread
+ * frees what is left, runs validate_heap and reports the throughput.
+ * Allocator options can be set through myconfig with -c key=value.
+ *
+ * With -p the threads instead form a pipeline: even-numbered threads only
+ * allocate, and pass every block through a shared queue to the
+ * odd-numbered threads, which only free.  The report ends with the
+ * counters the allocator keeps through mystats.
+ *
+ * With -a every free goes through myfree_async, for allocators that
+ * provide it, and the heap is validated after myfree_flush.  Either way
+ * the report includes the longest any single free call took.
+ */
+
+#include <error.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "allocator.h"
+#include "async.h"
+#include "segment.h"
+#include "stats.h"
+
+// Only some allocators free asynchronously; the others leave these NULL
+#pragma weak myfree_async
+#pragma weak myfree_flush
+
+/* TYPE DECLARATIONS */
+
+// struct for one worker thread
+typedef struct
+{
+    pthread_t thread;
+    unsigned seed;       // state of the thread's random number generator
+    void **blocks;       // blocks the thread currently holds
+    size_t *sizes;       // their sizes
+    long ops;            // allocator calls made
+    long handoffs;       // blocks passed to the exchange table
+    long failures;       // corrupted blocks or failed allocations
+    uint64_t worst_free_ns; // longest free call
+} worker_t;
+
+// Blocks each thread holds at most
+#define BLOCKS_PER_THREAD 1024
+
+// Slots in the table threads pass blocks through
+#define EXCHANGE_SLOTS 256
+
+// Percentage of frees that hand the block to another thread instead
+#define HANDOFF_PERCENT 30
+
+// Blocks the producer/consumer queue holds at most
+#define QUEUE_SLOTS 4096
+
+// Most allocator counters reported
+#define MAX_STATS 16
+
+// Amount of memory given to the allocator
+#define HEAP_SIZE (1L << 32)
+
+/* GLOBALS */
+
+static long g_ops_per_thread = 100000;
+static size_t g_max_size = 512;
+static void *g_exchange[EXCHANGE_SLOTS];
+static size_t g_exchange_sizes[EXCHANGE_SLOTS];
+static pthread_mutex_t g_exchange_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *g_queue[QUEUE_SLOTS];
+static size_t g_queue_sizes[QUEUE_SLOTS];
+static size_t g_queue_head;
+static size_t g_queue_len;
+static int g_producers_left;
+static bool g_async;
+
+/* FUNCTION PROTOTYPES */
+
+static void *run_worker(void *arg);
+static void *run_producer(void *arg);
+static void *run_consumer(void *arg);
+static void fill_block(void *ptr, size_t size);
+static bool check_block(void *ptr, size_t size);
+static void release_block(worker_t *worker, void *ptr, size_t size);
+static void apply_setting(char *arg);
+static uint64_t now_ns(void);
+
+/* Function: main
+ * --------------
+ * The main function parses command-line arguments (-t number of threads,
+ * -n allocator calls per thread, -s largest request size, -c key=value to
+ * set an allocator option, -p to run a producer/consumer pipeline, -a to
+ * free asynchronously), runs the worker threads, then frees every
+ * remaining block, validates the heap and prints the number of operations
+ * per second, the longest free and the allocator's counters.  Exits with
+ * status 1 if any block was corrupted or the heap is invalid.
+ */
+int main(int argc, char *argv[])
+{
+    int c;
+    int num_threads = 4;
+    bool pipeline = false;
+    while ((c = getopt(argc, argv, "t:n:s:c:pa")) != -1)
+    {
+        if (c == 't')
+        {
+            num_threads = atoi(optarg);
+        }
+        else if (c == 'n')
+        {
+            g_ops_per_thread = atol(optarg);
+        }
+        else if (c == 's')
+        {
+            g_max_size = strtoul(optarg, NULL, 10);
+        }
+        else if (c == 'c')
+        {
+            apply_setting(optarg);
+        }
+        else if (c == 'p')
+        {
+            pipeline = true;
+        }
+        else if (c == 'a')
+        {
+            g_async = true;
+        }
+        else
+        {
+            error(1, 0,
+                  "Usage: %s [-t threads] [-n ops per thread] [-s max size] [-c key=value] [-p] [-a]",
+                  argv[0]);
+        }
+    }
+    if (g_async && (myfree_async == NULL || myfree_flush == NULL))
+    {
+        error(1, 0, "This allocator has no myfree_async.");
+    }
+    if (num_threads < 1 || g_ops_per_thread < 1 || g_max_size < sizeof(size_t))
+    {
+        error(1, 0, "Need at least one thread, one op and a max size of %zu.", sizeof(size_t));
+    }
+    if (pipeline && num_threads < 2)
+    {
+        error(1, 0, "A pipeline needs at least two threads.");
+    }
+
+    void *heap_start = init_heap_segment(HEAP_SIZE);
+    if (heap_start == NULL || !myinit(heap_start, heap_segment_size()))
+    {
+        error(1, 0, "Could not initialize the heap.");
+    }
+
+    worker_t *workers = calloc(num_threads, sizeof(worker_t));
+    g_producers_left = (num_threads + 1) / 2;
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_threads; i++)
+    {
+        workers[i].seed = i + 1;
+        workers[i].blocks = calloc(BLOCKS_PER_THREAD, sizeof(void *));
+        workers[i].sizes = calloc(BLOCKS_PER_THREAD, sizeof(size_t));
+        void *(*run)(void *) = !pipeline ? run_worker : i % 2 == 0 ? run_producer : run_consumer;
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+    long ops = 0;
+    long handoffs = 0;
+    long failures = 0;
+    uint64_t worst_free_ns = 0;
+    for (int i = 0; i < num_threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+        handoffs += workers[i].handoffs;
+        failures += workers[i].failures;
+        if (workers[i].worst_free_ns > worst_free_ns)
+        {
+            worst_free_ns = workers[i].worst_free_ns;
+        }
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    // free what the threads left behind, from this thread
+    worker_t cleanup = {.seed = 0};
+    for (int i = 0; i < num_threads; i++)
+    {
+        for (int j = 0; j < BLOCKS_PER_THREAD; j++)
+        {
+            if (workers[i].blocks[j] != NULL)
+            {
+                release_block(&cleanup, workers[i].blocks[j], workers[i].sizes[j]);
+            }
+        }
+        free(workers[i].blocks);
+        free(workers[i].sizes);
+    }
+    for (int i = 0; i < EXCHANGE_SLOTS; i++)
+    {
+        if (g_exchange[i] != NULL)
+        {
+            release_block(&cleanup, g_exchange[i], g_exchange_sizes[i]);
+        }
+    }
+    free(workers);
+    failures += cleanup.failures;
+
+    if (g_async)
+    {
+        myfree_flush();
+    }
+    bool valid = validate_heap();
+    printf("%d threads: %ld ops, %ld handoffs, %ld failures, heap %s\n",
+           num_threads, ops, handoffs, failures, valid ? "valid" : "INVALID");
+    printf("Throughput = %.0f ops/sec\n", ops / seconds);
+    printf("Worst free = %lu ns\n", (unsigned long)worst_free_ns);
+    stat_t stats[MAX_STATS];
+    size_t num_stats = mystats(stats, MAX_STATS);
+    for (size_t i = 0; i < num_stats; i++)
+    {
+        printf("%s = %lu\n", stats[i].name, stats[i].value);
+    }
+    return failures == 0 && valid ? 0 : 1;
+}
+
+/* Function: run_worker
+ * --------------------
+ * Runs one thread's share of allocator calls.  Each call picks a random
+ * slot of the thread's table: an empty slot gets a new block, and a full
+ * one is resized, freed, or swapped with a random exchange slot, whose
+ * previous block, allocated by some other thread, is then freed here.
+ */
+static void *run_worker(void *arg)
+{
+    worker_t *worker = arg;
+    for (long n = 0; n < g_ops_per_thread; n++)
+    {
+        int slot = rand_r(&worker->seed) % BLOCKS_PER_THREAD;
+        void *ptr = worker->blocks[slot];
+        size_t size = worker->sizes[slot];
+        worker->ops++;
+        if (ptr == NULL)
+        {
+            size = sizeof(size_t) + rand_r(&worker->seed) % (g_max_size - sizeof(size_t) + 1);
+            ptr = mymalloc(size);
+            if (ptr == NULL)
+            {
+                worker->failures++;
+                continue;
+            }
+            fill_block(ptr, size);
+            worker->blocks[slot] = ptr;
+            worker->sizes[slot] = size;
+            continue;
+        }
+
+        int action = rand_r(&worker->seed) % 100;
+        worker->blocks[slot] = NULL;
+        if (action < 10)
+        {
+            size_t new_size = sizeof(size_t) +
+                              rand_r(&worker->seed) % (g_max_size - sizeof(size_t) + 1);
+            if (!check_block(ptr, size))
+            {
+                worker->failures++;
+                continue;
+            }
+            void *new_ptr = myrealloc(ptr, new_size);
+            if (new_ptr == NULL)
+            {
+                worker->failures++;
+                continue;
+            }
+            fill_block(new_ptr, new_size);
+            worker->blocks[slot] = new_ptr;
+            worker->sizes[slot] = new_size;
+        }
+        else if (action < 10 + HANDOFF_PERCENT)
+        {
+            if (!check_block(ptr, size))
+            {
+                worker->failures++;
+                continue;
+            }
+            int other = rand_r(&worker->seed) % EXCHANGE_SLOTS;
+            pthread_mutex_lock(&g_exchange_lock);
+            void *theirs = g_exchange[other];
+            size_t their_size = g_exchange_sizes[other];
+            g_exchange[other] = ptr;
+            g_exchange_sizes[other] = size;
+            pthread_mutex_unlock(&g_exchange_lock);
+            worker->handoffs++;
+            if (theirs != NULL)
+            {
+                release_block(worker, theirs, their_size);
+            }
+        }
+        else
+        {
+            release_block(worker, ptr, size);
+        }
+    }
+    return NULL;
+}
+
+/* Function: run_producer
+ * ----------------------
+ * Allocates the thread's share of blocks and passes each one to the
+ * consumers through the queue, waiting while the queue is full.
+ */
+static void *run_producer(void *arg)
+{
+    worker_t *worker = arg;
+    for (long n = 0; n < g_ops_per_thread; n++)
+    {
+        size_t size = sizeof(size_t) + rand_r(&worker->seed) % (g_max_size - sizeof(size_t) + 1);
+        void *ptr = mymalloc(size);
+        worker->ops++;
+        if (ptr == NULL)
+        {
+            worker->failures++;
+            continue;
+        }
+        fill_block(ptr, size);
+        for (bool queued = false; !queued;)
+        {
+            pthread_mutex_lock(&g_exchange_lock);
+            queued = g_queue_len < QUEUE_SLOTS;
+            if (queued)
+            {
+                size_t tail = (g_queue_head + g_queue_len++) % QUEUE_SLOTS;
+                g_queue[tail] = ptr;
+                g_queue_sizes[tail] = size;
+            }
+            pthread_mutex_unlock(&g_exchange_lock);
+            if (!queued)
+            {
+                sched_yield();
+            }
+        }
+        worker->handoffs++;
+    }
+    __atomic_fetch_sub(&g_producers_left, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Function: run_consumer
+ * ----------------------
+ * Frees blocks from the queue until it is empty and every producer is done.
+ */
+static void *run_consumer(void *arg)
+{
+    worker_t *worker = arg;
+    for (;;)
+    {
+        bool done = __atomic_load_n(&g_producers_left, __ATOMIC_ACQUIRE) == 0;
+        pthread_mutex_lock(&g_exchange_lock);
+        void *ptr = NULL;
+        size_t size = 0;
+        if (g_queue_len > 0)
+        {
+            ptr = g_queue[g_queue_head];
+            size = g_queue_sizes[g_queue_head];
+            g_queue_head = (g_queue_head + 1) % QUEUE_SLOTS;
+            g_queue_len--;
+        }
+        pthread_mutex_unlock(&g_exchange_lock);
+        if (ptr != NULL)
+        {
+            release_block(worker, ptr, size);
+            worker->ops++;
+        }
+        else if (done)
+        {
+            return NULL;
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+}
+
+/* Function: fill_block
+ * --------------------
+ * Writes the block's size into its first word and a byte pattern derived
+ * from its address and size into the rest.
+ */
+static void fill_block(void *ptr, size_t size)
+{
+    memcpy(ptr, &size, sizeof(size));
+    uint8_t pattern = (uint8_t)(((uintptr_t)ptr >> 3) ^ size);
+    memset((uint8_t *)ptr + sizeof(size), pattern, size - sizeof(size));
+}
+
+/* Function: check_block
+ * ---------------------
+ * Returns true if the block still holds what fill_block wrote, and
+ * otherwise reports the corruption.
+ */
+static bool check_block(void *ptr, size_t size)
+{
+    size_t stored;
+    memcpy(&stored, ptr, sizeof(stored));
+    uint8_t pattern = (uint8_t)(((uintptr_t)ptr >> 3) ^ size);
+    bool ok = stored == size;
+    for (size_t i = sizeof(size); ok && i < size; i++)
+    {
+        ok = ((uint8_t *)ptr)[i] == pattern;
+    }
+    if (!ok)
+    {
+        printf("block %p of %zu bytes was corrupted\n", ptr, size);
+    }
+    return ok;
+}
+
+/* Function: release_block
+ * -----------------------
+ * Checks a block and frees it, counting a failure if it was corrupted and
+ * timing the free call.
+ */
+static void release_block(worker_t *worker, void *ptr, size_t size)
+{
+    if (!check_block(ptr, size))
+    {
+        worker->failures++;
+    }
+    uint64_t start = now_ns();
+    if (g_async)
+    {
+        myfree_async(ptr);
+    }
+    else
+    {
+        myfree(ptr);
+    }
+    uint64_t elapsed = now_ns() - start;
+    if (elapsed > worker->worst_free_ns)
+    {
+        worker->worst_free_ns = elapsed;
+    }
+}
+
+/* Function: apply_setting
+ * ------------------------
+ * Passes a key=value option to the allocator through myconfig, exiting if
+ * it is malformed or rejected.
+ */
+static void apply_setting(char *arg)
+{
+    char *eq = strchr(arg, '=');
+    if (eq == NULL || eq == arg)
+    {
+        error(1, 0, "Option \"%s\" is not of the form key=value.", arg);
+    }
+    *eq = '\0';
+    if (!myconfig(arg, eq + 1))
+    {
+        error(1, 0, "myconfig() rejected option %s=%s", arg, eq + 1);
+    }
+}
+
+/* Function: now_ns
+ * ----------------
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,601 @@
+/* File: pageheap.c
+ * ----------------
+ * The page heap: spans of 4 KiB pages carved from the heap segment. Free
+ * spans sit on exact-length lists up to SMALL_SPAN_PAGES pages and on one
+ * best-fit list above that. A span is allocated from the front of a free
+ * span, so the heap fills from low addresses, and a freed span merges with
+ * free neighbours, found through the page map entries at their ends.
+ *
+ * The page map is a two-level radix tree from page number to span: a root
+ * array in .bss and leaves of LEAF_SIZE entries made on first use. Every
+ * page of an in-use span maps to it; a free span only keeps its first and
+ * last page current, which is all merging needs. Span records and leaves
+ * come from a reserve at the top of the segment, sized for the worst case
+ * of one span per page, so the page heap never runs out of metadata.
+ *
+ * In hugepage-aware mode the pages are also grouped into 2 MiB hugepages,
+ * each with a count of its in-use pages. A small span goes to the free span
+ * whose hugepage is fullest, so allocations pack into hugepages already in
+ * use and the rest stay wholly free; a span of a hugepage or more starts on
+ * a hugepage boundary. To find that span without walking every free one,
+ * each hugepage lists the free spans that start in it, and the hugepages
+ * with any are bucketed by their in-use count. Free spans are never
+ * decommitted by length, which would split a hugepage the kernel backs;
+ * instead a hugepage whose last span is freed is released whole, keeping
+ * one empty hugepage back so a span freed and allocated again does not
+ * fault it in each time.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "./pageheap.h"
+
+// the page map covers 4 GiB of pages; larger segments are capped
+#define MAX_PAGES ((size_t)1 << 20)
+#define LEAF_BITS 10
+#define LEAF_SIZE ((size_t)1 << LEAF_BITS)
+#define ROOT_SIZE (MAX_PAGES >> LEAF_BITS)
+// free spans shorter than this have a list per length
+#define SMALL_SPAN_PAGES 128
+// 2 MiB hugepages
+#define HUGEPAGE_SHIFT 21
+#define HUGEPAGE_PAGES ((size_t)1 << (HUGEPAGE_SHIFT - PAGE_SHIFT))
+#define MAX_HUGEPAGES (MAX_PAGES / HUGEPAGE_PAGES + 1)
+#define NO_HUGEPAGE ((size_t)-1)
+
+typedef struct {
+    span_t *spans[LEAF_SIZE];
+} map_leaf_t;
+
+static uint8_t *g_base;
+static size_t g_npages;                 // pages available for spans
+static size_t g_decommit_pages;         // decommit freed spans at least this long
+static map_leaf_t *g_map[ROOT_SIZE];
+static span_t *g_free_spans[SMALL_SPAN_PAGES + 1]; // [n] length n, [SMALL_SPAN_PAGES] longer
+
+// Hugepage-aware mode
+static bool g_hugepage_aware;
+static size_t g_hp_skew;                // pages from the hugepage boundary below g_base
+static uint16_t g_hp_used[MAX_HUGEPAGES]; // in-use pages per hugepage
+static bool g_hp_released[MAX_HUGEPAGES];
+static size_t g_hp_spare;               // empty hugepage kept committed, or NO_HUGEPAGE
+static span_t *g_hp_free[MAX_HUGEPAGES];  // free spans starting in each hugepage
+static size_t g_bucket[HUGEPAGE_PAGES + 1]; // hugepages with free spans, by in-use count
+static size_t g_bucket_next[MAX_HUGEPAGES]; // bucket links, NO_HUGEPAGE at the ends
+static size_t g_bucket_prev[MAX_HUGEPAGES];
+static uint64_t g_bucket_map[HUGEPAGE_PAGES / 64 + 1]; // bit u set when g_bucket[u] is non-empty
+
+// Metadata reserve at the top of the segment
+static span_t *g_records;               // span record pool
+static size_t g_records_used;
+static span_t *g_record_free;           // recycled records, linked through next
+static map_leaf_t *g_leaves;            // leaf pool
+static size_t g_leaves_used;
+
+
+// Page map
+static span_t *map_get(size_t page) {
+    map_leaf_t *leaf = g_map[page >> LEAF_BITS];
+    return leaf == NULL ? NULL : leaf->spans[page & (LEAF_SIZE - 1)];
+}
+
+static void map_set(size_t page, span_t *span) {
+    map_leaf_t **slot = &g_map[page >> LEAF_BITS];
+    if (*slot == NULL) {
+        *slot = &g_leaves[g_leaves_used++];
+        memset(*slot, 0, sizeof(map_leaf_t));
+    }
+    (*slot)->spans[page & (LEAF_SIZE - 1)] = span;
+}
+
+static void map_ends(span_t *span) {
+    map_set(span->start, span);
+    map_set(span->start + span->npages - 1, span);
+}
+
+static void map_all(span_t *span) {
+    for (size_t i = 0; i < span->npages; i++) {
+        map_set(span->start + i, span);
+    }
+}
+
+// Span records
+static span_t *record_new(size_t start, size_t npages) {
+    span_t *span = g_record_free;
+    if (span != NULL) {
+        g_record_free = span->next;
+    } else {
+        span = &g_records[g_records_used++];
+    }
+    memset(span, 0, sizeof(*span));
+    span->start = start;
+    span->npages = npages;
+    return span;
+}
+
+static void record_delete(span_t *span) {
+    span->npages = 0;
+    span->next = g_record_free;
+    g_record_free = span;
+}
+
+// Hugepage buckets
+static inline size_t hp_of(size_t page) {
+    return (page + g_hp_skew) >> (HUGEPAGE_SHIFT - PAGE_SHIFT);
+}
+
+static void bucket_insert(size_t hp) {
+    size_t used = g_hp_used[hp];
+    g_bucket_prev[hp] = NO_HUGEPAGE;
+    g_bucket_next[hp] = g_bucket[used];
+    if (g_bucket[used] != NO_HUGEPAGE) {
+        g_bucket_prev[g_bucket[used]] = hp;
+    }
+    g_bucket[used] = hp;
+    g_bucket_map[used / 64] |= 1UL << (used % 64);
+}
+
+static void bucket_remove(size_t hp) {
+    size_t used = g_hp_used[hp];
+    if (g_bucket_prev[hp] != NO_HUGEPAGE) {
+        g_bucket_next[g_bucket_prev[hp]] = g_bucket_next[hp];
+    } else {
+        g_bucket[used] = g_bucket_next[hp];
+    }
+    if (g_bucket_next[hp] != NO_HUGEPAGE) {
+        g_bucket_prev[g_bucket_next[hp]] = g_bucket_prev[hp];
+    }
+    if (g_bucket[used] == NO_HUGEPAGE) {
+        g_bucket_map[used / 64] &= ~(1UL << (used % 64));
+    }
+}
+
+// Free lists; in hugepage-aware mode a free span is also on its first
+// hugepage's list, and that hugepage in its bucket
+static inline size_t list_for(size_t npages) {
+    return npages < SMALL_SPAN_PAGES ? npages : SMALL_SPAN_PAGES;
+}
+
+static void free_insert(span_t *span) {
+    span_t **head = &g_free_spans[list_for(span->npages)];
+    span->prev = NULL;
+    span->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = span;
+    }
+    *head = span;
+    if (g_hugepage_aware) {
+        size_t hp = hp_of(span->start);
+        if (g_hp_free[hp] == NULL) {
+            bucket_insert(hp);
+        }
+        span->hp_prev = NULL;
+        span->hp_next = g_hp_free[hp];
+        if (g_hp_free[hp] != NULL) {
+            g_hp_free[hp]->hp_prev = span;
+        }
+        g_hp_free[hp] = span;
+    }
+}
+
+static void free_remove(span_t *span) {
+    if (span->prev != NULL) {
+        span->prev->next = span->next;
+    } else {
+        g_free_spans[list_for(span->npages)] = span->next;
+    }
+    if (span->next != NULL) {
+        span->next->prev = span->prev;
+    }
+    if (g_hugepage_aware) {
+        size_t hp = hp_of(span->start);
+        if (span->hp_prev != NULL) {
+            span->hp_prev->hp_next = span->hp_next;
+        } else {
+            g_hp_free[hp] = span->hp_next;
+        }
+        if (span->hp_next != NULL) {
+            span->hp_next->hp_prev = span->hp_prev;
+        }
+        if (g_hp_free[hp] == NULL) {
+            bucket_remove(hp);
+        }
+    }
+}
+
+// Smallest free span of at least npages pages, lowest address on ties
+static span_t *find_free(size_t npages) {
+    for (size_t n = npages; n < SMALL_SPAN_PAGES; n++) {
+        if (g_free_spans[n] != NULL) {
+            return g_free_spans[n];
+        }
+    }
+    span_t *best = NULL;
+    for (span_t *s = g_free_spans[SMALL_SPAN_PAGES]; s != NULL; s = s->next) {
+        if (s->npages >= npages && (best == NULL || s->npages < best->npages ||
+                                    (s->npages == best->npages && s->start < best->start))) {
+            best = s;
+        }
+    }
+    return best;
+}
+
+static void decommit(span_t *span) {
+    madvise(span_base(span), span_bytes(span), MADV_DONTNEED);
+    span->decommitted = true;
+}
+
+// Hugepages
+// First page of hugepage hp, clipped to the page range
+static inline size_t hp_start(size_t hp) {
+    size_t page = hp * HUGEPAGE_PAGES;
+    page = page > g_hp_skew ? page - g_hp_skew : 0;
+    return page < g_npages ? page : g_npages;
+}
+
+// Gives an empty hugepage's memory back to the OS
+static size_t hp_release(size_t hp) {
+    size_t first = hp_start(hp), end = hp_start(hp + 1);
+    madvise(g_base + first * PAGE_SIZE, (end - first) * PAGE_SIZE, MADV_DONTNEED);
+    g_hp_released[hp] = true;
+    return end - first;
+}
+
+// Adds the span's pages to (or removes them from) the in-use counts of the
+// hugepages it covers, moving each to the bucket for its new count. A
+// hugepage left empty becomes the spare, and the previous spare is released.
+static void hp_account(const span_t *span, bool in_use) {
+    size_t end = span->start + span->npages;
+    for (size_t page = span->start; page < end; ) {
+        size_t hp = hp_of(page);
+        size_t next = hp_start(hp + 1) < end ? hp_start(hp + 1) : end;
+        bool bucketed = g_hp_free[hp] != NULL;
+        if (bucketed) {
+            bucket_remove(hp);
+        }
+        if (in_use) {
+            g_hp_used[hp] += next - page;
+            g_hp_released[hp] = false;
+            if (g_hp_spare == hp) {
+                g_hp_spare = NO_HUGEPAGE;
+            }
+        } else if ((g_hp_used[hp] -= next - page) == 0) {
+            if (g_hp_spare != NO_HUGEPAGE) {
+                hp_release(g_hp_spare);
+            }
+            g_hp_spare = hp;
+        }
+        if (bucketed) {
+            bucket_insert(hp);
+        }
+        page = next;
+    }
+}
+
+// Free span of at least npages pages whose first hugepage has the most
+// pages in use, lowest address on ties. Buckets are tried fullest first, and
+// the first with a span that fits ends the search.
+static span_t *find_free_dense(size_t npages) {
+    for (size_t w = HUGEPAGE_PAGES / 64 + 1; w-- > 0; ) {
+        uint64_t bits = g_bucket_map[w];
+        while (bits != 0) {
+            size_t b = 63 - __builtin_clzl(bits);
+            bits &= ~(1UL << b);
+            span_t *best = NULL;
+            for (size_t hp = g_bucket[w * 64 + b]; hp != NO_HUGEPAGE; hp = g_bucket_next[hp]) {
+                for (span_t *s = g_hp_free[hp]; s != NULL; s = s->hp_next) {
+                    if (s->npages >= npages && (best == NULL || s->start < best->start)) {
+                        best = s;
+                    }
+                }
+            }
+            if (best != NULL) {
+                return best;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Pages to skip at the front of a free span so a span of npages starts on a
+// hugepage boundary, or 0 if it does not fit there
+static size_t hp_lead(const span_t *span, size_t npages) {
+    size_t offset = (span->start + g_hp_skew) % HUGEPAGE_PAGES;
+    size_t lead = offset == 0 ? 0 : HUGEPAGE_PAGES - offset;
+    return lead + npages <= span->npages ? lead : 0;
+}
+
+// Free span ending just before page, or NULL
+static span_t *free_left_of(size_t page) {
+    span_t *left = page > 0 ? map_get(page - 1) : NULL;
+    if (left == NULL || left->in_use || left->start + left->npages != page) {
+        return NULL;
+    }
+    return left;
+}
+
+// Free span starting at page, or NULL
+static span_t *free_at(size_t page) {
+    span_t *right = page < g_npages ? map_get(page) : NULL;
+    if (right == NULL || right->in_use || right->start != page) {
+        return NULL;
+    }
+    return right;
+}
+
+
+bool pageheap_init(void *start, size_t size, size_t decommit_pages, bool hugepage_aware) {
+    size_t total = size >> PAGE_SHIFT;
+    if (total > MAX_PAGES) {
+        total = MAX_PAGES;
+    }
+    size_t reserve = total * sizeof(span_t) +
+                     (total / LEAF_SIZE + 1) * sizeof(map_leaf_t);
+    size_t reserve_pages = (reserve + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    if (start == NULL || total <= reserve_pages) {
+        return false;
+    }
+    g_base = start;
+    g_npages = total - reserve_pages;
+    g_decommit_pages = decommit_pages;
+    g_leaves = (map_leaf_t *)(g_base + g_npages * PAGE_SIZE);
+    g_records = (span_t *)(g_leaves + total / LEAF_SIZE + 1);
+    g_leaves_used = 0;
+    g_records_used = 0;
+    g_record_free = NULL;
+    memset(g_map, 0, sizeof(g_map));
+    memset(g_free_spans, 0, sizeof(g_free_spans));
+    g_hugepage_aware = hugepage_aware;
+    g_hp_skew = ((uintptr_t)start >> PAGE_SHIFT) % HUGEPAGE_PAGES;
+    g_hp_spare = NO_HUGEPAGE;
+    memset(g_hp_used, 0, sizeof(g_hp_used));
+    memset(g_hp_released, 0, sizeof(g_hp_released));
+    memset(g_hp_free, 0, sizeof(g_hp_free));
+    memset(g_bucket, 0xff, sizeof(g_bucket));
+    memset(g_bucket_map, 0, sizeof(g_bucket_map));
+    if (hugepage_aware) {
+        madvise(g_base, g_npages * PAGE_SIZE, MADV_HUGEPAGE);
+    }
+
+    span_t *all = record_new(0, g_npages);
+    map_ends(all);
+    free_insert(all);
+    return true;
+}
+
+span_t *span_alloc(size_t npages) {
+    if (npages == 0 || npages > g_npages) {
+        return NULL;
+    }
+    bool dense = g_hugepage_aware && npages < HUGEPAGE_PAGES;
+    span_t *span = dense ? find_free_dense(npages) : find_free(npages);
+    if (span == NULL) {
+        return NULL;
+    }
+    free_remove(span);
+    size_t lead = g_hugepage_aware && !dense ? hp_lead(span, npages) : 0;
+    if (lead > 0) {
+        span_t *front = record_new(span->start, lead);
+        front->decommitted = span->decommitted;
+        map_ends(front);
+        free_insert(front);
+        span->start += lead;
+        span->npages -= lead;
+    }
+    if (span->npages > npages) {
+        span_t *rest = record_new(span->start + npages, span->npages - npages);
+        rest->decommitted = span->decommitted;
+        map_ends(rest);
+        free_insert(rest);
+        span->npages = npages;
+    }
+    span->in_use = true;
+    span->decommitted = false;
+    map_all(span);
+    if (g_hugepage_aware) {
+        hp_account(span, true);
+    }
+    return span;
+}
+
+void span_free(span_t *span) {
+    memset(&span->size_class, 0,
+           sizeof(*span) - offsetof(span_t, size_class));
+    span->in_use = false;
+    span->decommitted = false;
+    if (g_hugepage_aware) {
+        hp_account(span, false);
+    }
+
+    span_t *left = free_left_of(span->start);
+    if (left != NULL) {
+        free_remove(left);
+        span->start = left->start;
+        span->npages += left->npages;
+        record_delete(left);
+    }
+    span_t *right = free_at(span->start + span->npages);
+    if (right != NULL) {
+        free_remove(right);
+        span->npages += right->npages;
+        record_delete(right);
+    }
+    if (!g_hugepage_aware && g_decommit_pages > 0 && span->npages >= g_decommit_pages) {
+        decommit(span);
+    }
+    map_ends(span);
+    free_insert(span);
+}
+
+span_t *span_of(const void *ptr) {
+    const uint8_t *p = ptr;
+    if (p < g_base || p >= g_base + g_npages * PAGE_SIZE) {
+        return NULL;
+    }
+    size_t page = (size_t)(p - g_base) >> PAGE_SHIFT;
+    span_t *span = map_get(page);
+    if (span == NULL || !span->in_use || page < span->start ||
+        page >= span->start + span->npages) {
+        return NULL;
+    }
+    return span;
+}
+
+void *span_base(const span_t *span) {
+    return g_base + span->start * PAGE_SIZE;
+}
+
+size_t span_bytes(const span_t *span) {
+    return span->npages * PAGE_SIZE;
+}
+
+size_t pageheap_release(void) {
+    size_t released = 0;
+    if (g_hugepage_aware) {
+        for (size_t hp = 0; hp <= hp_of(g_npages - 1); hp++) {
+            if (g_hp_used[hp] == 0 && !g_hp_released[hp]) {
+                released += hp_release(hp);
+            }
+        }
+        g_hp_spare = NO_HUGEPAGE;
+        return released;
+    }
+    for (size_t n = 0; n <= SMALL_SPAN_PAGES; n++) {
+        for (span_t *s = g_free_spans[n]; s != NULL; s = s->next) {
+            if (!s->decommitted) {
+                decommit(s);
+                released += s->npages;
+            }
+        }
+    }
+    return released;
+}
+
+// Recounts each hugepage's in-use pages from the spans, and checks that
+// the buckets hold each of the nfree free spans under its first hugepage
+static bool validate_hugepages(size_t nfree) {
+    static size_t counted[MAX_HUGEPAGES];
+    memset(counted, 0, sizeof(counted));
+    for (size_t page = 0; page < g_npages; page += map_get(page)->npages) {
+        span_t *span = map_get(page);
+        size_t end = span->start + span->npages;
+        for (size_t p = page; span->in_use && p < end; ) {
+            size_t next = hp_start(hp_of(p) + 1) < end ? hp_start(hp_of(p) + 1) : end;
+            counted[hp_of(p)] += next - p;
+            p = next;
+        }
+    }
+    for (size_t hp = 0; hp <= hp_of(g_npages - 1); hp++) {
+        if (counted[hp] != g_hp_used[hp] || (counted[hp] > 0 && g_hp_released[hp])) {
+            printf("hugepage %zu counts %u pages in use but has %zu\n", hp, g_hp_used[hp],
+                   counted[hp]);
+            return false;
+        }
+    }
+    if (g_hp_spare != NO_HUGEPAGE && g_hp_used[g_hp_spare] != 0) {
+        printf("spare hugepage %zu is not empty\n", g_hp_spare);
+        return false;
+    }
+    size_t nbucketed = 0;
+    for (size_t used = 0; used <= HUGEPAGE_PAGES; used++) {
+        bool listed = (g_bucket_map[used / 64] >> (used % 64)) & 1;
+        if (listed != (g_bucket[used] != NO_HUGEPAGE)) {
+            printf("bucket %zu disagrees with its bitmap bit\n", used);
+            return false;
+        }
+        for (size_t hp = g_bucket[used]; hp != NO_HUGEPAGE; hp = g_bucket_next[hp]) {
+            if (g_hp_used[hp] != used || g_hp_free[hp] == NULL) {
+                printf("hugepage %zu is in bucket %zu\n", hp, used);
+                return false;
+            }
+            for (span_t *s = g_hp_free[hp]; s != NULL; s = s->hp_next) {
+                if (s->in_use || hp_of(s->start) != hp || ++nbucketed > nfree) {
+                    printf("hugepage %zu lists span %zu wrongly\n", hp, s->start);
+                    return false;
+                }
+            }
+        }
+    }
+    if (nbucketed != nfree) {
+        printf("%zu free spans but %zu bucketed\n", nfree, nbucketed);
+        return false;
+    }
+    return true;
+}
+
+bool pageheap_validate(void) {
+    if (g_base == NULL) {
+        return false;
+    }
+    size_t nfree = 0;
+    bool prev_free = false;
+    size_t page = 0;
+    while (page < g_npages) {
+        span_t *span = map_get(page);
+        if (span == NULL || span->start != page || span->npages == 0 ||
+            span->npages > g_npages - page) {
+            printf("page %zu does not start a valid span\n", page);
+            return false;
+        }
+        if (span->in_use) {
+            for (size_t i = 1; i < span->npages; i++) {
+                if (map_get(page + i) != span) {
+                    printf("page %zu of in-use span %zu is unmapped\n", page + i, page);
+                    return false;
+                }
+            }
+        } else {
+            if (prev_free || map_get(page + span->npages - 1) != span) {
+                printf("free span %zu is unmerged or its last page is unmapped\n", page);
+                return false;
+            }
+            nfree++;
+        }
+        prev_free = !span->in_use;
+        page += span->npages;
+    }
+
+    size_t nlisted = 0;
+    for (size_t n = 0; n <= SMALL_SPAN_PAGES; n++) {
+        span_t *prev = NULL;
+        for (span_t *s = g_free_spans[n]; s != NULL; s = s->next) {
+            if (s->in_use || list_for(s->npages) != n || s->prev != prev ||
+                map_get(s->start) != s || ++nlisted > nfree) {
+                printf("free list %zu is corrupt at span %zu\n", n, s->start);
+                return false;
+            }
+            prev = s;
+        }
+    }
+    if (nlisted != nfree) {
+        printf("%zu free spans but %zu listed\n", nfree, nlisted);
+        return false;
+    }
+    return !g_hugepage_aware || validate_hugepages(nfree);
+}
+
+void pageheap_dump(void) {
+    printf("PAGE HEAP [%p .. %p) %zu pages, %zu span records, %zu map leaves\n",
+           g_base, g_base + g_npages * PAGE_SIZE, g_npages, g_records_used, g_leaves_used);
+    for (size_t page = 0; page < g_npages; ) {
+        span_t *span = map_get(page);
+        if (span == NULL || span->npages == 0) {
+            printf("  !! no span at page %zu\n", page);
+            break;
+        }
+        printf("span pages [%zu, %zu) %s class=%d used=%u\n", span->start,
+               span->start + span->npages,
+               span->in_use ? "IN USE" : span->decommitted ? "FREE (decommitted)" : "FREE",
+               span->size_class, span->nused);
+        page += span->npages;
+    }
+    if (g_hugepage_aware) {
+        for (size_t hp = 0; hp <= hp_of(g_npages - 1); hp++) {
+            if (g_hp_used[hp] > 0) {
+                printf("hugepage %zu pages [%zu, %zu) %u in use\n", hp, hp_start(hp),
+                       hp_start(hp + 1), g_hp_used[hp]);
+            }
+        }
+    }
+}
@@ -0,0 +1,115 @@
+/* File: pageheap.h
+ * ----------------
+ * Interface to the page heap, a span allocator layered on the heap segment.
+ * It hands out spans (runs of contiguous 4 KiB pages), merges freed spans
+ * with free neighbours, maps any page back to its span through a radix page
+ * map, and decommits large free spans so their memory goes back to the OS.
+ * It can also place spans with 2 MiB hugepages in mind. Allocators built on
+ * it take whole spans and carve them up, rather than each owning the raw
+ * segment.
+ *
+ * The page heap is not thread-safe: multithreaded clients serialize the
+ * calls that change it. span_of only reads the page map and may run
+ * concurrently with them for pointers into spans the caller holds.
+ */
+
+#ifndef _PAGEHEAP_H
+#define _PAGEHEAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE ((size_t)1 << PAGE_SHIFT)
+
+typedef struct span {
+    size_t start;             // first page number, counted from the heap base
+    size_t npages;            // length in pages
+    bool in_use;              // handed out by span_alloc
+    bool decommitted;         // free and returned to the OS
+    struct span *next;        // free list links (page heap) or client list links
+    struct span *prev;
+    struct span *hp_next;     // links among the free spans starting in one hugepage
+    struct span *hp_prev;
+
+    // Client fields, owned by whoever allocated the span
+    int size_class;           // object size class, or 0 for a single large object
+    void *free_objects;       // singly linked free objects
+    void *local_free;         // objects freed by the owning thread
+    void *thread_free;        // objects freed by other threads, pushed atomically
+    void *owner;              // per-thread heap that allocates from the span
+    bool in_full;             // parked by the owner as having no free object
+    bool realloc_heavy;       // a large object that keeps its realloc slack
+    size_t bump;              // offset of the first never-used byte
+    unsigned nused;           // objects currently allocated
+} span_t;
+
+/* Function: pageheap_init
+ * -----------------------
+ * Takes over the segment [start, start + size) and makes all of it one free
+ * span, except a reserve at the top that holds span records and page map
+ * leaves. Free spans of at least decommit_pages pages are decommitted when
+ * they are freed (0 never decommits). Returns false if the segment is too
+ * small. Calling it again discards every span.
+ *
+ * With hugepage_aware set, the page heap packs small spans into the 2 MiB
+ * hugepages that are already fullest, starts spans of a hugepage or more
+ * on a hugepage boundary, and returns memory to the OS a whole empty
+ * hugepage at a time instead of by span length.
+ */
+bool pageheap_init(void *start, size_t size, size_t decommit_pages, bool hugepage_aware);
+
+/* Function: span_alloc
+ * --------------------
+ * Returns an in-use span of exactly npages pages with zeroed client fields,
+ * or NULL if no free span is large enough.
+ */
+span_t *span_alloc(size_t npages);
+
+/* Function: span_free
+ * -------------------
+ * Returns an in-use span to the page heap, merging it with free spans on
+ * either side. The span record must not be used afterwards.
+ */
+void span_free(span_t *span);
+
+/* Function: span_of
+ * -----------------
+ * Returns the in-use span containing ptr in a couple of loads, or NULL if
+ * ptr is outside the page heap or in a free page.
+ */
+span_t *span_of(const void *ptr);
+
+/* Functions: span_base, span_bytes
+ * --------------------------------
+ * span_base returns the address of the first byte of the span and
+ * span_bytes its length in bytes.
+ */
+void *span_base(const span_t *span);
+size_t span_bytes(const span_t *span);
+
+/* Function: pageheap_release
+ * --------------------------
+ * Decommits every free span that is still committed, whatever its size;
+ * in hugepage-aware mode, every empty hugepage instead. Returns the number
+ * of pages released.
+ */
+size_t pageheap_release(void);
+
+/* Function: pageheap_validate
+ * ---------------------------
+ * Checks that the spans tile the page range, that no two free spans touch,
+ * that the free lists hold exactly the free spans, and that the page map
+ * points every in-use page and the ends of every free span at its span.
+ * Returns true if all is well.
+ */
+bool pageheap_validate(void);
+
+/* Function: pageheap_dump
+ * -----------------------
+ * Prints every span in address order, for use from gdb.
+ */
+void pageheap_dump(void);
+
+#endif
@@ -0,0 +1,1384 @@
+/* File: slab.c
+ * ------------
+ * A small-object allocator on top of the page heap, with free lists
+ * sharded per page in the style of mimalloc. Small requests are rounded up
+ * to one of NUM_CLASSES slot sizes. Every thread has its own heap, which
+ * owns pages (64 KiB spans) of each size class, and every page keeps three
+ * free lists:
+ *
+ *   - free_objects, the allocation list that mymalloc pops from;
+ *   - local_free, where the owning thread pushes objects it frees;
+ *   - thread_free, where other threads push objects atomically.
+ *
+ * mymalloc's fast path is a pop from the allocation list of the heap's
+ * current page for the class, with no branch but the empty check. Only
+ * when that list runs dry does the slow path swap in the other two lists,
+ * carve fresh slots, or move on to another page, so consecutive
+ * allocations come from adjacent slots, and a free from another thread is
+ * one compare-and-swap with no lock. Pages with no free slot are parked on
+ * the heap's full list until an object in them is freed. Requests too big
+ * for any class get a span of their own, under the page heap lock.
+ *
+ * Objects have no header. The page heap's radix page map takes any pointer
+ * to its span, and through it the size class, in a few loads; free and
+ * myusable_size use it, and it lets them reject foreign pointers and
+ * pointers into the middle of an object.
+ *
+ * By default the page heap runs hugepage-aware, so pages fill the 2 MiB
+ * hugepages already in use before touching fresh ones, and memory goes
+ * back to the OS only as whole empty hugepages.
+ *
+ * myconfig("front", "cpu") swaps the per-thread heaps for one central heap,
+ * shared under a lock, behind an object cache per CPU. Each cache is a
+ * small stack of objects per class that a thread pushes and pops inside a
+ * restartable sequence: the kernel restarts the sequence if the thread is
+ * preempted or migrates before its single committing store, so the cache
+ * needs neither a lock nor an atomic instruction. A miss or a full stack
+ * moves half a stack's worth of objects from or to the central heap under
+ * its lock. Cache memory then grows with the number of CPUs rather than of
+ * threads. Where restartable sequences are unavailable (not x86-64, the
+ * C library did not register them, or a ThreadSanitizer build), and with
+ * "front=thread", every thread gets a cache of its own instead.
+ *
+ * Caches pass whole batches to each other before they go to the central
+ * heap. A full stack spills half of itself into its cache's overflow slot,
+ * or if that is taken into the transfer cache, which holds a few batches
+ * per class under a lock of its own. A miss takes back its own overflow,
+ * then a batch from the transfer cache, then steals another cache's
+ * overflow, and only then locks the central heap. A thread that only frees
+ * thereby feeds one that only allocates without either touching it.
+ *
+ * myconfig("front", "bitmap") has every thread allocate from one shared
+ * set of pages per class, with no lock and no cache. Each page keeps an
+ * occupancy bitmap of 64-bit words at its end. A thread claims a slot by
+ * finding a zero bit and setting it with a compare-and-swap, and frees one
+ * by clearing its bit with an atomic AND, so a free needs no owner and a
+ * double free is caught. Only adding a page to a class takes a lock.
+ *
+ * myinit must not run while other threads use the allocator. The pages of
+ * a thread that exits stay with its heap, and the objects in its cache
+ * with the cache.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+#if defined(__x86_64__) && !defined(__SANITIZE_THREAD__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#endif
+#include "./allocator.h"
+#include "./pageheap.h"
+#include "./stats.h"
+#include "./debug_break.h"
+
+// every size class page is 64 KiB
+#define CLASS_PAGE_PAGES 16
+// fresh slots are carved into the allocation list this many bytes at a time
+#define CARVE_BYTES PAGE_SIZE
+// free spans of at least this many pages are decommitted (0 = never)
+#define DECOMMIT_PAGES 256
+// most threads that can have a heap
+#define MAX_HEAPS 256
+// most objects of one class an object cache holds, and the bytes of one
+// class it aims to hold at most
+#define CACHE_SLOTS 64
+#define CACHE_CLASS_BYTES (32 * 1024)
+// whole batches of one class the transfer cache holds
+#define TRANSFER_BATCHES 16
+// most occupancy words a bitmap page needs: one bit per 8-byte slot
+#define BITMAP_WORDS (CLASS_PAGE_PAGES * PAGE_SIZE / 8 / 64)
+
+// Slot sizes; class 0 is reserved for large objects
+static const size_t g_class_size[] = {
+    0, 8, 16, 24, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384,
+    448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 4096
+};
+#define NUM_CLASSES (sizeof(g_class_size) / sizeof(g_class_size[0]))
+#define MAX_SMALL 4096
+
+typedef struct {
+    span_t *pages[NUM_CLASSES]; // pages per class; the head is allocated from
+    span_t *full;               // pages with no free object when last seen
+} heap_t;
+
+// Front ends: a heap per thread, object caches per CPU or per thread in
+// front of the central heap, or shared pages with occupancy bitmaps
+typedef enum { FRONT_HEAP, FRONT_CPU, FRONT_THREAD, FRONT_BITMAP } front_t;
+
+// A batch is half a full stack of one class. An overflow slot parks the
+// batch a full stack spills, for its cache to take back on a miss or for
+// another cache to steal. Its state goes EMPTY -> BUSY -> FULL -> BUSY ->
+// EMPTY, and only the thread that set BUSY touches objs.
+enum { BATCH_EMPTY, BATCH_BUSY, BATCH_FULL };
+typedef struct {
+    uint32_t state;
+    void *objs[CACHE_SLOTS / 2];
+} overflow_t;
+
+// An object cache: a stack of free objects per class, owned by the central
+// heap, and an overflow slot per class. Aligned so per-CPU caches do not
+// share cache lines.
+typedef struct {
+    uint32_t count[NUM_CLASSES];
+    void *slots[NUM_CLASSES][CACHE_SLOTS];
+    overflow_t overflow[NUM_CLASSES];
+} __attribute__((aligned(CACHE_LINE_SIZE))) cache_t;
+
+// The transfer cache of one class: whole batches passed between caches
+// under a lock of its own rather than the central heap's
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t nbatches;
+    void *objs[TRANSFER_BATCHES][CACHE_SLOTS / 2];
+} transfer_t;
+
+static unsigned char g_class_of[MAX_SMALL / ALIGNMENT + 1]; // bytes / ALIGNMENT -> class
+static size_t g_decommit_pages = DECOMMIT_PAGES;
+static bool g_hugepage_aware = true;
+static bool g_ready = false;
+
+// A page with no free object that stands in for an empty class queue, so the
+// fast path needs no NULL check
+static span_t g_empty_page;
+static heap_t g_heaps[MAX_HEAPS];
+static unsigned g_heaps_used;
+// bumped by myinit so every thread claims a fresh heap
+static unsigned g_generation;
+static pthread_mutex_t g_pageheap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread heap_t *t_heap;
+static __thread unsigned t_generation;
+
+static front_t g_front_option = FRONT_HEAP;
+static front_t g_front;          // in effect since myinit
+static heap_t g_central;
+static pthread_mutex_t g_central_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t g_cache_cap[NUM_CLASSES];
+static cache_t *g_cpu_caches;    // one per configured CPU
+static uint32_t g_ncpus;
+static cache_t *g_thread_caches[MAX_HEAPS];
+static unsigned g_thread_caches_used;
+
+static bool g_transfer_option = true;
+static bool g_transfer;          // in effect since myinit
+static transfer_t g_transfer_cache[NUM_CLASSES];
+
+static __thread cache_t *t_cache;
+static __thread unsigned t_cache_generation;
+
+// Bitmap pages of each class, linked through next from the newest; a page
+// stays on its list until myinit
+static span_t *g_bitmap_pages[NUM_CLASSES];
+// where the last allocation of each class found a free slot
+static span_t *g_bitmap_hint[NUM_CLASSES];
+static pthread_mutex_t g_bitmap_grow_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t g_bitmap_slots[NUM_CLASSES];    // slots in one page
+static uint32_t g_bitmap_words[NUM_CLASSES];    // occupancy words after them
+static unsigned g_bitmap_threads;
+static __thread unsigned t_bitmap_thread;       // spreads threads over words
+static __thread unsigned t_bitmap_generation;
+
+// Counters for mystats, reset by myinit
+static unsigned long g_central_locks;      // under g_central_lock
+static unsigned long g_transfer_batches;   // the rest are atomic
+static unsigned long g_reclaimed_batches;
+static unsigned long g_stolen_batches;
+static unsigned long g_bitmap_retries;     // lost compare-and-swaps, atomic
+static unsigned long g_bitmap_grows;       // under g_bitmap_grow_lock
+
+
+static inline size_t round_up(size_t n, size_t mult) {
+    return (n + mult - 1) / mult * mult;
+}
+
+// Fills the size-to-class table
+static void build_classes(void) {
+    size_t c = 1;
+    for (size_t i = 0; i <= MAX_SMALL / ALIGNMENT; i++) {
+        while (g_class_size[c] < i * ALIGNMENT) {
+            c++;
+        }
+        g_class_of[i] = c;
+    }
+}
+
+static void heap_reset(heap_t *heap) {
+    for (size_t c = 0; c < NUM_CLASSES; c++) {
+        heap->pages[c] = &g_empty_page;
+    }
+    heap->full = NULL;
+}
+
+// The calling thread's heap, claimed on first use after each myinit
+static heap_t *claim_heap(void) {
+    unsigned i = __atomic_fetch_add(&g_heaps_used, 1, __ATOMIC_RELAXED);
+    // threads past the first MAX_HEAPS share the central heap under its lock
+    t_heap = i < MAX_HEAPS ? &g_heaps[i] : &g_central;
+    t_generation = g_generation;
+    return t_heap;
+}
+
+static inline heap_t *thread_heap(void) {
+    if (t_generation != g_generation) {
+        return claim_heap();
+    }
+    return t_heap;
+}
+
+// Page heap calls, serialized across threads
+static span_t *locked_span_alloc(size_t npages) {
+    pthread_mutex_lock(&g_pageheap_lock);
+    span_t *span = span_alloc(npages);
+    pthread_mutex_unlock(&g_pageheap_lock);
+    return span;
+}
+
+static void locked_span_free(span_t *span) {
+    pthread_mutex_lock(&g_pageheap_lock);
+    span_free(span);
+    pthread_mutex_unlock(&g_pageheap_lock);
+}
+
+// Class queues, linked through the span's client-owned next/prev; an empty
+// queue holds &g_empty_page
+static void queue_push(heap_t *heap, span_t *page) {
+    span_t *head = heap->pages[page->size_class];
+    page->prev = NULL;
+    page->next = head == &g_empty_page ? NULL : head;
+    if (page->next != NULL) {
+        page->next->prev = page;
+    }
+    heap->pages[page->size_class] = page;
+}
+
+static void queue_remove(heap_t *heap, span_t *page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        heap->pages[page->size_class] = page->next != NULL ? page->next : &g_empty_page;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+}
+
+static void full_push(heap_t *heap, span_t *page) {
+    page->in_full = true;
+    page->prev = NULL;
+    page->next = heap->full;
+    if (page->next != NULL) {
+        page->next->prev = page;
+    }
+    heap->full = page;
+}
+
+static void full_remove(heap_t *heap, span_t *page) {
+    page->in_full = false;
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        heap->full = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+}
+
+// Refills an empty allocation list from the other two lists
+static void page_collect(span_t *page) {
+    page->free_objects = page->local_free;
+    page->local_free = NULL;
+    void *remote = __atomic_exchange_n(&page->thread_free, NULL, __ATOMIC_ACQUIRE);
+    if (remote == NULL) {
+        return;
+    }
+    void *tail = remote;
+    unsigned n = 1;
+    while (*(void **)tail != NULL) {
+        tail = *(void **)tail;
+        n++;
+    }
+    *(void **)tail = page->free_objects;
+    page->free_objects = remote;
+    page->nused -= n;
+}
+
+// Carves up to CARVE_BYTES of never-used slots into an empty allocation list
+static void page_extend(span_t *page) {
+    size_t size = g_class_size[page->size_class];
+    size_t end = span_bytes(page) - span_bytes(page) % size;
+    if (page->bump == end) {
+        return;
+    }
+    size_t n = CARVE_BYTES / size > 0 ? CARVE_BYTES / size : 1;
+    if (n > (end - page->bump) / size) {
+        n = (end - page->bump) / size;
+    }
+    uint8_t *first = (uint8_t *)span_base(page) + page->bump;
+    for (size_t i = 0; i + 1 < n; i++) {
+        *(void **)(first + i * size) = first + (i + 1) * size;
+    }
+    *(void **)(first + (n - 1) * size) = NULL;
+    page->free_objects = first;
+    __atomic_store_n(&page->bump, page->bump + n * size, __ATOMIC_RELAXED);
+}
+
+static inline void *page_pop(span_t *page) {
+    void *block = page->free_objects;
+    page->free_objects = *(void **)block;
+    page->nused++;
+    return block;
+}
+
+// Slow path of mymalloc: the current page of the class has run dry
+static void *malloc_generic(heap_t *heap, int c) {
+    span_t *page = heap->pages[c];
+    while (page != &g_empty_page && page != NULL) {
+        span_t *next = page->next;
+        if (page->free_objects == NULL) {
+            page_collect(page);
+        }
+        if (page->free_objects == NULL) {
+            page_extend(page);
+        }
+        if (page->free_objects != NULL) {
+            if (page != heap->pages[c]) {
+                queue_remove(heap, page);
+                queue_push(heap, page);
+            }
+            return page_pop(page);
+        }
+        queue_remove(heap, page);
+        full_push(heap, page);
+        page = next;
+    }
+
+    // other threads may have freed into full pages
+    for (page = heap->full; page != NULL; page = page->next) {
+        if (page->size_class == c && page->thread_free != NULL) {
+            page_collect(page);
+            full_remove(heap, page);
+            queue_push(heap, page);
+            return page_pop(page);
+        }
+    }
+
+    page = locked_span_alloc(CLASS_PAGE_PAGES);
+    if (page == NULL) {
+        return NULL;
+    }
+    page->size_class = c;
+    page->owner = heap;
+    queue_push(heap, page);
+    page_extend(page);
+    return page_pop(page);
+}
+
+// Span of the object starting at ptr, or NULL if ptr is not in an in-use
+// span or does not point at the start of an allocated-or-free slot
+static span_t *object_span(void *ptr) {
+    span_t *span = span_of(ptr);
+    if (span == NULL) {
+        return NULL;
+    }
+    size_t off = (uint8_t *)ptr - (uint8_t *)span_base(span);
+    if (span->size_class == 0) {
+        return off == 0 ? span : NULL;
+    }
+    if (off >= __atomic_load_n(&span->bump, __ATOMIC_RELAXED) ||
+        off % g_class_size[span->size_class] != 0) {
+        return NULL;
+    }
+    return span;
+}
+
+// Usable bytes of an object in span
+static size_t usable_size(const span_t *span) {
+    if (span->size_class == 0) {
+        return span_bytes(span);
+    }
+    return g_class_size[span->size_class];
+}
+
+// Frees an object into a page of the calling thread's heap; a page left
+// empty goes back to the page heap unless it is its class's only page
+static void free_local(heap_t *heap, span_t *page, void *ptr) {
+    *(void **)ptr = page->local_free;
+    page->local_free = ptr;
+    page->nused--;
+    if (page->in_full) {
+        full_remove(heap, page);
+        queue_push(heap, page);
+    }
+    if (page->nused == 0 && (page->prev != NULL || page->next != NULL)) {
+        queue_remove(heap, page);
+        locked_span_free(page);
+    }
+}
+
+// Frees an object into a page owned by another thread
+static void free_remote(span_t *page, void *ptr) {
+    void *head = __atomic_load_n(&page->thread_free, __ATOMIC_RELAXED);
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&page->thread_free, &head, ptr, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Shared bitmap pages
+
+// Sizes the bitmap pages of every class: as many slots as fit before one
+// bit for each
+static void bitmap_layout(void) {
+    size_t bytes = CLASS_PAGE_PAGES * PAGE_SIZE;
+    for (size_t c = 1; c < NUM_CLASSES; c++) {
+        size_t n = bytes / g_class_size[c];
+        while (n * g_class_size[c] + (n + 63) / 64 * sizeof(uint64_t) > bytes) {
+            n--;
+        }
+        g_bitmap_slots[c] = n;
+        g_bitmap_words[c] = (n + 63) / 64;
+    }
+}
+
+static inline uint64_t *page_bitmap(const span_t *page) {
+    return (uint64_t *)((uint8_t *)span_base(page) + span_bytes(page)) -
+           g_bitmap_words[page->size_class];
+}
+
+// Claims a free slot of page, or returns NULL if it has none. The search
+// starts at a word that depends on the thread, so threads sharing a page
+// mostly race for different words.
+static void *bitmap_claim(span_t *page) {
+    int c = page->size_class;
+    if (__atomic_load_n(&page->nused, __ATOMIC_RELAXED) >= g_bitmap_slots[c]) {
+        return NULL;
+    }
+    uint64_t *words = page_bitmap(page);
+    uint32_t nwords = g_bitmap_words[c];
+    uint32_t start = t_bitmap_thread * 7 % nwords;
+    for (uint32_t i = 0; i < nwords; i++) {
+        uint32_t w = (start + i) % nwords;
+        uint64_t bits = __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+        while (~bits != 0) {
+            int bit = __builtin_ctzll(~bits);
+            if (__atomic_compare_exchange_n(&words[w], &bits, bits | (uint64_t)1 << bit, true,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                __atomic_fetch_add(&page->nused, 1, __ATOMIC_RELAXED);
+                return (uint8_t *)span_base(page) + (w * 64 + bit) * g_class_size[c];
+            }
+            __atomic_fetch_add(&g_bitmap_retries, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Claims a slot from the pages of class c, from the hint to the oldest
+// page and then from the newest back to the hint; NULL if all are full
+static void *bitmap_search(int c, span_t *head) {
+    span_t *hint = __atomic_load_n(&g_bitmap_hint[c], __ATOMIC_ACQUIRE);
+    span_t *from = hint != NULL ? hint : head;
+    for (int pass = 0; pass < 2; pass++) {
+        for (span_t *page = from; page != NULL; page = page->next) {
+            if (pass == 1 && page == hint) {
+                return NULL;
+            }
+            void *obj = bitmap_claim(page);
+            if (obj != NULL) {
+                if (page != hint) {
+                    __atomic_store_n(&g_bitmap_hint[c], page, __ATOMIC_RELEASE);
+                }
+                return obj;
+            }
+        }
+        if (from == head) {
+            return NULL;
+        }
+        from = head;
+    }
+    return NULL;
+}
+
+// Allocates an object of class c from the shared pages, adding a page when
+// every page of the class is full
+static void *bitmap_alloc(int c) {
+    if (t_bitmap_generation != g_generation) {
+        t_bitmap_thread = __atomic_fetch_add(&g_bitmap_threads, 1, __ATOMIC_RELAXED);
+        t_bitmap_generation = g_generation;
+    }
+    for (;;) {
+        span_t *head = __atomic_load_n(&g_bitmap_pages[c], __ATOMIC_ACQUIRE);
+        void *obj = bitmap_search(c, head);
+        if (obj != NULL) {
+            return obj;
+        }
+        pthread_mutex_lock(&g_bitmap_grow_lock);
+        if (__atomic_load_n(&g_bitmap_pages[c], __ATOMIC_RELAXED) != head) {
+            // another thread added a page meanwhile
+            pthread_mutex_unlock(&g_bitmap_grow_lock);
+            continue;
+        }
+        span_t *page = locked_span_alloc(CLASS_PAGE_PAGES);
+        if (page == NULL) {
+            pthread_mutex_unlock(&g_bitmap_grow_lock);
+            return NULL;
+        }
+        page->size_class = c;
+        page->bump = g_bitmap_slots[c] * g_class_size[c];
+        page->next = head;
+        uint64_t *words = page_bitmap(page);
+        memset(words, 0, g_bitmap_words[c] * sizeof(uint64_t));
+        if (g_bitmap_slots[c] % 64 != 0) {
+            // bits past the last slot stay set
+            words[g_bitmap_words[c] - 1] = ~(uint64_t)0 << g_bitmap_slots[c] % 64;
+        }
+        g_bitmap_grows++;
+        __atomic_store_n(&g_bitmap_pages[c], page, __ATOMIC_RELEASE);
+        __atomic_store_n(&g_bitmap_hint[c], page, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&g_bitmap_grow_lock);
+    }
+}
+
+// Frees an object into its bitmap page; an object already free is ignored
+static void bitmap_free(span_t *page, void *ptr) {
+    size_t slot = ((uint8_t *)ptr - (uint8_t *)span_base(page)) / g_class_size[page->size_class];
+    uint64_t mask = (uint64_t)1 << slot % 64;
+    uint64_t old = __atomic_fetch_and(&page_bitmap(page)[slot / 64], ~mask, __ATOMIC_RELEASE);
+    if (old & mask) {
+        __atomic_fetch_sub(&page->nused, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Object caches
+
+#ifdef HAVE_RSEQ
+static inline struct rseq *rseq_area(void) {
+    return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// Whether the C library registered a restartable sequence area for the
+// calling thread, and so for every thread it creates
+static bool rseq_registered(void) {
+    return __rseq_size > 0 && (int32_t)rseq_area()->cpu_id >= 0;
+}
+
+// Start of a restartable sequence: a descriptor for the code from label 1
+// to label 2 (the instruction after the commit), with its abort handler at
+// label 4, and the store that makes it the thread's current sequence
+#define RSEQ_START                                  \
+    ".pushsection __rseq_cs, \"aw\"\n\t"            \
+    ".balign 32\n"                                  \
+    "3:\n\t"                                        \
+    ".long 0, 0\n\t"                                \
+    ".quad 1f, 2f - 1f, 4f\n\t"                     \
+    ".popsection\n\t"                               \
+    "leaq 3b(%%rip), %%rax\n\t"                     \
+    "movq %%rax, %[cs]\n"                           \
+    "1:\n\t"
+
+// Points rax at the cache of the CPU the thread runs on, or jumps to label
+// if that CPU has none
+#define RSEQ_CPU_CACHE(label)                       \
+    "movl %[cpu], %%eax\n\t"                        \
+    "cmpl %[ncpus], %%eax\n\t"                      \
+    "jae %l[" #label "]\n\t"                        \
+    "imulq %[stride], %%rax, %%rax\n\t"             \
+    "addq %[caches], %%rax\n\t"
+
+// Abort handler, out of line behind the signature the kernel checks; it
+// jumps back to retry the sequence from the start
+#define RSEQ_ABORT(label)                           \
+    ".pushsection __rseq_failure, \"ax\"\n\t"       \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                    \
+    ".long 0x53053053\n"                            \
+    "4:\n\t"                                        \
+    "jmp %l[" #label "]\n\t"                        \
+    ".popsection\n\t"
+
+// Pops an object of class c from this CPU's cache into *obj; false if the
+// stack is empty
+static bool cpu_pop(int c, void **obj) {
+    struct rseq *rs = rseq_area();
+retry:
+    __asm__ goto(RSEQ_START
+                 RSEQ_CPU_CACHE(miss)
+                 "movl (%%rax,%[count]), %%ecx\n\t"
+                 "testl %%ecx, %%ecx\n\t"
+                 "jz %l[miss]\n\t"
+                 "subl $1, %%ecx\n\t"
+                 "leaq (%%rax,%[slots]), %%rdx\n\t"
+                 "movq (%%rdx,%%rcx,8), %%rdx\n\t"
+                 "movq %%rdx, (%[obj])\n\t"
+                 "movl %%ecx, (%%rax,%[count])\n"
+                 "2:\n\t"
+                 RSEQ_ABORT(retry)
+                 :
+                 : [cs] "m"(rs->rseq_cs), [cpu] "m"(rs->cpu_id), [ncpus] "m"(g_ncpus),
+                   [stride] "i"(sizeof(cache_t)), [caches] "m"(g_cpu_caches),
+                   [count] "r"(offsetof(cache_t, count) + c * sizeof(uint32_t)),
+                   [slots] "r"(offsetof(cache_t, slots) + c * sizeof(void *[CACHE_SLOTS])),
+                   [obj] "r"(obj)
+                 : "memory", "cc", "rax", "rcx", "rdx"
+                 : miss, retry);
+    return true;
+miss:
+    return false;
+}
+
+// Pushes obj onto this CPU's cache for class c; false if the stack is full
+static bool cpu_push(int c, void *obj) {
+    struct rseq *rs = rseq_area();
+retry:
+    __asm__ goto(RSEQ_START
+                 RSEQ_CPU_CACHE(full)
+                 "movl (%%rax,%[count]), %%ecx\n\t"
+                 "cmpl %[cap], %%ecx\n\t"
+                 "jae %l[full]\n\t"
+                 "leaq (%%rax,%[slots]), %%rdx\n\t"
+                 "movq %[obj], (%%rdx,%%rcx,8)\n\t"
+                 "addl $1, %%ecx\n\t"
+                 "movl %%ecx, (%%rax,%[count])\n"
+                 "2:\n\t"
+                 RSEQ_ABORT(retry)
+                 :
+                 : [cs] "m"(rs->rseq_cs), [cpu] "m"(rs->cpu_id), [ncpus] "m"(g_ncpus),
+                   [stride] "i"(sizeof(cache_t)), [caches] "m"(g_cpu_caches),
+                   [count] "r"(offsetof(cache_t, count) + c * sizeof(uint32_t)),
+                   [slots] "r"(offsetof(cache_t, slots) + c * sizeof(void *[CACHE_SLOTS])),
+                   [cap] "m"(g_cache_cap[c]), [obj] "r"(obj)
+                 : "memory", "cc", "rax", "rcx", "rdx"
+                 : full, retry);
+    return true;
+full:
+    return false;
+}
+
+// The cache of the CPU the thread last ran on, for work outside a
+// restartable sequence
+static cache_t *cpu_cache(void) {
+    uint32_t cpu = __atomic_load_n(&rseq_area()->cpu_id, __ATOMIC_RELAXED);
+    return cpu < g_ncpus ? &g_cpu_caches[cpu] : NULL;
+}
+#else
+static bool rseq_registered(void) {
+    return false;
+}
+
+static bool cpu_pop(int c, void **obj) {
+    return false;
+}
+
+static bool cpu_push(int c, void *obj) {
+    return false;
+}
+
+static cache_t *cpu_cache(void) {
+    return NULL;
+}
+#endif
+
+static inline size_t cache_pages(void) {
+    return round_up(sizeof(cache_t), PAGE_SIZE) / PAGE_SIZE;
+}
+
+static void cache_reset(cache_t *cache) {
+    memset(cache->count, 0, sizeof(cache->count));
+    for (size_t c = 0; c < NUM_CLASSES; c++) {
+        cache->overflow[c].state = BATCH_EMPTY;
+    }
+}
+
+// The calling thread's cache, claimed on first use after each myinit; NULL
+// once MAX_HEAPS threads have one or the page heap is exhausted
+static cache_t *thread_cache(void) {
+    if (t_cache_generation == g_generation) {
+        return t_cache;
+    }
+    t_cache_generation = g_generation;
+    t_cache = NULL;
+    unsigned i = __atomic_fetch_add(&g_thread_caches_used, 1, __ATOMIC_RELAXED);
+    if (i >= MAX_HEAPS) {
+        return NULL;
+    }
+    span_t *span = locked_span_alloc(cache_pages());
+    if (span != NULL) {
+        t_cache = span_base(span);
+        cache_reset(t_cache);
+    }
+    __atomic_store_n(&g_thread_caches[i], t_cache, __ATOMIC_RELEASE);
+    return t_cache;
+}
+
+static bool cache_pop(int c, void **obj) {
+    if (g_front == FRONT_CPU) {
+        return cpu_pop(c, obj);
+    }
+    cache_t *cache = thread_cache();
+    if (cache == NULL || cache->count[c] == 0) {
+        return false;
+    }
+    *obj = cache->slots[c][--cache->count[c]];
+    return true;
+}
+
+static bool cache_push(int c, void *obj) {
+    if (g_front == FRONT_CPU) {
+        return cpu_push(c, obj);
+    }
+    cache_t *cache = thread_cache();
+    if (cache == NULL || cache->count[c] == g_cache_cap[c]) {
+        return false;
+    }
+    cache->slots[c][cache->count[c]++] = obj;
+    return true;
+}
+
+// Objects of class c moved to or from the central heap or a transfer at once
+static inline size_t batch_size(int c) {
+    return g_cache_cap[c] / 2;
+}
+
+// The cache at index i of the per-CPU or per-thread caches, or NULL
+static cache_t *cache_at(unsigned i) {
+    if (g_front == FRONT_CPU) {
+        return i < g_ncpus ? &g_cpu_caches[i] : NULL;
+    }
+    return i < MAX_HEAPS ? __atomic_load_n(&g_thread_caches[i], __ATOMIC_ACQUIRE) : NULL;
+}
+
+static unsigned num_caches(void) {
+    if (g_front == FRONT_CPU) {
+        return g_ncpus;
+    }
+    unsigned n = __atomic_load_n(&g_thread_caches_used, __ATOMIC_RELAXED);
+    return n < MAX_HEAPS ? n : MAX_HEAPS;
+}
+
+// Moves the batch parked in slot to objs; false if the slot holds none
+static bool overflow_take(overflow_t *slot, int c, void **objs) {
+    uint32_t full = BATCH_FULL;
+    if (__atomic_load_n(&slot->state, __ATOMIC_RELAXED) != BATCH_FULL ||
+        !__atomic_compare_exchange_n(&slot->state, &full, BATCH_BUSY, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    memcpy(objs, slot->objs, batch_size(c) * sizeof(void *));
+    __atomic_store_n(&slot->state, BATCH_EMPTY, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Parks the batch objs in slot; false if the slot is taken
+static bool overflow_put(overflow_t *slot, int c, void **objs) {
+    uint32_t empty = BATCH_EMPTY;
+    if (!__atomic_compare_exchange_n(&slot->state, &empty, BATCH_BUSY, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    memcpy(slot->objs, objs, batch_size(c) * sizeof(void *));
+    __atomic_store_n(&slot->state, BATCH_FULL, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Finds a batch of class c without the central lock: in the overflow of
+// the calling thread's cache, then in the transfer cache, then by stealing
+// the overflow of another cache, whose owner has not needed it back
+static bool take_batch(int c, void **objs) {
+    cache_t *own = g_front == FRONT_CPU ? cpu_cache() : thread_cache();
+    if (own != NULL && overflow_take(&own->overflow[c], c, objs)) {
+        __atomic_fetch_add(&g_reclaimed_batches, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    transfer_t *transfer = &g_transfer_cache[c];
+    if (__atomic_load_n(&transfer->nbatches, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&transfer->lock);
+        uint32_t n = transfer->nbatches;
+        if (n > 0) {
+            memcpy(objs, transfer->objs[n - 1], batch_size(c) * sizeof(void *));
+            __atomic_store_n(&transfer->nbatches, n - 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&transfer->lock);
+        if (n > 0) {
+            __atomic_fetch_add(&g_transfer_batches, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    unsigned ncaches = num_caches();
+    for (unsigned i = 0; i < ncaches; i++) {
+        cache_t *other = cache_at(i);
+        if (other != NULL && other != own && overflow_take(&other->overflow[c], c, objs)) {
+            __atomic_fetch_add(&g_stolen_batches, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parks a batch of class c without the central lock, in the overflow of the
+// calling thread's cache or else the transfer cache; false if both are full
+static bool put_batch(int c, void **objs) {
+    cache_t *own = g_front == FRONT_CPU ? cpu_cache() : thread_cache();
+    if (own != NULL && overflow_put(&own->overflow[c], c, objs)) {
+        return true;
+    }
+    transfer_t *transfer = &g_transfer_cache[c];
+    pthread_mutex_lock(&transfer->lock);
+    uint32_t n = transfer->nbatches;
+    if (n < TRANSFER_BATCHES) {
+        memcpy(transfer->objs[n], objs, batch_size(c) * sizeof(void *));
+        __atomic_store_n(&transfer->nbatches, n + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&transfer->lock);
+    return n < TRANSFER_BATCHES;
+}
+
+// Returns n objects to the central heap
+static void central_free(void **objs, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    pthread_mutex_lock(&g_central_lock);
+    g_central_locks++;
+    for (size_t i = 0; i < n; i++) {
+        free_local(&g_central, span_of(objs[i]), objs[i]);
+    }
+    pthread_mutex_unlock(&g_central_lock);
+}
+
+// Takes up to n objects of class c from the central heap; returns how many
+static size_t central_alloc(int c, void **objs, size_t n) {
+    size_t got = 0;
+    pthread_mutex_lock(&g_central_lock);
+    g_central_locks++;
+    while (got < n) {
+        span_t *page = g_central.pages[c];
+        objs[got] = page->free_objects != NULL ? page_pop(page) : malloc_generic(&g_central, c);
+        if (objs[got] == NULL) {
+            break;
+        }
+        got++;
+    }
+    pthread_mutex_unlock(&g_central_lock);
+    return got;
+}
+
+// Cache miss: takes a batch of class c, from elsewhere without a lock if
+// one is parked or else from the central heap, returns one object and
+// caches the rest
+static void *cache_refill(int c) {
+    void *batch[CACHE_SLOTS / 2];
+    size_t n = batch_size(c);
+    if (!g_transfer || !take_batch(c, batch)) {
+        n = central_alloc(c, batch, n);
+        if (n == 0) {
+            return NULL;
+        }
+    }
+    size_t cached = 1;
+    while (cached < n && cache_push(c, batch[cached])) {
+        cached++;
+    }
+    central_free(batch + cached, n - cached);
+    return batch[0];
+}
+
+// Cache full: spills a batch, parked for other caches if there is room and
+// otherwise returned to the central heap, then caches ptr
+static void cache_drain(int c, void *ptr) {
+    void *batch[CACHE_SLOTS / 2];
+    size_t n = 0;
+    while (n < batch_size(c) && cache_pop(c, &batch[n])) {
+        n++;
+    }
+    if (n < batch_size(c) || !g_transfer || !put_batch(c, batch)) {
+        central_free(batch, n);
+    }
+    if (!cache_push(c, ptr)) {
+        central_free(&ptr, 1);
+    }
+}
+
+
+/* Function: myconfig
+ * ------------------
+ * Accepts "decommit=<pages>", the length from which freed spans are
+ * returned to the OS (0 never decommits), and "hugepage=on|off", which
+ * packs pages into 2 MiB hugepages and returns memory a whole empty
+ * hugepage at a time (on by default; decommit applies only when off).
+ * "front=heap|cpu|thread|bitmap" picks per-thread heaps (the default), a
+ * central heap behind per-CPU or per-thread object caches, or shared pages
+ * claimed through their occupancy bitmaps without a lock, and
+ * "transfer=on|off" whether those caches pass whole batches to each other
+ * without the central heap (on by default).
+ */
+bool myconfig(const char *key, const char *value) {
+    if (strcmp(key, "transfer") == 0) {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+            return false;
+        }
+        g_transfer_option = strcmp(value, "on") == 0;
+        return true;
+    }
+    if (strcmp(key, "front") == 0) {
+        static const char *const names[] = {"heap", "cpu", "thread", "bitmap"};
+        for (front_t f = FRONT_HEAP; f <= FRONT_BITMAP; f++) {
+            if (strcmp(value, names[f]) == 0) {
+                g_front_option = f;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (strcmp(key, "decommit") == 0) {
+        char *end;
+        unsigned long pages = strtoul(value, &end, 10);
+        if (*value == '\0' || *end != '\0') {
+            return false;
+        }
+        g_decommit_pages = pages;
+        return true;
+    }
+    if (strcmp(key, "hugepage") == 0) {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+            return false;
+        }
+        g_hugepage_aware = strcmp(value, "on") == 0;
+        return true;
+    }
+    return false;
+}
+
+bool myinit(void *heap_start, size_t heap_size) {
+    if (!g_ready) {
+        build_classes();
+        bitmap_layout();
+        for (size_t c = 1; c < NUM_CLASSES; c++) {
+            size_t fit = CACHE_CLASS_BYTES / g_class_size[c];
+            g_cache_cap[c] = fit < CACHE_SLOTS ? fit : CACHE_SLOTS;
+            pthread_mutex_init(&g_transfer_cache[c].lock, NULL);
+        }
+        g_ready = true;
+    }
+    for (size_t i = 0; i < MAX_HEAPS; i++) {
+        heap_reset(&g_heaps[i]);
+    }
+    heap_reset(&g_central);
+    for (size_t c = 0; c < NUM_CLASSES; c++) {
+        g_transfer_cache[c].nbatches = 0;
+        g_bitmap_pages[c] = g_bitmap_hint[c] = NULL;
+    }
+    g_heaps_used = 0;
+    g_thread_caches_used = 0;
+    g_bitmap_threads = 0;
+    g_generation++;
+    g_central_locks = g_transfer_batches = g_reclaimed_batches = g_stolen_batches = 0;
+    g_bitmap_retries = g_bitmap_grows = 0;
+    g_transfer = g_transfer_option;
+    if (!pageheap_init(heap_start, heap_size, g_decommit_pages, g_hugepage_aware)) {
+        return false;
+    }
+
+    g_front = g_front_option;
+    if (g_front == FRONT_CPU && !rseq_registered()) {
+        g_front = FRONT_THREAD;
+    }
+    if (g_front == FRONT_CPU) {
+        g_ncpus = get_nprocs_conf();
+        span_t *span = span_alloc(round_up(g_ncpus * sizeof(cache_t), PAGE_SIZE) / PAGE_SIZE);
+        if (span == NULL) {
+            return false;
+        }
+        g_cpu_caches = span_base(span);
+        for (uint32_t i = 0; i < g_ncpus; i++) {
+            cache_reset(&g_cpu_caches[i]);
+        }
+    }
+    return true;
+}
+
+/* Function: mymalloc
+ * ------------------
+ * Pops from the allocation list of the thread's current page for the size
+ * class; everything else is in malloc_generic. With object caches, pops
+ * from the cache instead and refills it on a miss, and with bitmap pages
+ * claims a slot of a shared page. Threads beyond the first MAX_HEAPS
+ * share the central heap and allocate under its lock. Larger requests get
+ * a span of their own.
+ */
+void *mymalloc(size_t requested_size) {
+    if (requested_size - 1 < MAX_SMALL) {
+        int c = g_class_of[(requested_size + ALIGNMENT - 1) / ALIGNMENT];
+        if (g_front == FRONT_BITMAP) {
+            return bitmap_alloc(c);
+        }
+        if (g_front != FRONT_HEAP) {
+            void *obj;
+            return cache_pop(c, &obj) ? obj : cache_refill(c);
+        }
+        heap_t *heap = thread_heap();
+        if (heap == &g_central) {
+            void *obj;
+            return central_alloc(c, &obj, 1) == 1 ? obj : NULL;
+        }
+        span_t *page = heap->pages[c];
+        void *block = page->free_objects;
+        if (block == NULL) {
+            return malloc_generic(heap, c);
+        }
+        page->free_objects = *(void **)block;
+        page->nused++;
+        return block;
+    }
+    if (requested_size == 0 || requested_size > MAX_REQUEST_SIZE || !g_ready) {
+        return NULL;
+    }
+    span_t *span = locked_span_alloc(round_up(requested_size, PAGE_SIZE) / PAGE_SIZE);
+    if (span == NULL) {
+        return NULL;
+    }
+    span->nused = 1;
+    return span_base(span);
+}
+
+// Allocation step of mymalloc_flags: a hot small block takes a class of
+// whole lines, and a realloc-heavy large object is marked on its span to
+// keep its slack through myrealloc
+static void *malloc_hinted(size_t size, unsigned flags) {
+    if ((flags & MALLOC_HOT) && size != 0 && size <= MAX_SMALL) {
+        size = round_up(size, CACHE_LINE_SIZE);
+    }
+    void *ptr = mymalloc(size);
+    if (ptr != NULL && (flags & MALLOC_REALLOC_HEAVY) && size > MAX_SMALL) {
+        object_span(ptr)->realloc_heavy = true;
+    }
+    return ptr;
+}
+
+/* Function: mymalloc_flags
+ * ------------------------
+ * Slots sit at multiples of their size from a page boundary, and every
+ * class at or above 64 bytes that a multiple of 64 rounds to is itself a
+ * multiple of 64, so rounding a hot request up to a whole cache line is
+ * enough to align it; large spans are page-aligned anyway. Realloc-heavy
+ * blocks reserve slack, zeroed blocks are cleared up to the request, and
+ * lifetime hints are ignored.
+ */
+void *mymalloc_flags(size_t requested_size, unsigned flags) {
+    return malloc_flagged(malloc_hinted, requested_size, flags);
+}
+
+/* Function: myfree
+ * ----------------
+ * Looks the object's span up in the page map; pointers that do not start
+ * an object in an in-use span are ignored. The owning thread frees into
+ * the page's local list, any other thread into its atomic thread list;
+ * threads sharing the central heap free into it under its lock. With
+ * object caches, the object goes to the cache, and half the cache to
+ * the central heap when it is full. A bitmap page's object just has its
+ * bit cleared.
+ */
+void myfree(void *ptr) {
+    span_t *span = object_span(ptr);
+    if (span == NULL) {
+        return;
+    }
+    if (span->size_class == 0) {
+        locked_span_free(span);
+        return;
+    }
+    if (g_front == FRONT_BITMAP) {
+        bitmap_free(span, ptr);
+        return;
+    }
+    if (g_front != FRONT_HEAP) {
+        if (!cache_push(span->size_class, ptr)) {
+            cache_drain(span->size_class, ptr);
+        }
+        return;
+    }
+    heap_t *heap = thread_heap();
+    if (span->owner == heap && heap == &g_central) {
+        central_free(&ptr, 1);
+    } else if (span->owner == heap) {
+        free_local(heap, span, ptr);
+    } else {
+        free_remote(span, ptr);
+    }
+}
+
+/* Function: myrealloc
+ * -------------------
+ * Stays in place while the new size fits the object's slot or span, and
+ * otherwise moves the object with malloc/copy/free.
+ */
+void *myrealloc(void *old_ptr, size_t new_size) {
+    if (old_ptr == NULL) {
+        return mymalloc(new_size);
+    }
+    if (new_size == 0) {
+        myfree(old_ptr);
+        return NULL;
+    }
+    span_t *span = object_span(old_ptr);
+    if (span == NULL) {
+        return NULL;
+    }
+    size_t old_usable = usable_size(span);
+    if (new_size <= old_usable) {
+        return old_ptr;
+    }
+    // a realloc-heavy large object reserves its slack again when it moves
+    void *new_ptr = span->realloc_heavy ? mymalloc_flags(new_size, MALLOC_REALLOC_HEAVY)
+                                        : mymalloc(new_size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, old_ptr, old_usable);
+    myfree(old_ptr);
+    return new_ptr;
+}
+
+/* Function: myusable_size
+ * ------------------------
+ * A small object's slot size or a large object's whole span, found through
+ * the page map in a few loads. A slot that was freed still reports its
+ * size, since telling it from a live one would mean searching lists other
+ * threads own.
+ */
+size_t myusable_size(void *ptr) {
+    span_t *span = object_span(ptr);
+    return span == NULL ? 0 : usable_size(span);
+}
+
+/* Function: mystats
+ * -----------------
+ * Reports how often the object caches took the central heap's lock, and
+ * how many batches they got without it: from the transfer cache, back from
+ * their own overflow, or stolen from another cache's. With bitmap pages,
+ * reports how many compare-and-swaps lost a race for a word and how many
+ * pages were added.
+ */
+size_t mystats(stat_t stats[], size_t max) {
+    stat_t all[] = {
+        {"central_locks", g_central_locks},
+        {"transfer_batches", g_transfer_batches},
+        {"reclaimed_batches", g_reclaimed_batches},
+        {"stolen_batches", g_stolen_batches},
+        {"bitmap_retries", g_bitmap_retries},
+        {"bitmap_pages", g_bitmap_grows},
+    };
+    size_t n = sizeof(all) / sizeof(all[0]) < max ? sizeof(all) / sizeof(all[0]) : max;
+    memcpy(stats, all, n * sizeof(stat_t));
+    return n;
+}
+
+// Counts a free list of page, checking every object is a carved slot
+static bool count_free(span_t *page, void *list, size_t *count) {
+    size_t size = g_class_size[page->size_class];
+    uint8_t *base = span_base(page);
+    for (uint8_t *slot = list; slot != NULL; slot = *(uint8_t **)slot) {
+        if (slot < base || slot >= base + page->bump || (slot - base) % size != 0 ||
+            ++*count > page->bump / size) {
+            printf("class %d: bad free slot %p\n", page->size_class, slot);
+            breakpoint();
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checks one page of heap: ownership, class, list membership and that its
+// free lists and allocated count add up to the slots carved. Objects on the
+// thread list still count as allocated until the owner collects them.
+static bool validate_page(heap_t *heap, span_t *page, int c, bool full) {
+    if (!page->in_use || page->owner != heap || page->in_full != full ||
+        (!full && page->size_class != c)) {
+        printf("class %d: page %p is in the wrong list\n", c, page);
+        breakpoint();
+        return false;
+    }
+    size_t nfree = 0;
+    size_t nremote = 0;
+    if (!count_free(page, page->free_objects, &nfree) ||
+        !count_free(page, page->local_free, &nfree) ||
+        !count_free(page, page->thread_free, &nremote)) {
+        return false;
+    }
+    size_t carved = page->bump / g_class_size[page->size_class];
+    if (nfree + page->nused != carved || nremote > page->nused) {
+        printf("class %d: %zu free + %u used slots != %zu carved\n", page->size_class,
+               nfree, page->nused, carved);
+        breakpoint();
+        return false;
+    }
+    return true;
+}
+
+// Checks every page of one heap, its class queues and its full list
+static bool validate_pages(heap_t *heap, const char *name) {
+    for (size_t c = 1; c < NUM_CLASSES; c++) {
+        span_t *prev = NULL;
+        for (span_t *page = heap->pages[c]; page != &g_empty_page; page = page->next) {
+            if (page == NULL || page->prev != prev || !validate_page(heap, page, c, false)) {
+                printf("%s class %zu: queue is corrupt\n", name, c);
+                breakpoint();
+                return false;
+            }
+            prev = page;
+            if (page->next == NULL) {
+                break;
+            }
+        }
+    }
+    span_t *prev = NULL;
+    for (span_t *page = heap->full; page != NULL; page = page->next) {
+        if (page->prev != prev || !validate_page(heap, page, page->size_class, true)) {
+            printf("%s: full list is corrupt\n", name);
+            breakpoint();
+            return false;
+        }
+        prev = page;
+    }
+    return true;
+}
+
+// Checks that n cached objects are objects of class c from pages of the
+// central heap, which counts them as allocated
+static bool validate_objects(void *const *objs, size_t n, size_t c) {
+    for (size_t i = 0; i < n; i++) {
+        span_t *page = object_span(objs[i]);
+        if (page == NULL || page->size_class != c || page->owner != &g_central) {
+            printf("class %zu: bad cached object %p\n", c, objs[i]);
+            breakpoint();
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checks a cache's stacks and overflow slots
+static bool validate_cache(const cache_t *cache) {
+    for (size_t c = 1; c < NUM_CLASSES; c++) {
+        const overflow_t *slot = &cache->overflow[c];
+        if (cache->count[c] > g_cache_cap[c] || slot->state == BATCH_BUSY) {
+            printf("cache %p class %zu: holds %u objects, overflow %s\n", cache, c,
+                   cache->count[c], slot->state == BATCH_BUSY ? "busy" : "idle");
+            breakpoint();
+            return false;
+        }
+        if (!validate_objects(cache->slots[c], cache->count[c], c) ||
+            (slot->state == BATCH_FULL && !validate_objects(slot->objs, batch_size(c), c))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checks the bitmap pages of every class: their layout, that the bits past
+// the last slot are set, and that the set bits add up to the used count
+static bool validate_bitmaps(void) {
+    for (size_t c = 1; c < NUM_CLASSES; c++) {
+        for (span_t *page = g_bitmap_pages[c]; page != NULL; page = page->next) {
+            const uint64_t *words = page_bitmap(page);
+            size_t used = 0;
+            for (uint32_t w = 0; w < g_bitmap_words[c]; w++) {
+                used += __builtin_popcountll(words[w]);
+            }
+            size_t padding = g_bitmap_words[c] * 64 - g_bitmap_slots[c];
+            uint64_t last = words[g_bitmap_words[c] - 1];
+            if (!page->in_use || page->size_class != c ||
+                page->bump != g_bitmap_slots[c] * g_class_size[c] ||
+                (padding > 0 && last >> (64 - padding) != ~(uint64_t)0 >> (64 - padding)) ||
+                used - padding != page->nused) {
+                printf("class %zu: bitmap page %p has %zu bits set for %u used slots\n", c,
+                       page, used - padding, page->nused);
+                breakpoint();
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* Function: validate_heap
+ * -----------------------
+ * Checks the page heap, then every page of every thread heap, or of the
+ * central heap, every object cache and the transfer cache, and every
+ * bitmap page. Only call it while no other thread uses the allocator.
+ */
+bool validate_heap() {
+    if (!g_ready || !pageheap_validate() || g_empty_page.free_objects != NULL) {
+        return false;
+    }
+    unsigned nheaps = g_heaps_used < MAX_HEAPS ? g_heaps_used : MAX_HEAPS;
+    for (unsigned i = 0; i < nheaps; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "heap %u", i);
+        if (!validate_pages(&g_heaps[i], name)) {
+            return false;
+        }
+    }
+    if (!validate_pages(&g_central, "central heap") || !validate_bitmaps()) {
+        return false;
+    }
+    if (g_front == FRONT_CPU) {
+        for (uint32_t i = 0; i < g_ncpus; i++) {
+            if (!validate_cache(&g_cpu_caches[i])) {
+                return false;
+            }
+        }
+    }
+    unsigned ncaches = g_thread_caches_used < MAX_HEAPS ? g_thread_caches_used : MAX_HEAPS;
+    for (unsigned i = 0; i < ncaches; i++) {
+        if (g_thread_caches[i] != NULL && !validate_cache(g_thread_caches[i])) {
+            return false;
+        }
+    }
+    for (size_t c = 1; c < NUM_CLASSES; c++) {
+        const transfer_t *transfer = &g_transfer_cache[c];
+        if (transfer->nbatches > TRANSFER_BATCHES) {
+            printf("class %zu: transfer cache holds %u batches\n", c, transfer->nbatches);
+            breakpoint();
+            return false;
+        }
+        for (uint32_t i = 0; i < transfer->nbatches; i++) {
+            if (!validate_objects(transfer->objs[i], batch_size(c), c)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Prints how many pages one heap holds per class
+static void dump_pages(heap_t *heap, const char *name) {
+    for (size_t c = 1; c < NUM_CLASSES; c++) {
+        size_t n = 0;
+        for (span_t *page = heap->pages[c]; page != &g_empty_page && page != NULL;
+             page = page->next) {
+            n++;
+        }
+        if (n > 0) {
+            printf("%s class %2zu (%4zu bytes): %zu pages\n", name, c, g_class_size[c], n);
+        }
+    }
+}
+
+/* Function: dump_heap
+ * -------------------
+ * This function is not called anywhere, but is useful from gdb. It prints
+ * the page heap's spans and how many pages each heap, including the
+ * central one, holds per class.
+ */
+void dump_heap(void) {
+    pageheap_dump();
+    unsigned nheaps = g_heaps_used < MAX_HEAPS ? g_heaps_used : MAX_HEAPS;
+    for (unsigned i = 0; i < nheaps; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "heap %u", i);
+        dump_pages(&g_heaps[i], name);
+    }
+    dump_pages(&g_central, "central");
+}
@@ -0,0 +1,25 @@
+/* File: stats.h
+ * -------------
+ * Counters that a thread-safe allocator keeps about itself, such as how
+ * often it took a shared lock, for the multithreaded test to report. Each
+ * allocator keeps its own set; every counter starts from zero at myinit.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stddef.h>
+
+typedef struct {
+    const char *name;
+    unsigned long value;
+} stat_t;
+
+/* Function: mystats
+ * -----------------
+ * Stores up to max of the allocator's counters in stats and returns how
+ * many it stored. Only call it while no other thread uses the allocator.
+ */
+size_t mystats(stat_t stats[], size_t max);
+
+#endif
@@ -0,0 +1,915 @@
+/* File: striped.c
+ * ---------------
+ * A thread-safe explicit free-list allocator whose heap is split into
+ * address stripes, each with its own lock and free lists, so threads that
+ * work in different stripes allocate, free and coalesce in parallel.
+ *
+ * Blocks follow explicit.c: a header holding the size and flags, and free
+ * blocks on doubly linked, size-segregated lists, merged with their free
+ * neighbours the moment they are freed. A free block also ends in a footer
+ * holding its size, and the block after it has FLAG_PREV_FREE set, so the
+ * left neighbour is found in one load instead of by walking the heap.
+ *
+ * Every thread has a home stripe, assigned round-robin, and allocates there
+ * first: a first-fit search of the stripe's lists, then a cut from the
+ * stripe's never-used space above its top. Only when both fail does it try
+ * the other stripes. A free block belongs to the stripe holding its header,
+ * and the last free block below a top goes back above the top.
+ *
+ * Locking: an operation on a block holds the lock of the stripe holding
+ * its header and of the stripe holding the header after it, whose
+ * FLAG_PREV_FREE it may change, and a free that merges leftward also holds
+ * the left neighbour's. Locks are always taken in address order. Blocks
+ * and merges may cross stripe boundaries, which is when one operation
+ * holds several locks; a stripe's top only reaches its end when everything
+ * below is in use. A free learns its left neighbour from that block's
+ * footer, which it reads holding only its own stripe's lock; if the
+ * neighbour lies in a lower stripe it drops its locks and takes them again
+ * in order. Headers and footers are read and written with relaxed atomics
+ * because of such reads, as a footer may be rewritten meanwhile under
+ * another stripe's lock.
+ *
+ * myfree_async (async.h) hands blocks to a background drain thread through
+ * a ring per calling thread, with one producer and one consumer, so it
+ * needs no lock. The drain thread empties the rings into a batch, sorts it
+ * by address and frees each run of adjacent blocks as one block.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./allocator.h"
+#include "./async.h"
+#include "./debug_break.h"
+#include "./lock.h"
+#include "./stats.h"
+
+// Header flags, in the low bits of the size
+#define FLAG_ALLOC 1            // the block is allocated
+#define FLAG_PREV_FREE 2        // the block before is free and ends in a footer
+#define FLAG_REALLOC 4          // realloc-heavy block that keeps its slack
+#define FLAG_MASK 7
+
+// Headers end on an alignment boundary, so payloads are aligned
+#define HDR_SIZE sizeof(size_t)
+#define HDR_PAD ((ALIGNMENT - HDR_SIZE % ALIGNMENT) % ALIGNMENT)
+// room for a header, two free-list links and a footer
+#define MIN_BLOCK ((4 * sizeof(size_t) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+#define MAX_STRIPES 64
+#define DEFAULT_STRIPES 8
+// smallest stripe myinit makes by itself; fewer stripes are used on a small heap
+#define MIN_STRIPE_SIZE ((size_t)1 << 20)
+// smallest stripe the stripe_size setting may ask for
+#define MIN_STRIPE_OPTION ((size_t)1 << 12)
+// free list i holds blocks of 2^(i+5) up to 2^(i+6) bytes; the last, all larger
+#define NUM_LISTS 24
+// pointers one thread's async ring holds; a power of two
+#define RING_SLOTS 1024
+// most threads with an async ring; later threads free synchronously
+#define MAX_RINGS 256
+// most pointers the drain thread sorts and frees at once
+#define DRAIN_BATCH 8192
+
+typedef struct {
+    lock_t lock;
+    uint8_t *start;             // first header address in the stripe
+    uint8_t *end;
+    uint8_t *top;               // never-used space starts here
+    bool top_prev_free;         // the block ending at top is free
+    void *lists[NUM_LISTS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) stripe_t;
+
+// A thread's async ring: it fills slots at tail, the drain thread empties
+// them at head, and each index lives on its own cache line
+typedef struct {
+    size_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    void *slots[RING_SLOTS];
+} ring_t;
+
+// What myfree_async does with a block when the thread's ring is full
+typedef enum { FULL_SYNC, FULL_WAIT } full_policy_t;
+
+static stripe_t g_stripes[MAX_STRIPES];
+static unsigned g_stripes_option = DEFAULT_STRIPES;
+static size_t g_stripe_size_option;     // 0 to split the heap evenly
+static unsigned g_nstripes;
+static size_t g_stripe_size;
+static uint8_t *g_base;         // first header address in the heap
+static uint8_t *g_end;
+// bumped by myinit so every thread picks a fresh home stripe
+static unsigned g_generation;
+static unsigned g_next_home;
+
+static __thread unsigned t_home;
+static __thread unsigned t_generation;
+
+// Counters for mystats besides the locks', reset by myinit
+static unsigned long g_cross_merges;    // merges across a stripe boundary
+static unsigned long g_away_allocs;     // allocations outside the home stripe
+static unsigned long g_async_frees;     // blocks the drain thread freed
+static unsigned long g_async_runs;      // runs of adjacent blocks it freed them as
+static unsigned long g_async_full;      // myfree_async calls that found the ring full
+
+// Rings are claimed per thread after each myinit and allocated from the heap
+static ring_t *g_rings[MAX_RINGS];
+static unsigned g_rings_used;
+static __thread ring_t *t_ring;
+static __thread unsigned t_ring_generation;
+static full_policy_t g_full_policy = FULL_SYNC;
+
+// The drain thread sleeps on g_drain_wake when every ring is empty, with
+// g_drain_sleeping set so the next push wakes it, and wakes myfree_flush
+// callers on g_drain_done when it goes idle
+static pthread_mutex_t g_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_drain_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_drain_done = PTHREAD_COND_INITIALIZER;
+static bool g_drain_started;            // under g_drain_lock
+static bool g_drain_idle;               // under g_drain_lock
+static bool g_drain_sleeping;
+static void *g_drain_batch[DRAIN_BATCH];    // the drain thread's only
+
+
+static inline size_t hdr_load(void *hdr) {
+    return __atomic_load_n((size_t *)hdr, __ATOMIC_RELAXED);
+}
+
+static inline void hdr_store(void *hdr, size_t value) {
+    __atomic_store_n((size_t *)hdr, value, __ATOMIC_RELAXED);
+}
+
+static inline size_t blk_size(void *hdr) {
+    return hdr_load(hdr) & ~(size_t)FLAG_MASK;
+}
+
+static inline bool blk_alloc(void *hdr) {
+    return (hdr_load(hdr) & FLAG_ALLOC) != 0;
+}
+
+static inline bool blk_prev_free(void *hdr) {
+    return (hdr_load(hdr) & FLAG_PREV_FREE) != 0;
+}
+
+// Writes a free block's header (its left neighbour is never free) and footer
+static inline void write_free(void *hdr, size_t size) {
+    hdr_store(hdr, size);
+    hdr_store((uint8_t *)hdr + size - sizeof(size_t), size);
+}
+
+// Header of the free block ending just below hdr, from its footer
+static inline uint8_t *left_of(void *hdr) {
+    return (uint8_t *)hdr - hdr_load((uint8_t *)hdr - sizeof(size_t));
+}
+
+static inline unsigned stripe_of(const void *p) {
+    size_t i = (size_t)((const uint8_t *)p - g_base) / g_stripe_size;
+    return i < g_nstripes ? i : g_nstripes - 1;
+}
+
+static inline uint64_t stripe_bit(unsigned i) {
+    return (uint64_t)1 << i;
+}
+
+static inline uint8_t *stripe_top(const stripe_t *s) {
+    return __atomic_load_n(&s->top, __ATOMIC_RELAXED);
+}
+
+// True if a block starts at p, a block end; the caller holds p's stripe
+static inline bool is_block(uint8_t *p) {
+    return p < g_end && p < g_stripes[stripe_of(p)].top;
+}
+
+static inline size_t align_up(size_t n) {
+    return (n + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+
+// Convert requested size to aligned block size
+static inline size_t request_to_asize(size_t requested) {
+    size_t total = align_up(HDR_SIZE + requested);
+    return total < MIN_BLOCK ? MIN_BLOCK : total;
+}
+
+// Free-list links follow the header
+static inline void **link_next(void *hdr) {
+    return (void **)((uint8_t *)hdr + HDR_SIZE);
+}
+
+static inline void **link_prev(void *hdr) {
+    return (void **)((uint8_t *)hdr + HDR_SIZE + sizeof(void *));
+}
+
+static inline unsigned list_index(size_t size) {
+    unsigned i = 63 - __builtin_clzl(size) - 5;
+    return i < NUM_LISTS ? i : NUM_LISTS - 1;
+}
+
+static void list_insert(stripe_t *s, void *hdr) {
+    void **head = &s->lists[list_index(blk_size(hdr))];
+    *link_prev(hdr) = NULL;
+    *link_next(hdr) = *head;
+    if (*head != NULL) {
+        *link_prev(*head) = hdr;
+    }
+    *head = hdr;
+}
+
+static void list_remove(stripe_t *s, void *hdr) {
+    void *prev = *link_prev(hdr);
+    void *next = *link_next(hdr);
+    if (prev != NULL) {
+        *link_next(prev) = next;
+    } else {
+        s->lists[list_index(blk_size(hdr))] = next;
+    }
+    if (next != NULL) {
+        *link_prev(next) = prev;
+    }
+}
+
+// Locks the stripes in mask in address order
+static void lock_stripes(uint64_t mask) {
+    for (unsigned i = 0; i < g_nstripes; i++) {
+        if (mask & stripe_bit(i)) {
+            lock_acquire(&g_stripes[i].lock);
+        }
+    }
+}
+
+static void unlock_stripes(uint64_t mask) {
+    for (unsigned i = 0; i < g_nstripes; i++) {
+        if (mask & stripe_bit(i)) {
+            lock_release(&g_stripes[i].lock);
+        }
+    }
+}
+
+// Adds stripe i to the held set; i is never below a stripe already held
+static void lock_more(uint64_t *held, unsigned i) {
+    if ((*held & stripe_bit(i)) == 0) {
+        lock_acquire(&g_stripes[i].lock);
+        *held |= stripe_bit(i);
+    }
+}
+
+// Tells the block or top at p, a block end, whether the block before it is
+// free; the caller holds p's stripe
+static void set_prev_free(uint8_t *p, bool free) {
+    if (p >= g_end) {
+        return;
+    }
+    stripe_t *s = &g_stripes[stripe_of(p)];
+    if (p < s->top) {
+        size_t h = hdr_load(p);
+        hdr_store(p, free ? h | FLAG_PREV_FREE : h & ~(size_t)FLAG_PREV_FREE);
+    } else {
+        s->top_prev_free = free;
+    }
+}
+
+// The calling thread's home stripe, picked round-robin after each myinit
+static unsigned home_stripe(void) {
+    if (t_generation != g_generation) {
+        t_home = __atomic_fetch_add(&g_next_home, 1, __ATOMIC_RELAXED) % g_nstripes;
+        t_generation = g_generation;
+    }
+    return t_home;
+}
+
+// Marks the free block hdr of size bsize allocated at asize, splitting off
+// the rest as a free block if it is big enough; held holds hdr's stripe
+// and no stripe above it. A free block never has FLAG_REALLOC, so only a
+// block growing in place keeps it.
+static void take_block(void *hdr, size_t bsize, size_t asize, uint64_t *held) {
+    size_t keep = hdr_load(hdr) & (FLAG_PREV_FREE | FLAG_REALLOC);
+    uint8_t *end = (uint8_t *)hdr + bsize;
+    if (bsize - asize >= MIN_BLOCK) {
+        uint8_t *rest = (uint8_t *)hdr + asize;
+        unsigned t = stripe_of(rest);
+        lock_more(held, t);
+        write_free(rest, bsize - asize);
+        list_insert(&g_stripes[t], rest);
+        bsize = asize;
+    } else if (end < g_end) {
+        lock_more(held, stripe_of(end));
+        set_prev_free(end, false);
+    }
+    hdr_store(hdr, bsize | keep | FLAG_ALLOC);
+}
+
+// Allocates from stripe i: first fit over its lists, then a cut from its
+// top, setting flags in the new block's header. Returns the header, or NULL.
+static void *stripe_alloc(unsigned i, size_t asize, size_t flags) {
+    stripe_t *s = &g_stripes[i];
+    uint64_t held = 0;
+    lock_more(&held, i);
+    void *found = NULL;
+    for (unsigned l = list_index(asize); l < NUM_LISTS && found == NULL; l++) {
+        for (void *b = s->lists[l]; b != NULL; b = *link_next(b)) {
+            if (blk_size(b) >= asize) {
+                found = b;
+                break;
+            }
+        }
+    }
+    if (found != NULL) {
+        list_remove(s, found);
+        take_block(found, blk_size(found), asize, &held);
+    } else if ((size_t)(s->end - s->top) >= asize) {
+        // the block after the cut is the stripe's top or the next stripe's
+        // first block, whose left neighbour was never-used space: not free
+        found = s->top;
+        hdr_store(found, asize | FLAG_ALLOC | (s->top_prev_free ? FLAG_PREV_FREE : 0));
+        __atomic_store_n(&s->top, s->top + asize, __ATOMIC_RELAXED);
+        s->top_prev_free = false;
+    }
+    if (found != NULL) {
+        hdr_store(found, hdr_load(found) | flags);
+    }
+    unlock_stripes(held);
+    return found;
+}
+
+// Frees size bytes of allocated blocks starting at hdr as one block and
+// merges it with free neighbours, under the locks of hdr's stripe, of the
+// stripe after the range and of its left neighbour's stripe. Headers inside
+// the range are left as they are; nothing reads them once it is free.
+static void free_range(void *hdr, size_t size) {
+    uint8_t *next = (uint8_t *)hdr + size;
+    unsigned k = stripe_of(hdr);
+    uint64_t held = stripe_bit(k) | (next < g_end ? stripe_bit(stripe_of(next)) : 0);
+    uint8_t *left;
+    for (;;) {
+        // with hdr's stripe held the left neighbour stays free, so its
+        // footer stays a footer; retake the locks if it is in a lower stripe
+        lock_stripes(held);
+        left = blk_prev_free(hdr) ? left_of(hdr) : NULL;
+        if (left == NULL || (held & stripe_bit(stripe_of(left)))) {
+            break;
+        }
+        unlock_stripes(held);
+        held |= stripe_bit(stripe_of(left));
+    }
+
+    uint8_t *merged = hdr;
+    size_t msize = size;
+    if (left != NULL) {
+        list_remove(&g_stripes[stripe_of(left)], left);
+        merged = left;
+        msize += blk_size(left);
+        if (stripe_of(left) != k) {
+            __atomic_fetch_add(&g_cross_merges, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (is_block(next) && !blk_alloc(next)) {
+        unsigned r = stripe_of(next);
+        list_remove(&g_stripes[r], next);
+        msize += blk_size(next);
+        if (r != stripe_of(merged)) {
+            __atomic_fetch_add(&g_cross_merges, 1, __ATOMIC_RELAXED);
+        }
+    }
+    write_free(merged, msize);
+    uint8_t *end = merged + msize;
+    stripe_t *s = &g_stripes[stripe_of(merged)];
+    if (end == s->top && end < s->end) {
+        // the last block below the top goes back above it
+        __atomic_store_n(&s->top, merged, __ATOMIC_RELAXED);
+        s->top_prev_free = false;
+    } else {
+        list_insert(s, merged);
+        if (end == next) {
+            set_prev_free(next, true);
+        }
+    }
+    unlock_stripes(held);
+}
+
+static void free_block(void *hdr) {
+    free_range(hdr, blk_size(hdr));
+}
+
+// Grows the allocated block hdr to asize bytes, or up to keep bytes where
+// there is room, into a free right neighbour or its stripe's never-used
+// space; false if neither has room
+static bool grow_in_place(void *hdr, size_t asize, size_t keep) {
+    size_t cur = blk_size(hdr);
+    uint8_t *next = (uint8_t *)hdr + cur;
+    if (next >= g_end) {
+        return false;
+    }
+    uint64_t held = 0;
+    lock_more(&held, stripe_of(hdr));
+    unsigned r = stripe_of(next);
+    lock_more(&held, r);
+    stripe_t *s = &g_stripes[r];
+    bool grown = false;
+    if (!is_block(next)) {
+        size_t room = s->end - (uint8_t *)hdr;
+        if (room >= asize) {
+            size_t size = keep < room ? keep : room;
+            __atomic_store_n(&s->top, (uint8_t *)hdr + size, __ATOMIC_RELAXED);
+            hdr_store(hdr, size | (hdr_load(hdr) & FLAG_MASK));
+            grown = true;
+        }
+    } else if (!blk_alloc(next) && cur + blk_size(next) >= asize) {
+        size_t nsize = blk_size(next);
+        list_remove(s, next);
+        take_block(hdr, cur + nsize, keep < cur + nsize ? keep : cur + nsize, &held);
+        grown = true;
+    }
+    unlock_stripes(held);
+    return grown;
+}
+
+// Header of the allocated block with payload ptr, or NULL if ptr is not one
+static void *checked_header(void *ptr) {
+    uint8_t *hdr = (uint8_t *)ptr - HDR_SIZE;
+    if (g_base == NULL || hdr < g_base || hdr >= g_end ||
+        (uintptr_t)ptr % ALIGNMENT != 0 || hdr >= stripe_top(&g_stripes[stripe_of(hdr)])) {
+        return NULL;
+    }
+    size_t size = blk_size(hdr);
+    if (!blk_alloc(hdr) || size < MIN_BLOCK || size > (size_t)(g_end - hdr)) {
+        return NULL;
+    }
+    return hdr;
+}
+
+
+// Asynchronous frees
+
+static int compare_addresses(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) * (void *const *)a;
+    uintptr_t y = (uintptr_t) * (void *const *)b;
+    return x < y ? -1 : x > y;
+}
+
+// True if some ring holds a pointer the drain thread has not taken
+static bool rings_pending(void) {
+    unsigned n = __atomic_load_n(&g_rings_used, __ATOMIC_SEQ_CST);
+    for (unsigned i = 0; i < n && i < MAX_RINGS; i++) {
+        ring_t *ring = __atomic_load_n(&g_rings[i], __ATOMIC_ACQUIRE);
+        if (ring != NULL && __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != ring->head) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Moves up to max pointers from the rings into batch; returns how many
+static size_t rings_take(void **batch, size_t max) {
+    size_t n = 0;
+    unsigned nrings = __atomic_load_n(&g_rings_used, __ATOMIC_ACQUIRE);
+    for (unsigned i = 0; i < nrings && i < MAX_RINGS && n < max; i++) {
+        ring_t *ring = __atomic_load_n(&g_rings[i], __ATOMIC_ACQUIRE);
+        if (ring == NULL) {
+            continue;
+        }
+        size_t head = ring->head;
+        size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        while (head != tail && n < max) {
+            batch[n++] = ring->slots[head++ % RING_SLOTS];
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+// Frees a batch in address order, each run of adjacent blocks as one block.
+// The blocks are not checked again: one queued twice across batches may be
+// free or reused by now, and its header proves nothing either way.
+static void sweep(void **batch, size_t n) {
+    qsort(batch, n, sizeof(void *), compare_addresses);
+    size_t runs = 0;
+    size_t freed = 0;
+    for (size_t i = 0; i < n;) {
+        uint8_t *hdr = (uint8_t *)batch[i] - HDR_SIZE;
+        size_t size = blk_size(hdr);
+        for (i++; i < n && (uint8_t *)batch[i] - HDR_SIZE <= hdr + size; i++) {
+            // a pointer passed twice in one batch is freed once
+            if ((uint8_t *)batch[i] - HDR_SIZE == hdr + size) {
+                size += blk_size((uint8_t *)batch[i] - HDR_SIZE);
+                freed++;
+            }
+        }
+        free_range(hdr, size);
+        freed++;
+        runs++;
+    }
+    __atomic_fetch_add(&g_async_frees, freed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_async_runs, runs, __ATOMIC_RELAXED);
+}
+
+static void *drain_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        size_t n = rings_take(g_drain_batch, DRAIN_BATCH);
+        if (n > 0) {
+            sweep(g_drain_batch, n);
+            continue;
+        }
+        pthread_mutex_lock(&g_drain_lock);
+        __atomic_store_n(&g_drain_sleeping, true, __ATOMIC_SEQ_CST);
+        while (!rings_pending()) {
+            g_drain_idle = true;
+            pthread_cond_broadcast(&g_drain_done);
+            pthread_cond_wait(&g_drain_wake, &g_drain_lock);
+        }
+        g_drain_idle = false;
+        __atomic_store_n(&g_drain_sleeping, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&g_drain_lock);
+    }
+    return NULL;
+}
+
+static void drain_wake(void) {
+    pthread_mutex_lock(&g_drain_lock);
+    pthread_cond_signal(&g_drain_wake);
+    pthread_mutex_unlock(&g_drain_lock);
+}
+
+// The calling thread's ring, claimed on first use after each myinit, with
+// the drain thread started if it is not yet running; NULL if no ring can
+// be had
+static ring_t *thread_ring(void) {
+    if (t_ring_generation == g_generation) {
+        return t_ring;
+    }
+    t_ring_generation = g_generation;
+    t_ring = NULL;
+    pthread_mutex_lock(&g_drain_lock);
+    if (!g_drain_started) {
+        pthread_t thread;
+        g_drain_started = pthread_create(&thread, NULL, drain_main, NULL) == 0;
+        if (g_drain_started) {
+            pthread_detach(thread);
+        }
+    }
+    bool started = g_drain_started;
+    pthread_mutex_unlock(&g_drain_lock);
+    unsigned i = started ? __atomic_fetch_add(&g_rings_used, 1, __ATOMIC_RELAXED) : MAX_RINGS;
+    // the ring is aligned by hand and never freed; myinit drops it with the heap
+    uint8_t *raw = i < MAX_RINGS ? mymalloc(sizeof(ring_t) + CACHE_LINE_SIZE) : NULL;
+    if (raw == NULL) {
+        return NULL;
+    }
+    ring_t *ring = (ring_t *)(((uintptr_t)raw + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+    ring->head = ring->tail = 0;
+    __atomic_store_n(&g_rings[i], ring, __ATOMIC_RELEASE);
+    t_ring = ring;
+    return ring;
+}
+
+/* Function: myconfig
+ * ------------------
+ * Accepts "stripes=<n>", the number of address stripes, from 1 to 64 (8 by
+ * default), and "stripe_size=<bytes>", the size of every stripe but the
+ * last, which takes the rest of the heap (0, the default, splits the heap
+ * evenly). Small stripes make tests spill and merge across boundaries.
+ * myinit uses fewer stripes on a heap too small to hold them all.
+ * "async_full=sync|wait" picks what myfree_async does when the calling
+ * thread's ring is full: free the block at once (the default), or wait for
+ * the drain thread to make room.
+ */
+bool myconfig(const char *key, const char *value) {
+    if (strcmp(key, "async_full") == 0) {
+        if (strcmp(value, "sync") != 0 && strcmp(value, "wait") != 0) {
+            return false;
+        }
+        g_full_policy = strcmp(value, "sync") == 0 ? FULL_SYNC : FULL_WAIT;
+        return true;
+    }
+    char *end;
+    unsigned long n = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0') {
+        return false;
+    }
+    if (strcmp(key, "stripes") == 0 && n >= 1 && n <= MAX_STRIPES) {
+        g_stripes_option = n;
+        return true;
+    }
+    if (strcmp(key, "stripe_size") == 0 && (n == 0 || n >= MIN_STRIPE_OPTION)) {
+        g_stripe_size_option = align_up(n);
+        return true;
+    }
+    return false;
+}
+
+bool myinit(void *heap_start, size_t heap_size) {
+    // the rings live in the old heap: empty them first
+    myfree_flush();
+    g_base = NULL;
+    g_end = NULL;
+    if (heap_start == NULL || (uintptr_t)heap_start % ALIGNMENT != 0 ||
+        heap_size < HDR_PAD + MIN_BLOCK) {
+        return false;
+    }
+    size_t usable = (heap_size - HDR_PAD) & ~(size_t)(ALIGNMENT - 1);
+    g_nstripes = g_stripes_option;
+    if (g_stripe_size_option != 0) {
+        g_stripe_size = g_stripe_size_option;
+        while (g_nstripes > 1 && (g_nstripes - 1) * g_stripe_size + MIN_BLOCK > usable) {
+            g_nstripes--;
+        }
+    } else {
+        while (g_nstripes > 1 && usable / g_nstripes < MIN_STRIPE_SIZE) {
+            g_nstripes--;
+        }
+        g_stripe_size = (usable / g_nstripes) & ~(size_t)(ALIGNMENT - 1);
+    }
+    g_base = (uint8_t *)heap_start + HDR_PAD;
+    g_end = g_base + usable;
+    for (unsigned i = 0; i < g_nstripes; i++) {
+        stripe_t *s = &g_stripes[i];
+        *s = (stripe_t){.lock = LOCK_INITIALIZER};
+        s->start = g_base + i * g_stripe_size;
+        s->end = i + 1 < g_nstripes ? s->start + g_stripe_size : g_end;
+        s->top = s->start;
+    }
+    g_cross_merges = g_away_allocs = 0;
+    g_async_frees = g_async_runs = g_async_full = 0;
+    pthread_mutex_lock(&g_drain_lock);
+    memset(g_rings, 0, sizeof(g_rings));
+    g_rings_used = 0;
+    pthread_mutex_unlock(&g_drain_lock);
+    // the first thread to allocate gets stripe 0, at the bottom of the heap
+    g_next_home = 0;
+    g_generation++;
+    return true;
+}
+
+// Allocates requested_size bytes, home stripe first, with flags set in the
+// block's header
+static void *malloc_with(size_t requested_size, size_t flags) {
+    if (requested_size == 0 || requested_size > MAX_REQUEST_SIZE || g_base == NULL) {
+        return NULL;
+    }
+    size_t asize = request_to_asize(requested_size);
+    unsigned home = home_stripe();
+    for (unsigned n = 0; n < g_nstripes; n++) {
+        void *hdr = stripe_alloc((home + n) % g_nstripes, asize, flags);
+        if (hdr != NULL) {
+            if (n > 0) {
+                __atomic_fetch_add(&g_away_allocs, 1, __ATOMIC_RELAXED);
+            }
+            return (uint8_t *)hdr + HDR_SIZE;
+        }
+    }
+    return NULL;
+}
+
+/* Function: mymalloc
+ * ------------------
+ * Allocates in the thread's home stripe, and only if it has no room in the
+ * other stripes in turn.
+ */
+void *mymalloc(size_t requested_size) {
+    return malloc_with(requested_size, 0);
+}
+
+// Allocation step of mymalloc_flags: realloc-heavy blocks are flagged to
+// keep their slack through myrealloc
+static void *malloc_hinted(size_t size, unsigned flags) {
+    return malloc_with(size, (flags & MALLOC_REALLOC_HEAVY) ? FLAG_REALLOC : 0);
+}
+
+/* Function: mymalloc_flags
+ * ------------------------
+ * Realloc-heavy blocks reserve slack and zeroed blocks are cleared up to
+ * the request; the other flags are ignored.
+ */
+void *mymalloc_flags(size_t requested_size, unsigned flags) {
+    return malloc_flagged(malloc_hinted, requested_size, flags);
+}
+
+/* Function: myfree
+ * ----------------
+ * Frees the block and merges it with its free neighbours at once, across
+ * stripe boundaries too. Pointers that are not allocated blocks are
+ * ignored.
+ */
+void myfree(void *ptr) {
+    void *hdr = ptr == NULL ? NULL : checked_header(ptr);
+    if (hdr != NULL) {
+        free_block(hdr);
+    }
+}
+
+void myfree_async(void *ptr) {
+    if (ptr == NULL || checked_header(ptr) == NULL) {
+        return;
+    }
+    ring_t *ring = thread_ring();
+    if (ring == NULL) {
+        myfree(ptr);
+        return;
+    }
+    size_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SLOTS) {
+        __atomic_fetch_add(&g_async_full, 1, __ATOMIC_RELAXED);
+        if (g_full_policy == FULL_SYNC) {
+            myfree(ptr);
+            return;
+        }
+        while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SLOTS) {
+            drain_wake();
+            sched_yield();
+        }
+    }
+    ring->slots[tail % RING_SLOTS] = ptr;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g_drain_sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&g_drain_sleeping, false, __ATOMIC_SEQ_CST)) {
+        drain_wake();
+    }
+}
+
+void myfree_flush(void) {
+    pthread_mutex_lock(&g_drain_lock);
+    while (g_drain_started && (!g_drain_idle || rings_pending())) {
+        pthread_cond_signal(&g_drain_wake);
+        pthread_cond_wait(&g_drain_done, &g_drain_lock);
+    }
+    pthread_mutex_unlock(&g_drain_lock);
+}
+
+/* Function: myrealloc
+ * -------------------
+ * Stays in place when the block is already big enough or can grow into a
+ * free neighbour or never-used space, and otherwise moves the block with
+ * malloc/copy/free.
+ */
+void *myrealloc(void *old_ptr, size_t new_size) {
+    if (old_ptr == NULL) {
+        return mymalloc(new_size);
+    }
+    if (new_size == 0) {
+        myfree(old_ptr);
+        return NULL;
+    }
+    void *hdr = checked_header(old_ptr);
+    if (hdr == NULL || new_size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+    // a realloc-heavy block grows into its slack where there is room, and
+    // reserves it again when it has to move
+    bool heavy = (hdr_load(hdr) & FLAG_REALLOC) != 0;
+    size_t asize = request_to_asize(new_size);
+    size_t keep = heavy ? request_to_asize(realloc_reserve(new_size)) : asize;
+    size_t cur = blk_size(hdr);
+    if (asize <= cur || grow_in_place(hdr, asize, keep)) {
+        return old_ptr;
+    }
+    void *new_ptr = heavy ? mymalloc_flags(new_size, MALLOC_REALLOC_HEAVY) : mymalloc(new_size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, old_ptr, cur - HDR_SIZE);
+    myfree(old_ptr);
+    return new_ptr;
+}
+
+size_t myusable_size(void *ptr) {
+    void *hdr = ptr == NULL ? NULL : checked_header(ptr);
+    return hdr == NULL ? 0 : blk_size(hdr) - HDR_SIZE;
+}
+
+/* Function: mystats
+ * -----------------
+ * Reports the stripe locks' counters summed over all stripes, the longest
+ * any stripe lock was held, how many merges crossed a stripe boundary and
+ * how many allocations left the home stripe; then how many blocks the drain
+ * thread freed, in how many runs, and how often a ring was full.
+ */
+size_t mystats(stat_t stats[], size_t max) {
+    unsigned long acquisitions = 0, contended = 0, sleeps = 0;
+    uint64_t max_hold = 0;
+    for (unsigned i = 0; i < g_nstripes; i++) {
+        const lock_t *lock = &g_stripes[i].lock;
+        acquisitions += lock->acquisitions;
+        contended += lock->contended;
+        sleeps += lock->sleeps;
+        max_hold = lock->max_hold_cycles > max_hold ? lock->max_hold_cycles : max_hold;
+    }
+    stat_t all[] = {
+        {"lock_acquisitions", acquisitions},
+        {"lock_contended", contended},
+        {"lock_sleeps", sleeps},
+        {"lock_max_hold_cycles", max_hold},
+        {"cross_stripe_merges", g_cross_merges},
+        {"away_allocs", g_away_allocs},
+        {"async_frees", g_async_frees},
+        {"async_runs", g_async_runs},
+        {"async_ring_full", g_async_full},
+    };
+    size_t n = sizeof(all) / sizeof(all[0]) < max ? sizeof(all) / sizeof(all[0]) : max;
+    memcpy(stats, all, n * sizeof(stat_t));
+    return n;
+}
+
+// Counts and checks the free list l of stripe i, adding its length to *count
+static bool validate_list(unsigned i, unsigned l, size_t *count) {
+    void *prev = NULL;
+    for (void *b = g_stripes[i].lists[l]; b != NULL; b = *link_next(b)) {
+        if (stripe_of(b) != i || blk_alloc(b) || list_index(blk_size(b)) != l ||
+            *link_prev(b) != prev) {
+            printf("stripe %u list %u: bad free block %p\n", i, l, b);
+            breakpoint();
+            return false;
+        }
+        prev = b;
+        (*count)++;
+    }
+    return true;
+}
+
+/* Function: validate_heap
+ * -----------------------
+ * Walks every stripe's blocks in address order, checking sizes, footers,
+ * FLAG_PREV_FREE and each top's flag against their left neighbours, that
+ * no two free blocks touch, and that the free lists hold exactly the free
+ * blocks. Only call it while no other thread uses the allocator.
+ */
+bool validate_heap() {
+    if (g_base == NULL) {
+        return false;
+    }
+    size_t nfree = 0;
+    bool prev_free = false;
+    uint8_t *p = g_base;
+    while (p < g_end) {
+        stripe_t *s = &g_stripes[stripe_of(p)];
+        if (p >= s->top) {
+            // never-used space: skip to the next stripe
+            if (p != s->top || s->top_prev_free != prev_free) {
+                printf("stripe %u: top %p does not follow the blocks\n", stripe_of(p), s->top);
+                breakpoint();
+                return false;
+            }
+            p = s->end;
+            prev_free = false;
+            continue;
+        }
+        size_t size = blk_size(p);
+        if (size < MIN_BLOCK || size % ALIGNMENT != 0 || size > (size_t)(g_end - p) ||
+            blk_prev_free(p) != prev_free) {
+            printf("block %p: bad size %zu or flags\n", p, size);
+            breakpoint();
+            return false;
+        }
+        if (!blk_alloc(p)) {
+            if (prev_free || hdr_load(p + size - sizeof(size_t)) != size) {
+                printf("free block %p: %s\n", p, prev_free ? "not coalesced" : "bad footer");
+                breakpoint();
+                return false;
+            }
+            nfree++;
+        }
+        prev_free = !blk_alloc(p);
+        p += size;
+    }
+    size_t listed = 0;
+    for (unsigned i = 0; i < g_nstripes; i++) {
+        for (unsigned l = 0; l < NUM_LISTS; l++) {
+            if (!validate_list(i, l, &listed)) {
+                return false;
+            }
+        }
+    }
+    if (listed != nfree) {
+        printf("%zu free blocks but %zu listed\n", nfree, listed);
+        breakpoint();
+        return false;
+    }
+    return true;
+}
+
+/* Function: dump_heap
+ * -------------------
+ * This function is not called anywhere, but is useful from gdb. It prints
+ * each stripe's range and top, and every block.
+ */
+void dump_heap(void) {
+    for (unsigned i = 0; i < g_nstripes; i++) {
+        stripe_t *s = &g_stripes[i];
+        printf("stripe %u: %p-%p top %p%s\n", i, s->start, s->end, s->top,
+               s->top_prev_free ? " (after a free block)" : "");
+    }
+    uint8_t *p = g_base;
+    while (p < g_end) {
+        stripe_t *s = &g_stripes[stripe_of(p)];
+        if (p >= s->top) {
+            p = s->end;
+            continue;
+        }
+        printf("%p size=%zu %s%s\n", p, blk_size(p), blk_alloc(p) ? "ALLOC" : "FREE",
+               blk_prev_free(p) ? " prev-free" : "");
+        p += blk_size(p);
+    }
+}
@@ -14,12 +14,18 @@
 
 #include <error.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <linux/perf_event.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 #include "allocator.h"
 #include "segment.h"
 
@@ -47,6 +53,10 @@ typedef struct
     size_t size;
 } block_t;
 
+// Call latencies are counted in buckets of 8 per power of two, enough for a
+// percentile within an eighth of its value
+#define CYCLE_BUCKETS (64 * 8)
+
 // struct for info for one script file
 typedef struct
 {
@@ -56,8 +66,37 @@ typedef struct
     int num_ids;      // number of distinct block ids
     block_t *blocks;  // array of memory blocks malloc returns when executing
     size_t peak_size; // total payload bytes at peak in-use
+    uint64_t op_ns;   // nanoseconds spent inside allocator calls
+    uint64_t worst_cycles[REALLOC + 1]; // slowest single call per request type
+    uint64_t cycle_counts[REALLOC + 1][CYCLE_BUCKETS]; // calls per request type by cycle bucket
+    unsigned malloc_flags; // flags for mymalloc_flags (-F), or 0 to call mymalloc
+    int hot_blocks;        // blocks allocated with MALLOC_HOT
+    int hot_aligned;       // of those, the ones starting on a cache line
+    bool perf;             // count cache and TLB misses and sample hugepage coverage (-P)
+    long long tlb_misses;  // data TLB load misses during the run, or -1 if unavailable
+    long long l1d_misses;  // L1 data cache load misses during the run, or -1
+    long long llc_misses;  // last-level cache load misses during the run, or -1
+    size_t peak_rss;       // resident bytes of the heap segment near peak payload
+    size_t peak_huge;      // of those, the bytes backed by transparent hugepages
 } script_t;
 
+// Most allocator options (-c) and sweep values (-s) accepted on the command line
+#define MAX_SETTINGS 16
+
+// struct for allocator options passed through myconfig before each myinit
+typedef struct
+{
+    char *settings[MAX_SETTINGS];     // fixed "key=value" options (-c)
+    int num_settings;
+    char *sweep_key;                  // option swept across values (-s), or NULL
+    char *sweep_values[MAX_SETTINGS]; // values tried for sweep_key
+    int num_sweep_values;
+    unsigned malloc_flags;            // MALLOC_* flags for every malloc (-F)
+} options_t;
+
+// With -P, hugepage coverage is sampled on a new payload peak at most this often
+#define COVERAGE_SAMPLE_OPS 1024
+
 // Amount by which we resize ops when needed when reading in from file
 const int OPS_RESIZE_AMOUNT = 500;
 
@@ -67,11 +106,31 @@ const long HEAP_SIZE = 1L << 32;
 
 /* FUNCTION PROTOTYPES */
 
-static int test_scripts(char *script_names[], int num_script_names, bool quiet);
+static int test_scripts(char *script_names[], int num_script_names, bool quiet,
+                        bool timed, bool latency, bool perf, options_t *options);
+static uint64_t now_ns(void);
+static uint64_t now_cycles(void);
+static void record_call(script_t *script, enum request_type op, uint64_t start_ns,
+                        uint64_t start_cycles);
+static int cycle_bucket(uint64_t cycles);
+static uint64_t cycle_percentile(const uint64_t counts[CYCLE_BUCKETS], uint64_t worst,
+                                 double fraction);
+static void print_percentiles(const char *label, uint64_t counts[][CYCLE_BUCKETS],
+                              const uint64_t worst[]);
+static int open_miss_counter(unsigned cache);
+static long long close_counter(int fd);
+static void print_count(const char *label, long long count);
+static bool hugepage_coverage(size_t *rss, size_t *huge);
+static void parse_setting(char *arg, options_t *options);
+static void parse_sweep(char *arg, options_t *options);
+static unsigned parse_flags(char *arg);
+static bool apply_settings(options_t *options, int sweep_index, script_t *script);
 static bool read_line(char buffer[], size_t buffer_size, FILE *fp, int *pnread);
 static script_t parse_script(const char *filename);
 static request_t parse_script_line(char *buffer, int lineno, char *script_name);
-static size_t eval_correctness(script_t *script, bool quiet, bool *success);
+static size_t eval_correctness(script_t *script, bool quiet, options_t *options,
+                               int sweep_index, bool fresh_segment, bool *success);
+static void note_extent(void *ptr, size_t size, void **heap_end, void **heap_top);
 static void *eval_malloc(int req, size_t requested_size, script_t *script, bool *failptr);
 static void *eval_realloc(int req, size_t requested_size, script_t *script, bool *failptr);
 static bool verify_block(void *ptr, size_t size, script_t *script, int lineno);
@@ -82,22 +141,57 @@ static void allocator_error(script_t *script, int lineno, char *format, ...);
 
 /* Function: main
  * --------------
- * The main function parses command-line arguments (currently only -q for quiet)
- * and any script files that follow and runs the heap allocator on the specified
- * script files.  It outputs statistics about the run of each script, such as
- * the number of successful runs, number of failures, and average utilization.
+ * The main function parses command-line arguments (-q for quiet, -t to report
+ * time per request, -l to report worst-case cycles per call, -c key=value
+ * to set an allocator option, -s key=v1,v2,... to run every script once per
+ * option value, -F flag,flag,... to make every malloc a mymalloc_flags call
+ * with those flags, -P to report data TLB misses and the hugepage coverage
+ * of the heap at peak) and any script files that follow and runs the heap allocator
+ * on the specified script files.  It outputs statistics about the run of each
+ * script, such as the number of successful runs, number of failures, and
+ * average utilization.  A sweep also reports how fragmentation changed from
+ * the first value to each of the others.
  */
 int main(int argc, char *argv[])
 {
     // Parse command line arguments
     char c;
     bool quiet = false;
-    while ((c = getopt(argc, argv, "q")) != EOF)
+    bool timed = false;
+    bool latency = false;
+    bool perf = false;
+    options_t options = {.num_settings = 0, .sweep_key = NULL, .num_sweep_values = 0,
+                         .malloc_flags = 0};
+    while ((c = getopt(argc, argv, "qtlPc:s:F:")) != EOF)
     {
         if (c == 'q')
         {
             quiet = true;
         }
+        else if (c == 't')
+        {
+            timed = true;
+        }
+        else if (c == 'l')
+        {
+            latency = true;
+        }
+        else if (c == 'P')
+        {
+            perf = true;
+        }
+        else if (c == 'c')
+        {
+            parse_setting(optarg, &options);
+        }
+        else if (c == 's')
+        {
+            parse_sweep(optarg, &options);
+        }
+        else if (c == 'F')
+        {
+            options.malloc_flags = parse_flags(optarg);
+        }
     }
     if (optind >= argc)
     {
@@ -107,53 +201,277 @@ int main(int argc, char *argv[])
     // disable stdout buffering, all printfs display to terminal immediately
     setvbuf(stdout, NULL, _IONBF, 0);
 
-    return test_scripts(argv + optind, argc - optind, quiet);
+    return test_scripts(argv + optind, argc - optind, quiet, timed, latency, perf,
+                        &options);
+}
+
+/* Function: parse_setting
+ * -----------------------
+ * Records a "key=value" allocator option given with -c.  Throws an error
+ * if the option is malformed or there are too many of them.
+ */
+static void parse_setting(char *arg, options_t *options)
+{
+    if (strchr(arg, '=') == NULL || arg[0] == '=')
+    {
+        error(1, 0, "Option \"%s\" is not of the form key=value.", arg);
+    }
+    if (options->num_settings == MAX_SETTINGS)
+    {
+        error(1, 0, "Too many -c options (at most %d).", MAX_SETTINGS);
+    }
+    options->settings[options->num_settings++] = arg;
+}
+
+/* Function: parse_sweep
+ * ---------------------
+ * Records the "key=v1,v2,..." option given with -s.  Each script is run
+ * once per listed value.  Throws an error if the sweep is malformed.
+ */
+static void parse_sweep(char *arg, options_t *options)
+{
+    char *eq = strchr(arg, '=');
+    if (eq == NULL || eq == arg || options->sweep_key != NULL)
+    {
+        error(1, 0, "Sweep \"%s\" is not a single key=v1,v2,... list.", arg);
+    }
+    *eq = '\0';
+    options->sweep_key = arg;
+    for (char *value = strtok(eq + 1, ","); value != NULL; value = strtok(NULL, ","))
+    {
+        if (options->num_sweep_values == MAX_SETTINGS)
+        {
+            error(1, 0, "Too many sweep values (at most %d).", MAX_SETTINGS);
+        }
+        options->sweep_values[options->num_sweep_values++] = value;
+    }
+    if (options->num_sweep_values == 0)
+    {
+        error(1, 0, "Sweep for \"%s\" lists no values.", arg);
+    }
+}
+
+/* Function: parse_flags
+ * ---------------------
+ * Turns the comma-separated flag names given with -F (short, long, realloc,
+ * hot, zero) into MALLOC_* flags.  Throws an error on an unknown name.
+ */
+static unsigned parse_flags(char *arg)
+{
+    static const char *const names[] = {"short", "long", "realloc", "hot", "zero"};
+    static const unsigned values[] = {MALLOC_SHORT_LIVED, MALLOC_LONG_LIVED,
+                                      MALLOC_REALLOC_HEAVY, MALLOC_HOT, MALLOC_ZERO};
+    unsigned flags = 0;
+    for (char *name = strtok(arg, ","); name != NULL; name = strtok(NULL, ","))
+    {
+        size_t i = 0;
+        while (i < sizeof(names) / sizeof(names[0]) && strcmp(name, names[i]) != 0)
+        {
+            i++;
+        }
+        if (i == sizeof(names) / sizeof(names[0]))
+        {
+            error(1, 0, "Unknown malloc flag \"%s\" (expected short, long, realloc, hot, zero).",
+                  name);
+        }
+        flags |= values[i];
+    }
+    return flags;
+}
+
+/* Function: apply_settings
+ * ------------------------
+ * Passes every -c option, plus the sweep value at sweep_index if sweeping,
+ * to the allocator through myconfig.  Reports an allocator error and
+ * returns false if the allocator rejects any of them.
+ */
+static bool apply_settings(options_t *options, int sweep_index, script_t *script)
+{
+    char key[MAX_SCRIPT_LINE_LEN];
+    for (int i = 0; i < options->num_settings; i++)
+    {
+        const char *eq = strchr(options->settings[i], '=');
+        snprintf(key, sizeof(key), "%.*s", (int)(eq - options->settings[i]),
+                 options->settings[i]);
+        if (!myconfig(key, eq + 1))
+        {
+            allocator_error(script, 0, "myconfig() rejected option %s",
+                            options->settings[i]);
+            return false;
+        }
+    }
+    if (options->sweep_key != NULL &&
+        !myconfig(options->sweep_key, options->sweep_values[sweep_index]))
+    {
+        allocator_error(script, 0, "myconfig() rejected option %s=%s",
+                        options->sweep_key, options->sweep_values[sweep_index]);
+        return false;
+    }
+    return true;
 }
 
 /* Function: test_scripts
  * ----------------------
  * Runs the scripts with names in the specified array, with more or less output
- * depending on the value of `quiet`.  Returns the number of failures during all
- * the tests.
+ * depending on the value of `quiet`.  When sweeping an option, each script is
+ * run once per sweep value and utilization is averaged per value.  If `timed`,
+ * the average time spent per allocator call is reported too.  If `latency`,
+ * each script is replayed a second time on the same segment, so the pages
+ * the first replay touched are already faulted in, and the second replay's
+ * most cycles and 99.9th percentile of cycles for malloc, realloc and free
+ * are reported per script and over all scripts.  If `perf`, each script reports
+ * its L1 data cache, last-level cache and data TLB load misses, and how much
+ * of the heap's resident memory was backed by hugepages at peak.  Returns
+ * the number of failures during all the tests.
  */
-static int test_scripts(char *script_names[], int num_script_names, bool quiet)
+static int test_scripts(char *script_names[], int num_script_names, bool quiet,
+                        bool timed, bool latency, bool perf, options_t *options)
 {
-    int nsuccesses = 0;
+    int num_runs = (options->sweep_key != NULL) ? options->num_sweep_values : 1;
+    int nsuccesses[MAX_SETTINGS] = {0};
     int nfailures = 0;
 
     // Utilization summed across all successful script runs (each is % out of 100)
-    int total_util = 0;
+    int total_util[MAX_SETTINGS] = {0};
+
+    // Slowest call of each request type across all successful script runs,
+    // and the calls of each type by cycle bucket
+    uint64_t worst_cycles[MAX_SETTINGS][REALLOC + 1] = {{0}};
+    static uint64_t cycle_counts[MAX_SETTINGS][REALLOC + 1][CYCLE_BUCKETS];
+
+    // Blocks allocated with MALLOC_HOT, and how many of them were aligned
+    int hot_blocks = 0;
+    int hot_aligned = 0;
 
     for (int i = 0; i < num_script_names; i++)
     {
-        script_t script = parse_script(script_names[i]);
+        for (int run = 0; run < num_runs; run++)
+        {
+            script_t script = parse_script(script_names[i]);
+            script.malloc_flags = options->malloc_flags;
+            script.perf = perf;
+
+            // Evaluate this script and record the results
+            if (options->sweep_key != NULL)
+            {
+                printf("\nEvaluating allocator on %s [%s=%s]...", script.name,
+                       options->sweep_key, options->sweep_values[run]);
+            }
+            else
+            {
+                printf("\nEvaluating allocator on %s...", script.name);
+            }
+            bool success;
+            size_t used_segment = eval_correctness(&script, quiet, options, run, true, &success);
+            if (success && latency)
+            {
+                // Keep only the second replay's timings: in the first, page
+                // faults on the fresh segment dominate the slowest calls
+                memset(script.blocks, 0, script.num_ids * sizeof(block_t));
+                memset(script.worst_cycles, 0, sizeof(script.worst_cycles));
+                memset(script.cycle_counts, 0, sizeof(script.cycle_counts));
+                script.op_ns = 0;
+                script.peak_size = 0;
+                script.hot_blocks = 0;
+                script.hot_aligned = 0;
+                used_segment = eval_correctness(&script, quiet, options, run, false, &success);
+            }
+            if (success)
+            {
+                printf("successfully serviced %d requests. (payload/segment = %zu/%zu)",
+                       script.num_ops, script.peak_size, used_segment);
+                if (timed && script.num_ops > 0)
+                {
+                    printf(" %.1f ns/op", (double)script.op_ns / script.num_ops);
+                }
+                if (latency)
+                {
+                    printf(" worst cycles malloc/realloc/free = %" PRIu64 "/%" PRIu64 "/%" PRIu64,
+                           script.worst_cycles[ALLOC], script.worst_cycles[REALLOC],
+                           script.worst_cycles[FREE]);
+                    print_percentiles(", p99.9 = ", script.cycle_counts, script.worst_cycles);
+                }
+                if (perf)
+                {
+                    print_count(" L1d misses", script.l1d_misses);
+                    print_count(", LLC misses", script.llc_misses);
+                    print_count(", dTLB misses", script.tlb_misses);
+                    if (script.peak_rss > 0)
+                    {
+                        printf(", hugepage coverage at peak = %zu%% of %zu KiB",
+                               100 * script.peak_huge / script.peak_rss, script.peak_rss >> 10);
+                    }
+                }
+                for (int op = ALLOC; op <= REALLOC; op++)
+                {
+                    if (script.worst_cycles[op] > worst_cycles[run][op])
+                    {
+                        worst_cycles[run][op] = script.worst_cycles[op];
+                    }
+                    for (int b = 0; b < CYCLE_BUCKETS; b++)
+                    {
+                        cycle_counts[run][op][b] += script.cycle_counts[op][b];
+                    }
+                }
+                if (used_segment > 0)
+                {
+                    total_util[run] += (100 * script.peak_size) / used_segment;
+                }
+                hot_blocks += script.hot_blocks;
+                hot_aligned += script.hot_aligned;
+                nsuccesses[run]++;
+            }
+            else
+            {
+                nfailures++;
+            }
+
+            free(script.ops);
+            free(script.blocks);
+        }
+    }
 
-        // Evaluate this script and record the results
-        printf("\nEvaluating allocator on %s...", script.name);
-        bool success;
-        size_t used_segment = eval_correctness(&script, quiet, &success);
-        if (success)
+    if (nfailures < num_runs * num_script_names)
+    {
+        printf("\n");
+    }
+    if (hot_blocks > 0)
+    {
+        printf("Hot blocks on a cache line: %d of %d\n", hot_aligned, hot_blocks);
+    }
+    for (int run = 0; run < num_runs; run++)
+    {
+        if (!nsuccesses[run])
         {
-            printf("successfully serviced %d requests. (payload/segment = %zu/%zu)",
-                   script.num_ops, script.peak_size, used_segment);
-            if (used_segment > 0)
+            continue;
+        }
+        if (latency)
+        {
+            printf("Worst-case cycles malloc/realloc/free = %" PRIu64 "/%" PRIu64 "/%" PRIu64 "\n",
+                   worst_cycles[run][ALLOC], worst_cycles[run][REALLOC],
+                   worst_cycles[run][FREE]);
+            print_percentiles("99.9th percentile cycles malloc/realloc/free = ",
+                              cycle_counts[run], worst_cycles[run]);
+            printf("\n");
+        }
+        if (options->sweep_key != NULL)
+        {
+            printf("Utilization averaged %d%% [%s=%s]\n", total_util[run] / nsuccesses[run],
+                   options->sweep_key, options->sweep_values[run]);
+            if (run > 0 && nsuccesses[0])
             {
-                total_util += (100 * script.peak_size) / used_segment;
+                // fragmentation is the part of the used segment holding no payload
+                int base_frag = 100 - total_util[0] / nsuccesses[0];
+                int frag = 100 - total_util[run] / nsuccesses[run];
+                printf("Fragmentation %d%% -> %d%% (%+d points) [%s=%s -> %s]\n", base_frag,
+                       frag, frag - base_frag, options->sweep_key, options->sweep_values[0],
+                       options->sweep_values[run]);
             }
-            nsuccesses++;
         }
         else
         {
-            nfailures++;
+            printf("Utilization averaged %d%%\n", total_util[run] / nsuccesses[run]);
         }
-
-        free(script.ops);
-        free(script.blocks);
-    }
-
-    if (nsuccesses)
-    {
-        printf("\nUtilization averaged %d%%\n", total_util / nsuccesses);
     }
     return nfailures;
 }
@@ -163,13 +481,25 @@ static int test_scripts(char *script_names[], int num_script_names, bool quiet)
  * Check the allocator for correctness on given script. Interprets the
  * script operation-by-operation and reports if it detects any "obvious"
  * errors (returning blocks outside the heap, unaligned,
- * overlapping blocks, etc.)
+ * overlapping blocks, etc.)  In perf mode it also counts cache and TLB
+ * misses over the run, including the harness's own writes and checks of
+ * payloads, and samples hugepage coverage whenever the payload reaches a
+ * new peak.  Unless fresh_segment, it reuses the segment of the previous
+ * run, whose pages that run already faulted in.
  */
-static size_t eval_correctness(script_t *script, bool quiet, bool *success)
+static size_t eval_correctness(script_t *script, bool quiet, options_t *options,
+                               int sweep_index, bool fresh_segment, bool *success)
 {
     *success = false;
 
-    init_heap_segment(HEAP_SIZE);
+    if (fresh_segment || heap_segment_start() == NULL)
+    {
+        init_heap_segment(HEAP_SIZE);
+    }
+    if (!apply_settings(options, sweep_index, script))
+    {
+        return -1;
+    }
     if (!myinit(heap_segment_start(), heap_segment_size()))
     {
         allocator_error(script, 0, "myinit() returned false");
@@ -182,12 +512,20 @@ static size_t eval_correctness(script_t *script, bool quiet, bool *success)
         return -1;
     }
 
-    // Track the topmost address used by the heap for utilization purposes
+    // Track the topmost address used by the heap for utilization purposes.
+    // An allocator may also grow down from the top of the segment, so
+    // blocks in the upper half count toward the lowest address used there.
     void *heap_end = heap_segment_start();
+    void *heap_top = (char *)heap_segment_start() + heap_segment_size();
 
     // Track the current amount of memory allocated on the heap
     size_t cur_size = 0;
 
+    int l1d_fd = script->perf ? open_miss_counter(PERF_COUNT_HW_CACHE_L1D) : -1;
+    int llc_fd = script->perf ? open_miss_counter(PERF_COUNT_HW_CACHE_LL) : -1;
+    int tlb_fd = script->perf ? open_miss_counter(PERF_COUNT_HW_CACHE_DTLB) : -1;
+    int last_sample = -COVERAGE_SAMPLE_OPS;
+
     // Send each request to the heap allocator and check the resulting behavior
     for (int req = 0; req < script->num_ops; req++)
     {
@@ -204,10 +542,7 @@ static size_t eval_correctness(script_t *script, bool quiet, bool *success)
             }
 
             cur_size += requested_size;
-            if ((char *)p + requested_size > (char *)heap_end)
-            {
-                heap_end = (char *)p + requested_size;
-            }
+            note_extent(p, requested_size, &heap_end, &heap_top);
         }
         else if (script->ops[req].op == REALLOC)
         {
@@ -220,10 +555,7 @@ static size_t eval_correctness(script_t *script, bool quiet, bool *success)
             }
 
             cur_size += (requested_size - old_size);
-            if ((char *)p + requested_size > (char *)heap_end)
-            {
-                heap_end = (char *)p + requested_size;
-            }
+            note_extent(p, requested_size, &heap_end, &heap_top);
         }
         else if (script->ops[req].op == FREE)
         {
@@ -237,7 +569,9 @@ static size_t eval_correctness(script_t *script, bool quiet, bool *success)
                 return -1;
             }
             script->blocks[id] = (block_t){.ptr = NULL, .size = 0};
+            uint64_t start = now_ns(), start_cycles = now_cycles();
             myfree(p);
+            record_call(script, FREE, start, start_cycles);
             cur_size -= old_size;
         }
 
@@ -252,8 +586,16 @@ static size_t eval_correctness(script_t *script, bool quiet, bool *success)
         if (cur_size > script->peak_size)
         {
             script->peak_size = cur_size;
+            if (script->perf && req - last_sample >= COVERAGE_SAMPLE_OPS &&
+                hugepage_coverage(&script->peak_rss, &script->peak_huge))
+            {
+                last_sample = req;
+            }
         }
     }
+    script->l1d_misses = script->perf ? close_counter(l1d_fd) : -1;
+    script->llc_misses = script->perf ? close_counter(llc_fd) : -1;
+    script->tlb_misses = script->perf ? close_counter(tlb_fd) : -1;
 
     // verify payload is still intact for any block still allocated
     for (int id = 0; id < script->num_ids; id++)
@@ -266,7 +608,27 @@ static size_t eval_correctness(script_t *script, bool quiet, bool *success)
     }
 
     *success = true;
-    return (char *)heap_end - (char *)heap_segment_start();
+    return ((char *)heap_end - (char *)heap_segment_start()) +
+           ((char *)heap_segment_start() + heap_segment_size() - (char *)heap_top);
+}
+
+/* Function: note_extent
+ * ---------------------
+ * Widens the part of the segment in use to cover a block: a block in the
+ * lower half of the segment raises heap_end to its end, and a block in the
+ * upper half lowers heap_top to its start.
+ */
+static void note_extent(void *ptr, size_t size, void **heap_end, void **heap_top)
+{
+    char *middle = (char *)heap_segment_start() + heap_segment_size() / 2;
+    if ((char *)ptr < middle && (char *)ptr + size > (char *)*heap_end)
+    {
+        *heap_end = (char *)ptr + size;
+    }
+    else if ((char *)ptr >= middle && ptr < *heap_top)
+    {
+        *heap_top = ptr;
+    }
 }
 
 /* Function: eval_malloc
@@ -286,7 +648,17 @@ static void *eval_malloc(int req, size_t requested_size, script_t *script,
     int id = script->ops[req].id;
 
     void *p;
-    if ((p = mymalloc(requested_size)) == NULL && requested_size != 0)
+    uint64_t start = now_ns(), start_cycles = now_cycles();
+    if (script->malloc_flags != 0)
+    {
+        p = mymalloc_flags(requested_size, script->malloc_flags);
+    }
+    else
+    {
+        p = mymalloc(requested_size);
+    }
+    record_call(script, ALLOC, start, start_cycles);
+    if (p == NULL && requested_size != 0)
     {
         allocator_error(script, script->ops[req].lineno,
                         "heap exhausted, malloc returned NULL");
@@ -303,6 +675,24 @@ static void *eval_malloc(int req, size_t requested_size, script_t *script,
         return NULL;
     }
 
+    // MALLOC_ZERO must be honored; MALLOC_HOT is a hint, so only counted
+    if ((script->malloc_flags & MALLOC_ZERO) && requested_size > 0)
+    {
+        unsigned char *bytes = p;
+        if (bytes[0] != 0 || memcmp(bytes, bytes + 1, requested_size - 1) != 0)
+        {
+            allocator_error(script, script->ops[req].lineno,
+                            "New block (%p) was not zeroed despite MALLOC_ZERO", p);
+            *failptr = true;
+            return NULL;
+        }
+    }
+    if ((script->malloc_flags & MALLOC_HOT) && p != NULL)
+    {
+        script->hot_blocks++;
+        script->hot_aligned += ((uintptr_t)p % CACHE_LINE_SIZE == 0);
+    }
+
     /* Fill new block with the low-order byte of new id
      * can be used later to verify data copied when realloc'ing.
      */
@@ -338,7 +728,10 @@ static void *eval_realloc(int req, size_t requested_size, script_t *script,
     }
 
     void *newp;
-    if ((newp = myrealloc(oldp, requested_size)) == NULL && requested_size != 0)
+    uint64_t start = now_ns(), start_cycles = now_cycles();
+    newp = myrealloc(oldp, requested_size);
+    record_call(script, REALLOC, start, start_cycles);
+    if (newp == NULL && requested_size != 0)
     {
         allocator_error(script, script->ops[req].lineno,
                         "heap exhausted, realloc returned NULL");
@@ -403,6 +796,15 @@ static bool verify_block(void *ptr, size_t size, script_t *script, int lineno)
         return false;
     }
 
+    // usable size, if the allocator tracks it, must cover the request
+    size_t usable = myusable_size(ptr);
+    if (usable != 0 && usable < size)
+    {
+        allocator_error(script, lineno, "New block (%p) has usable size %zu < %zu requested",
+                        ptr, usable, size);
+        return false;
+    }
+
     // block must not overlap any other blocks
     for (int i = 0; i < script->num_ids; i++)
     {
@@ -447,6 +849,209 @@ static bool verify_payload(void *ptr, size_t size, int id, script_t *script,
     return true;
 }
 
+/* Function: now_ns
+ * ----------------
+ * Returns a monotonic timestamp in nanoseconds, used to time allocator calls.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Function: now_cycles
+ * --------------------
+ * Returns the CPU timestamp counter, used for worst-case call latency.  On
+ * machines without one, falls back to nanoseconds.
+ */
+static uint64_t now_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+/* Function: record_call
+ * ---------------------
+ * Adds the time since start_ns to the script's total allocator time and
+ * keeps the largest cycle count seen for this request type.  Cycles are
+ * read first so the clock_gettime call stays outside the measured window.
+ */
+static void record_call(script_t *script, enum request_type op, uint64_t start_ns,
+                        uint64_t start_cycles)
+{
+    uint64_t cycles = now_cycles() - start_cycles;
+    script->op_ns += now_ns() - start_ns;
+    if (cycles > script->worst_cycles[op])
+    {
+        script->worst_cycles[op] = cycles;
+    }
+    script->cycle_counts[op][cycle_bucket(cycles)]++;
+}
+
+/* Function: cycle_bucket
+ * ----------------------
+ * Returns the bucket counting calls of this many cycles: counts below 8
+ * have a bucket each, and every power of two above is split into 8.
+ */
+static int cycle_bucket(uint64_t cycles)
+{
+    if (cycles < 8)
+    {
+        return cycles;
+    }
+    int shift = 63 - __builtin_clzll(cycles) - 3;
+    return (shift + 1) * 8 + ((cycles >> shift) & 7);
+}
+
+/* Function: cycle_percentile
+ * --------------------------
+ * Returns the upper end of the bucket holding the given fraction of the
+ * counted calls, but no more than the worst call, or 0 if there were none.
+ */
+static uint64_t cycle_percentile(const uint64_t counts[CYCLE_BUCKETS], uint64_t worst,
+                                 double fraction)
+{
+    uint64_t total = 0;
+    for (int b = 0; b < CYCLE_BUCKETS; b++)
+    {
+        total += counts[b];
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < CYCLE_BUCKETS && total > 0; b++)
+    {
+        seen += counts[b];
+        if (seen >= fraction * total)
+        {
+            if (b < 8)
+            {
+                return b;
+            }
+            int shift = b / 8 - 1;
+            uint64_t upper = ((uint64_t)(8 + b % 8 + 1) << shift) - 1;
+            return upper < worst ? upper : worst;
+        }
+    }
+    return 0;
+}
+
+/* Function: print_percentiles
+ * ---------------------------
+ * Prints the label and then the 99.9th percentile of cycles for malloc,
+ * realloc and free, separated by slashes, from per-type cycle buckets and
+ * worst cases.
+ */
+static void print_percentiles(const char *label, uint64_t counts[][CYCLE_BUCKETS],
+                              const uint64_t worst[])
+{
+    printf("%s%" PRIu64 "/%" PRIu64 "/%" PRIu64, label,
+           cycle_percentile(counts[ALLOC], worst[ALLOC], 0.999),
+           cycle_percentile(counts[REALLOC], worst[REALLOC], 0.999),
+           cycle_percentile(counts[FREE], worst[FREE], 0.999));
+}
+
+/* Function: open_miss_counter
+ * ----------------------------
+ * Opens and starts a counter of this process's load misses in user mode in
+ * the given cache, one of the PERF_COUNT_HW_CACHE_* ids such as the L1 data
+ * cache or the data TLB.  Returns its file descriptor, or -1 if the kernel
+ * or machine offers no such counter (as in many virtual machines).
+ */
+static int open_miss_counter(unsigned cache)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Function: close_counter
+ * -----------------------
+ * Stops and closes a counter from open_miss_counter and returns its count,
+ * or -1 if fd is -1 or the count cannot be read.
+ */
+static long long close_counter(int fd)
+{
+    if (fd < 0)
+    {
+        return -1;
+    }
+    long long count;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+    {
+        count = -1;
+    }
+    close(fd);
+    return count;
+}
+
+/* Function: print_count
+ * ----------------------
+ * Prints a counter from close_counter after its label, or that it is
+ * unavailable if the count is -1.
+ */
+static void print_count(const char *label, long long count)
+{
+    if (count >= 0)
+    {
+        printf("%s = %lld", label, count);
+    }
+    else
+    {
+        printf("%s unavailable", label);
+    }
+}
+
+/* Function: hugepage_coverage
+ * ---------------------------
+ * Sums the Rss and AnonHugePages lines of /proc/self/smaps over the
+ * mappings inside the heap segment, which madvise may have split, and
+ * stores them in bytes.  Returns false if smaps cannot be read.
+ */
+static bool hugepage_coverage(size_t *rss, size_t *huge)
+{
+    FILE *fp = fopen("/proc/self/smaps", "r");
+    if (fp == NULL)
+    {
+        return false;
+    }
+    uintptr_t seg_start = (uintptr_t)heap_segment_start();
+    uintptr_t seg_end = seg_start + heap_segment_size();
+    bool inside = false;
+    size_t rss_kb = 0;
+    size_t huge_kb = 0;
+    char line[MAX_SCRIPT_LINE_LEN];
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        unsigned long start, end, kb;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+        {
+            inside = start >= seg_start && end <= seg_end;
+        }
+        else if (inside && sscanf(line, "Rss: %lu kB", &kb) == 1)
+        {
+            rss_kb += kb;
+        }
+        else if (inside && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+        {
+            huge_kb += kb;
+        }
+    }
+    fclose(fp);
+    *rss = rss_kb << 10;
+    *huge = huge_kb << 10;
+    return true;
+}
+
 /* Function: allocator_error
  * ------------------------
  * Report an error while running an allocator script.  Prints out the script
@@ -483,7 +1088,8 @@ static script_t parse_script(const char *path)
     }
 
     // Initialize a script object to store the information about this script
-    script_t script = {.ops = NULL, .blocks = NULL, .num_ops = 0, .peak_size = 0};
+    script_t script = {.ops = NULL, .blocks = NULL, .num_ops = 0, .peak_size = 0, .op_ns = 0,
+                       .worst_cycles = {0}};
     const char *basename = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
     strncpy(script.name, basename, sizeof(script.name) - 1);
     script.name[sizeof(script.name) - 1] = '\0';
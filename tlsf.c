@@ -0,0 +1,492 @@
+/* File: tlsf.c
+ * ------------
+ * A Two-Level Segregated Fit allocator. Free blocks are kept in one list
+ * per size class, where a class is a power-of-two range (first level) cut
+ * into SL_COUNT equal slices (second level). A bitmap per level records
+ * which lists are non-empty, so finding a block at least as large as a
+ * request is two bit scans, and every operation runs in constant time with
+ * no list walks.
+ *
+ * Blocks carry a one-word header holding the size and two flags: whether
+ * the block is free, and whether the block just before it is free. Free
+ * blocks also store their size in their last word (a boundary tag), so
+ * free can find and merge the previous block in O(1).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "./allocator.h"
+#include "./debug_break.h"
+
+// second-level lists per first-level range
+#define SL_LOG2 4
+#define SL_COUNT (1 << SL_LOG2)
+// sizes below SMALL_BLOCK all share first level 0, in ALIGNMENT steps
+#define FL_SHIFT (SL_LOG2 + 3)
+#define SMALL_BLOCK (1UL << FL_SHIFT)
+// blocks are smaller than 2^FL_MAX bytes (the segment is capped there)
+#define FL_MAX 32
+#define FL_COUNT (FL_MAX - FL_SHIFT + 1)
+
+#define HDR_SIZE sizeof(size_t)
+#define FLAG_FREE 1UL
+#define FLAG_PREV_FREE 2UL
+#define FLAG_REALLOC 4UL        // realloc-heavy block that keeps its slack
+#define FLAG_MASK (ALIGNMENT - 1)
+// header, two list links and the boundary tag of a free block
+#define MIN_BLOCK (4 * HDR_SIZE)
+
+typedef struct free_block {
+    size_t header;
+    struct free_block *next;
+    struct free_block *prev;
+} free_block_t;
+
+static uint8_t *heap_lo;
+static uint8_t *heap_hi;          // address of the epilogue header
+static uint32_t g_fl_bitmap;
+static uint32_t g_sl_bitmap[FL_COUNT];
+static free_block_t *g_lists[FL_COUNT][SL_COUNT];
+
+
+// Header access
+static inline size_t blk_size(const void *hdr) {
+    return *(const size_t *)hdr & ~(size_t)FLAG_MASK;
+}
+
+static inline bool blk_free(const void *hdr) {
+    return *(const size_t *)hdr & FLAG_FREE;
+}
+
+static inline bool blk_prev_free(const void *hdr) {
+    return *(const size_t *)hdr & FLAG_PREV_FREE;
+}
+
+static inline void blk_set(void *hdr, size_t size, size_t flags) {
+    *(size_t *)hdr = size | flags;
+}
+
+static inline uint8_t *blk_next(void *hdr) {
+    return (uint8_t *)hdr + blk_size(hdr);
+}
+
+// previous block, only valid when this block's FLAG_PREV_FREE is set
+static inline uint8_t *blk_prev(void *hdr) {
+    size_t prev_size = *((size_t *)hdr - 1);
+    return (uint8_t *)hdr - prev_size;
+}
+
+static inline void set_prev_free(void *hdr, bool prev_free) {
+    if (prev_free) {
+        *(size_t *)hdr |= FLAG_PREV_FREE;
+    } else {
+        *(size_t *)hdr &= ~FLAG_PREV_FREE;
+    }
+}
+
+// marks a block free, writes its boundary tag and tells the next block
+static inline void mark_free(void *hdr, size_t size) {
+    blk_set(hdr, size, FLAG_FREE | (*(size_t *)hdr & FLAG_PREV_FREE));
+    *(size_t *)((uint8_t *)hdr + size - HDR_SIZE) = size;
+    set_prev_free((uint8_t *)hdr + size, true);
+}
+
+// marks a block allocated, keeping FLAG_REALLOC, which a free block never has
+static inline void mark_alloc(void *hdr, size_t size) {
+    blk_set(hdr, size, *(size_t *)hdr & (FLAG_PREV_FREE | FLAG_REALLOC));
+    set_prev_free((uint8_t *)hdr + size, false);
+}
+
+static inline void *payload_of(void *hdr) {
+    return (uint8_t *)hdr + HDR_SIZE;
+}
+
+static inline uint8_t *hdr_of(void *payload) {
+    return (uint8_t *)payload - HDR_SIZE;
+}
+
+// Block size (header included) for a request, or 0 if too large
+static inline size_t block_size_for(size_t requested_size) {
+    if (requested_size > MAX_REQUEST_SIZE) {
+        return 0;
+    }
+    size_t size = (requested_size + HDR_SIZE + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+    return size < MIN_BLOCK ? MIN_BLOCK : size;
+}
+
+static inline int msb(size_t x) {
+    return 63 - __builtin_clzl(x);
+}
+
+// Size class holding blocks of exactly this size
+static void mapping_insert(size_t size, int *fl, int *sl) {
+    if (size < SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size / (SMALL_BLOCK / SL_COUNT);
+    } else {
+        int f = msb(size);
+        *sl = (size >> (f - SL_LOG2)) ^ SL_COUNT;
+        *fl = f - FL_SHIFT + 1;
+    }
+}
+
+// Smallest class whose every block holds at least size bytes
+static void mapping_search(size_t size, int *fl, int *sl) {
+    if (size >= SMALL_BLOCK) {
+        size += (1UL << (msb(size) - SL_LOG2)) - 1;
+    }
+    mapping_insert(size, fl, sl);
+}
+
+// Free lists
+static void list_insert(void *hdr) {
+    int fl, sl;
+    mapping_insert(blk_size(hdr), &fl, &sl);
+    free_block_t *b = hdr;
+    b->prev = NULL;
+    b->next = g_lists[fl][sl];
+    if (b->next != NULL) {
+        b->next->prev = b;
+    }
+    g_lists[fl][sl] = b;
+    g_fl_bitmap |= 1U << fl;
+    g_sl_bitmap[fl] |= 1U << sl;
+}
+
+static void list_remove(void *hdr) {
+    int fl, sl;
+    mapping_insert(blk_size(hdr), &fl, &sl);
+    free_block_t *b = hdr;
+    if (b->prev != NULL) {
+        b->prev->next = b->next;
+    } else {
+        g_lists[fl][sl] = b->next;
+    }
+    if (b->next != NULL) {
+        b->next->prev = b->prev;
+    }
+    if (g_lists[fl][sl] == NULL) {
+        g_sl_bitmap[fl] &= ~(1U << sl);
+        if (g_sl_bitmap[fl] == 0) {
+            g_fl_bitmap &= ~(1U << fl);
+        }
+    }
+}
+
+// Head of the first non-empty list in class (fl, sl) or above, or NULL
+static free_block_t *find_suitable(int fl, int sl) {
+    if (fl >= FL_COUNT) {
+        return NULL;
+    }
+    uint32_t sl_map = g_sl_bitmap[fl] & (~0U << sl);
+    if (sl_map == 0) {
+        uint64_t fl_map = g_fl_bitmap & (~0UL << (fl + 1));
+        if (fl_map == 0) {
+            return NULL;
+        }
+        fl = __builtin_ctzl(fl_map);
+        sl_map = g_sl_bitmap[fl];
+    }
+    return g_lists[fl][__builtin_ctz(sl_map)];
+}
+
+// Trims an allocated block to size, freeing the tail if it is big enough
+// (merging it into a free block that follows)
+static void trim(uint8_t *hdr, size_t size) {
+    size_t rem = blk_size(hdr) - size;
+    if (rem < MIN_BLOCK) {
+        return;
+    }
+    blk_set(hdr, size, *(size_t *)hdr & (FLAG_PREV_FREE | FLAG_REALLOC));
+    uint8_t *tail = hdr + size;
+    uint8_t *next = tail + rem;
+    blk_set(tail, rem, 0);
+    if (blk_free(next)) {
+        list_remove(next);
+        rem += blk_size(next);
+    }
+    mark_free(tail, rem);
+    list_insert(tail);
+}
+
+
+// no tunable options
+bool myconfig(const char *key, const char *value) {
+    return false;
+}
+
+/* Function: myinit
+ * ----------------
+ * Sets up the whole segment (capped below 2^FL_MAX bytes) as one free block
+ * followed by a zero-size allocated epilogue header.
+ */
+bool myinit(void *heap_start, size_t heap_size) {
+    if (heap_start == NULL) {
+        return false;
+    }
+    if (heap_size >= (1UL << FL_MAX)) {
+        heap_size = (1UL << FL_MAX) - ALIGNMENT;
+    }
+    heap_size &= ~(size_t)(ALIGNMENT - 1);
+    if (heap_size < MIN_BLOCK + HDR_SIZE) {
+        return false;
+    }
+    heap_lo = heap_start;
+    heap_hi = heap_lo + heap_size - HDR_SIZE;
+    g_fl_bitmap = 0;
+    memset(g_sl_bitmap, 0, sizeof(g_sl_bitmap));
+    memset(g_lists, 0, sizeof(g_lists));
+
+    blk_set(heap_hi, 0, 0);
+    blk_set(heap_lo, heap_hi - heap_lo, 0);
+    mark_free(heap_lo, heap_hi - heap_lo);
+    list_insert(heap_lo);
+    return true;
+}
+
+/* Function: mymalloc
+ * ------------------
+ * Takes the head of the first non-empty list in the smallest class that
+ * fully fits the request (good fit, no search) and splits off the excess.
+ */
+void *mymalloc(size_t requested_size) {
+    size_t size = block_size_for(requested_size);
+    if (requested_size == 0 || size == 0 || heap_lo == NULL) {
+        return NULL;
+    }
+    int fl, sl;
+    mapping_search(size, &fl, &sl);
+    free_block_t *b = find_suitable(fl, sl);
+    if (b == NULL) {
+        return NULL;
+    }
+    list_remove(b);
+    mark_alloc(b, blk_size(b));
+    trim((uint8_t *)b, size);
+    return payload_of(b);
+}
+
+// Allocation step of mymalloc_flags: realloc-heavy blocks are flagged to
+// keep their slack through myrealloc
+static void *malloc_hinted(size_t size, unsigned flags) {
+    void *ptr = mymalloc(size);
+    if (ptr != NULL && (flags & MALLOC_REALLOC_HEAVY)) {
+        *(size_t *)hdr_of(ptr) |= FLAG_REALLOC;
+    }
+    return ptr;
+}
+
+/* Function: mymalloc_flags
+ * ------------------------
+ * Reserves slack for realloc-heavy blocks and zeroes on request. Blocks
+ * are not cache-line aligned, so MALLOC_HOT is ignored.
+ */
+void *mymalloc_flags(size_t requested_size, unsigned flags) {
+    return malloc_flagged(malloc_hinted, requested_size, flags);
+}
+
+/* Function: myfree
+ * ----------------
+ * Merges the block with free neighbours on either side, found through the
+ * next block's header and the previous block's boundary tag.
+ */
+void myfree(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    uint8_t *hdr = hdr_of(ptr);
+    if (hdr < heap_lo || hdr >= heap_hi || blk_free(hdr)) {
+        return;
+    }
+    size_t size = blk_size(hdr);
+    uint8_t *next = hdr + size;
+    if (blk_free(next)) {
+        list_remove(next);
+        size += blk_size(next);
+    }
+    if (blk_prev_free(hdr)) {
+        uint8_t *prev = blk_prev(hdr);
+        list_remove(prev);
+        size += blk_size(prev);
+        hdr = prev;
+    }
+    mark_free(hdr, size);
+    list_insert(hdr);
+}
+
+/* Function: myrealloc
+ * -------------------
+ * Shrinks in place, or grows in place into a free next block when the two
+ * together are large enough; otherwise falls back to malloc/copy/free.
+ */
+void *myrealloc(void *old_ptr, size_t new_size) {
+    if (old_ptr == NULL) {
+        return mymalloc(new_size);
+    }
+    if (new_size == 0) {
+        myfree(old_ptr);
+        return NULL;
+    }
+    size_t size = block_size_for(new_size);
+    if (size == 0) {
+        return NULL;
+    }
+    uint8_t *hdr = hdr_of(old_ptr);
+    size_t old_size = blk_size(hdr);
+    // a realloc-heavy block keeps its slack: it is trimmed only beyond it,
+    // and reserves it again when it has to move
+    bool heavy = (*(size_t *)hdr & FLAG_REALLOC) != 0;
+    size_t keep = heavy ? block_size_for(realloc_reserve(new_size)) : size;
+    if (size <= old_size) {
+        if (keep < old_size) {
+            trim(hdr, keep);
+        }
+        return old_ptr;
+    }
+
+    uint8_t *next = hdr + old_size;
+    if (blk_free(next) && old_size + blk_size(next) >= size) {
+        list_remove(next);
+        mark_alloc(hdr, old_size + blk_size(next));
+        if (keep < blk_size(hdr)) {
+            trim(hdr, keep);
+        }
+        return old_ptr;
+    }
+
+    void *new_ptr = heavy ? mymalloc_flags(new_size, MALLOC_REALLOC_HEAVY) : mymalloc(new_size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, old_ptr, old_size - HDR_SIZE);
+    myfree(old_ptr);
+    return new_ptr;
+}
+
+size_t myusable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    uint8_t *hdr = hdr_of(ptr);
+    if (hdr < heap_lo || hdr >= heap_hi || blk_free(hdr)) {
+        return 0;
+    }
+    return blk_size(hdr) - HDR_SIZE;
+}
+
+// Checks that a free block is reachable from the list of its size class
+static bool listed(free_block_t *b) {
+    int fl, sl;
+    mapping_insert(blk_size(b), &fl, &sl);
+    for (free_block_t *cur = g_lists[fl][sl]; cur != NULL; cur = cur->next) {
+        if (cur == b) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Function: validate_heap
+ * -----------------------
+ * Walks every block checking sizes, boundary tags, the prev-free flags and
+ * that no two free blocks touch, then checks each list's links, classes and
+ * bitmap bits, and that the lists hold exactly the free blocks.
+ */
+bool validate_heap() {
+    if (heap_lo == NULL) {
+        return false;
+    }
+    size_t nfree = 0;
+    bool prev_free = false;
+    uint8_t *hdr = heap_lo;
+    while (hdr < heap_hi) {
+        size_t size = blk_size(hdr);
+        if (size < MIN_BLOCK || size % ALIGNMENT != 0 || size > (size_t)(heap_hi - hdr)) {
+            printf("block %p has bad size %zu\n", hdr, size);
+            breakpoint();
+            return false;
+        }
+        if (blk_prev_free(hdr) != prev_free) {
+            printf("block %p has a stale prev-free flag\n", hdr);
+            breakpoint();
+            return false;
+        }
+        if (blk_free(hdr)) {
+            if (prev_free || *(size_t *)(hdr + size - HDR_SIZE) != size) {
+                printf("free block %p is uncoalesced or has a bad boundary tag\n", hdr);
+                breakpoint();
+                return false;
+            }
+            nfree++;
+        }
+        prev_free = blk_free(hdr);
+        hdr += size;
+    }
+    if (hdr != heap_hi || blk_size(heap_hi) != 0 || blk_prev_free(heap_hi) != prev_free) {
+        printf("heap walk does not end at the epilogue\n");
+        breakpoint();
+        return false;
+    }
+
+    size_t nlisted = 0;
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        if (((g_fl_bitmap >> fl) & 1) != (g_sl_bitmap[fl] != 0)) {
+            printf("first-level bit %d disagrees with second level\n", fl);
+            breakpoint();
+            return false;
+        }
+        for (int sl = 0; sl < SL_COUNT; sl++) {
+            if (((g_sl_bitmap[fl] >> sl) & 1) != (g_lists[fl][sl] != NULL)) {
+                printf("bitmap bit (%d, %d) disagrees with its list\n", fl, sl);
+                breakpoint();
+                return false;
+            }
+            free_block_t *prev = NULL;
+            for (free_block_t *b = g_lists[fl][sl]; b != NULL; b = b->next) {
+                int bfl, bsl;
+                if ((uint8_t *)b < heap_lo || (uint8_t *)b >= heap_hi || !blk_free(b) ||
+                    b->prev != prev || ++nlisted > nfree) {
+                    printf("list (%d, %d) is corrupt at %p\n", fl, sl, b);
+                    breakpoint();
+                    return false;
+                }
+                mapping_insert(blk_size(b), &bfl, &bsl);
+                if (bfl != fl || bsl != sl) {
+                    printf("free block %p is in the wrong list\n", b);
+                    breakpoint();
+                    return false;
+                }
+                prev = b;
+            }
+        }
+    }
+    if (nlisted != nfree) {
+        printf("%zu free blocks but %zu listed\n", nfree, nlisted);
+        breakpoint();
+        return false;
+    }
+    return true;
+}
+
+/* Function: dump_heap
+ * -------------------
+ * This function is not called anywhere, but is useful from gdb. It prints
+ * every block in address order with its flags and size class.
+ */
+void dump_heap(void) {
+    if (heap_lo == NULL) {
+        printf("HEAP not initialized\n");
+        return;
+    }
+    printf("HEAP [%p .. %p) fl_bitmap=0x%08x\n", heap_lo, heap_hi, g_fl_bitmap);
+    size_t idx = 0;
+    for (uint8_t *hdr = heap_lo; hdr < heap_hi && blk_size(hdr) > 0; hdr = blk_next(hdr)) {
+        int fl, sl;
+        mapping_insert(blk_size(hdr), &fl, &sl);
+        printf("#%04zu off=%10zu size=%10zu class=(%2d,%2d) %s%s%s\n", idx++,
+               (size_t)(hdr - heap_lo), blk_size(hdr), fl, sl,
+               blk_free(hdr) ? "FREE" : "ALLOC", blk_prev_free(hdr) ? " prev-free" : "",
+               blk_free(hdr) && !listed((free_block_t *)hdr) ? " UNLISTED" : "");
+    }
+}
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""Trace-driven tuner for the explicit allocator.
+
+Replays a set of scripts through test_explicit with different myconfig
+settings (passed as -c key=value), scores each configuration on utilization
+and time per request, and coordinate-descends over the knobs below until no
+single change improves the score.  The best configuration is written as a
+header of #defines that explicit.c picks up when built with USE_TUNED_CONFIG
+(see the test_explicit_tuned target in the Makefile).
+
+usage: tune.py [-b binary] [-o header] [-w time_weight] [-r rounds] script...
+"""
+
+import argparse
+import math
+import re
+import subprocess
+import sys
+
+POLICIES = {"first": "FIT_FIRST", "next": "FIT_NEXT", "best": "FIT_BEST",
+            "good": "FIT_GOOD", "seg": "FIT_SEGREGATED"}
+
+# Candidate size-class boundaries (bytes); the last class is unbounded
+CLASS_SETS = [
+    "32:48:64:96:128:192:256:512:1024:2048:4096:8192:16384:65536:262144:1048576",
+    "32:64:128:256:512:1024:2048:4096:8192:16384:32768:65536",
+    "64:256:1024:4096:16384:65536",
+    "24:32:40:48:56:64:80:96:112:128:160:192:224:256:384:512:1024:4096",
+]
+
+# Knobs in the order they are descended; the first value is the default
+KNOBS = [
+    ("policy", list(POLICIES)),
+    ("goodfit_k", ["8", "2", "4", "16", "32"]),
+    ("classes", CLASS_SETS),
+    ("split", ["0", "32", "64", "128"]),
+    ("quick_depth", ["0", "4", "16", "64"]),
+    ("coalesce", ["imm", "def"]),
+    ("coalesce_after", ["0", "64", "256", "1024"]),
+]
+
+UTIL_RE = re.compile(r"Utilization averaged (\d+)%")
+TIME_RE = re.compile(r"([\d.]+) ns/op")
+
+
+def measure(binary, scripts, config):
+    """Runs the scripts once under config, returns (utilization %, ns/op) or
+    None if the allocator failed on any of them."""
+    cmd = [binary, "-q", "-t"]
+    for key, value in config.items():
+        cmd += ["-c", "%s=%s" % (key, value)]
+    out = subprocess.run(cmd + scripts, capture_output=True, text=True)
+    util = UTIL_RE.search(out.stdout)
+    times = [float(t) for t in TIME_RE.findall(out.stdout)]
+    if out.returncode != 0 or util is None or len(times) != len(scripts):
+        return None
+    # geometric mean so that one long trace does not dominate the time term
+    ns = math.exp(sum(math.log(max(t, 1e-3)) for t in times) / len(times))
+    return int(util.group(1)), ns
+
+
+def tune(binary, scripts, time_weight, rounds):
+    """Coordinate descent over KNOBS; returns (config, util, ns, score)."""
+    config = {key: values[0] for key, values in KNOBS}
+    base = measure(binary, scripts, config)
+    if base is None:
+        sys.exit("tune.py: default configuration failed, is %s built?" % binary)
+    base_ns = base[1]
+
+    # utilization scaled by relative speed: with weight w, halving the time
+    # per request is worth the same as a factor 2**w more utilization
+    def score(result):
+        util, ns = result
+        return util * (base_ns / ns) ** time_weight
+
+    best = (base, score(base))
+    for _ in range(rounds):
+        improved = False
+        for key, values in KNOBS:
+            for value in values:
+                if value == config[key]:
+                    continue
+                trial = dict(config, **{key: value})
+                result = measure(binary, scripts, trial)
+                if result is None:
+                    continue
+                print("%-60s util %3d%% %9.1f ns/op score %6.2f" %
+                      (" ".join("%s=%s" % kv for kv in trial.items())[:60],
+                       result[0], result[1], score(result)), file=sys.stderr)
+                if score(result) > best[1]:
+                    config, best, improved = trial, (result, score(result)), True
+        if not improved:
+            break
+    (util, ns), best_score = best
+    return config, util, ns, best_score
+
+
+def write_header(path, config, util, ns, best_score, scripts):
+    classes = config["classes"].split(":")
+    lines = [
+        "// Generated by tune.py -- do not edit. Rerun `make tune` to refresh.",
+        "// Trained on: %s" % " ".join(scripts),
+        "// Utilization %d%%, %.1f ns/op, score %.2f" % (util, ns, best_score),
+        "#define FIT_POLICY %s" % POLICIES[config["policy"]],
+        "#define GOOD_FIT_K %s" % config["goodfit_k"],
+        "#define SPLIT_THRESHOLD %s" % config["split"],
+        "#define QUICK_DEPTH %s" % config["quick_depth"],
+        "#define COALESCE_DEFERRED %d" % (config["coalesce"] == "def"),
+        "#define COALESCE_AFTER %s" % config["coalesce_after"],
+        "#define SIZE_CLASSES %s" % ", ".join(classes),
+    ]
+    with open(path, "w") as f:
+        f.write("\n".join(lines) + "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-b", "--binary", default="./test_explicit")
+    parser.add_argument("-o", "--output", default="explicit_tuned.h")
+    parser.add_argument("-w", "--time-weight", type=float, default=0.1,
+                        help="weight of speed against utilization (0 = ignore time)")
+    parser.add_argument("-r", "--rounds", type=int, default=2)
+    parser.add_argument("scripts", nargs="+")
+    args = parser.parse_args()
+
+    config, util, ns, best_score = tune(args.binary, args.scripts,
+                                        args.time_weight, args.rounds)
+    write_header(args.output, config, util, ns, best_score, args.scripts)
+    print("%s: %s (util %d%%, %.1f ns/op)" %
+          (args.output, " ".join("%s=%s" % kv for kv in config.items()), util, ns))
+
+
+if __name__ == "__main__":
+    main()